@@ -0,0 +1,247 @@
+// CameraWatchdog.cpp
+#include "CameraWatchdog.h"
+
+#include <algorithm>
+#include <iostream>
+#include <thread>
+#include <pylon/FeaturePersistence.h>
+#include "MemoryBudget.h"
+#include "MetricsRegistry.h"
+
+using namespace Pylon;
+using namespace std;
+
+// Reconnect attempts start 100 ms apart and back off to at most one every 5 s.
+static const unsigned c_reconnectFirstDelayMs = 100;
+static const unsigned c_reconnectMaxDelayMs = 5000;
+static const unsigned c_reconnectStopPollMs = 50;
+
+CPooledBufferFactory::CPooledBufferFactory()
+    : m_allocations( 0 )
+    , m_reuses( 0 )
+    , m_pBuffersGauge( NULL )
+    , m_pBytesGauge( NULL )
+    , m_pInUseGauge( NULL )
+    , m_pAccount( NULL )
+{
+}
+
+CPooledBufferFactory::~CPooledBufferFactory()
+{
+    for (size_t i = 0; i < m_buffers.size(); ++i)
+    {
+        delete[] m_buffers[i].pData;
+        if (m_pAccount != NULL)
+        {
+            m_pAccount->Release( m_buffers[i].size );
+        }
+    }
+}
+
+void CPooledBufferFactory::AllocateBuffer( size_t bufferSize, void** pCreatedBuffer, intptr_t& bufferContext )
+{
+    std::lock_guard<std::mutex> lock( m_mutex );
+    for (size_t i = 0; i < m_buffers.size(); ++i)
+    {
+        if (!m_buffers[i].inUse && m_buffers[i].size >= bufferSize)
+        {
+            m_buffers[i].inUse = true;
+            *pCreatedBuffer = m_buffers[i].pData;
+            bufferContext = (intptr_t) i;
+            ++m_reuses;
+            UpdateGauges();
+            return;
+        }
+    }
+    Buffer buffer;
+    if (m_pAccount != NULL)
+    {
+        m_pAccount->Charge( bufferSize );
+    }
+    buffer.pData = new uint8_t[bufferSize];
+    buffer.size = bufferSize;
+    buffer.inUse = true;
+    m_buffers.push_back( buffer );
+    *pCreatedBuffer = buffer.pData;
+    bufferContext = (intptr_t) (m_buffers.size() - 1);
+    ++m_allocations;
+    UpdateGauges();
+}
+
+void CPooledBufferFactory::FreeBuffer( void* /*pCreatedBuffer*/, intptr_t bufferContext )
+{
+    // Keep the memory; it is handed out again on the next StartGrabbing().
+    std::lock_guard<std::mutex> lock( m_mutex );
+    m_buffers[(size_t) bufferContext].inUse = false;
+    UpdateGauges();
+}
+
+void CPooledBufferFactory::DestroyBufferFactory()
+{
+}
+
+size_t CPooledBufferFactory::Allocations() const
+{
+    std::lock_guard<std::mutex> lock( m_mutex );
+    return m_allocations;
+}
+
+size_t CPooledBufferFactory::Reuses() const
+{
+    std::lock_guard<std::mutex> lock( m_mutex );
+    return m_reuses;
+}
+
+void CPooledBufferFactory::AttachMetrics( CMetricsRegistry& registry, const std::string& labels )
+{
+    std::lock_guard<std::mutex> lock( m_mutex );
+    m_pBuffersGauge = &registry.Gauge( "robot_grab_buffers", "Grab buffers owned by the camera's pool.", labels );
+    m_pBytesGauge = &registry.Gauge( "robot_grab_buffer_bytes", "Memory of the camera's grab buffer pool.", labels );
+    m_pInUseGauge = &registry.Gauge( "robot_grab_buffers_in_use", "Grab buffers currently handed to pylon.", labels );
+    UpdateGauges();
+}
+
+void CPooledBufferFactory::AttachBudget( CMemoryBudget& budget )
+{
+    std::lock_guard<std::mutex> lock( m_mutex );
+    m_pAccount = &budget.Account( "grab.buffers" );
+    for (size_t i = 0; i < m_buffers.size(); ++i)
+    {
+        m_pAccount->Charge( m_buffers[i].size );
+    }
+}
+
+// Called with m_mutex held; allocations and frees happen on StartGrabbing() and StopGrabbing(), not per frame.
+void CPooledBufferFactory::UpdateGauges()
+{
+    if (m_pBuffersGauge == NULL)
+    {
+        return;
+    }
+    size_t bytes = 0;
+    size_t inUse = 0;
+    for (size_t i = 0; i < m_buffers.size(); ++i)
+    {
+        bytes += m_buffers[i].size;
+        inUse += m_buffers[i].inUse ? 1 : 0;
+    }
+    m_pBuffersGauge->Set( (double) m_buffers.size() );
+    m_pBytesGauge->Set( (double) bytes );
+    m_pInUseGauge->Set( (double) inUse );
+}
+
+CDeviceRemovalWatchdog::CDeviceRemovalWatchdog()
+    : m_removed( false )
+    , m_lastRecoveryMs( 0.0 )
+    , m_reconnects( 0 )
+{
+}
+
+void CDeviceRemovalWatchdog::OnCameraDeviceRemoved( CInstantCamera& camera )
+{
+    {
+        std::lock_guard<std::mutex> lock( m_mutex );
+        m_removedAt = std::chrono::steady_clock::now();
+    }
+    m_removed = true;
+    cerr << "Camera " << camera.GetDeviceInfo().GetSerialNumber() << " was removed." << endl;
+}
+
+void CDeviceRemovalWatchdog::CacheConfiguration( CBaslerUniversalInstantCamera& camera )
+{
+    String_t configuration;
+    CFeaturePersistence::SaveToString( configuration, &camera.GetNodeMap() );
+
+    std::lock_guard<std::mutex> lock( m_mutex );
+    m_serialNumber = camera.GetDeviceInfo().GetSerialNumber();
+    m_configuration = configuration;
+}
+
+bool CDeviceRemovalWatchdog::Reconnect( CBaslerUniversalInstantCamera& camera, const std::atomic<bool>* pStop,
+                                        unsigned timeoutMs )
+{
+    String_t serialNumber;
+    String_t configuration;
+    std::chrono::steady_clock::time_point removedAt;
+    {
+        std::lock_guard<std::mutex> lock( m_mutex );
+        if (m_serialNumber.empty())
+        {
+            return false;
+        }
+        // The grab loop may notice the removal before pylon's callback does.
+        if (!m_removed)
+        {
+            m_removedAt = std::chrono::steady_clock::now();
+        }
+        serialNumber = m_serialNumber;
+        configuration = m_configuration;
+        removedAt = m_removedAt;
+    }
+
+    // Only the device goes away; the CInstantCamera keeps its registered handlers.
+    camera.DestroyDevice();
+
+    CTlFactory& tlFactory = CTlFactory::GetInstance();
+    CDeviceInfo info;
+    info.SetSerialNumber( serialNumber );
+    DeviceInfoList_t filter;
+    filter.push_back( info );
+
+    const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    unsigned delayMs = c_reconnectFirstDelayMs;
+    while (true)
+    {
+        try
+        {
+            DeviceInfoList_t devices;
+            if (tlFactory.EnumerateDevices( devices, filter ) > 0)
+            {
+                camera.Attach( tlFactory.CreateDevice( devices[0] ) );
+                camera.Open();
+                break;
+            }
+        }
+        catch (const GenericException& e)
+        {
+            cerr << "Reconnecting camera " << serialNumber << " failed: " << e.GetDescription() << endl;
+            if (camera.IsPylonDeviceAttached())
+            {
+                camera.DestroyDevice();
+            }
+        }
+        // Sleep in short slices so that a stop request does not wait out a long backoff.
+        const std::chrono::steady_clock::time_point retryAt = std::chrono::steady_clock::now() + std::chrono::milliseconds( delayMs );
+        while (std::chrono::steady_clock::now() < retryAt && !(pStop != NULL && *pStop))
+        {
+            std::this_thread::sleep_for( std::chrono::milliseconds( c_reconnectStopPollMs ) );
+        }
+        if (pStop != NULL && *pStop)
+        {
+            cerr << "Stopped reconnecting camera " << serialNumber << "." << endl;
+            return false;
+        }
+        if (timeoutMs != 0 && std::chrono::steady_clock::now() - start >= std::chrono::milliseconds( timeoutMs ))
+        {
+            cerr << "Camera " << serialNumber << " did not come back within " << timeoutMs << " ms." << endl;
+            return false;
+        }
+        delayMs = std::min( delayMs * 2, c_reconnectMaxDelayMs );
+    }
+
+    try
+    {
+        CFeaturePersistence::LoadFromString( configuration, &camera.GetNodeMap(), true );
+    }
+    catch (const GenericException& e)
+    {
+        // Keep going with whatever was applied; a half-configured camera beats no camera.
+        cerr << "Reapplying the configuration of camera " << serialNumber << " failed: " << e.GetDescription() << endl;
+    }
+
+    m_removed = false;
+    ++m_reconnects;
+    m_lastRecoveryMs = std::chrono::duration<double, std::milli>( std::chrono::steady_clock::now() - removedAt ).count();
+    cout << "Camera " << serialNumber << " reconnected after " << m_lastRecoveryMs << " ms." << endl;
+    return true;
+}
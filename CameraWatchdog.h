@@ -0,0 +1,106 @@
+// CameraWatchdog.h
+/*
+    Device-removal handling for the camera threads.
+
+    CDeviceRemovalWatchdog is registered as a configuration event handler and is told by
+    pylon when a camera drops off USB/GigE. The camera thread then calls Reconnect(), which
+    looks the camera up again by serial number with exponential backoff, reattaches it to the
+    same CInstantCamera object (so the image and camera event handlers stay registered) and
+    reapplies the configuration that was cached with CacheConfiguration() before grabbing.
+
+    CPooledBufferFactory is handed to the camera with SetBufferFactory(). pylon returns the
+    grab buffers to it when the device is destroyed, and it hands the very same buffers out
+    again after the reconnect, so recovery does not reallocate frame memory. With
+    AttachMetrics() it keeps gauges of its buffers, their bytes and those handed out. With
+    AttachBudget() its memory is charged to the budget: pylon needs the buffers it asks
+    for, so they are counted but never refused.
+*/
+#ifndef CAMERAWATCHDOG_H
+#define CAMERAWATCHDOG_H
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <pylon/PylonIncludes.h>
+#include <pylon/BaslerUniversalInstantCamera.h>
+
+class CMemoryAccount;
+class CMemoryBudget;
+class CMetricGauge;
+class CMetricsRegistry;
+
+class CPooledBufferFactory : public Pylon::IBufferFactory
+{
+public:
+    CPooledBufferFactory();
+    virtual ~CPooledBufferFactory();
+
+    virtual void AllocateBuffer( size_t bufferSize, void** pCreatedBuffer, intptr_t& bufferContext );
+    virtual void FreeBuffer( void* pCreatedBuffer, intptr_t bufferContext );
+    // The factory is owned by the camera thread (Cleanup_None), so this does nothing.
+    virtual void DestroyBufferFactory();
+
+    size_t Allocations() const;     // Buffers obtained from the heap.
+    size_t Reuses() const;          // Buffers handed out again from the pool.
+
+    // labels identify the camera, e.g. CMetricsRegistry::Label( "camera", "0" ).
+    void AttachMetrics( CMetricsRegistry& registry, const std::string& labels );
+    // The cameras' factories share one account. The budget must outlive the factory.
+    void AttachBudget( CMemoryBudget& budget );
+
+private:
+    struct Buffer
+    {
+        uint8_t* pData;
+        size_t size;
+        bool inUse;
+    };
+
+    void UpdateGauges();
+
+    mutable std::mutex m_mutex;
+    std::vector<Buffer> m_buffers;
+    size_t m_allocations;
+    size_t m_reuses;
+    CMetricGauge* m_pBuffersGauge;
+    CMetricGauge* m_pBytesGauge;
+    CMetricGauge* m_pInUseGauge;
+    CMemoryAccount* m_pAccount;
+};
+
+class CDeviceRemovalWatchdog : public Pylon::CConfigurationEventHandler
+{
+public:
+    CDeviceRemovalWatchdog();
+
+    // Called by pylon from its internal monitoring thread.
+    virtual void OnCameraDeviceRemoved( Pylon::CInstantCamera& camera );
+
+    // Remembers the serial number and node map settings of an opened, configured camera.
+    void CacheConfiguration( Pylon::CBaslerUniversalInstantCamera& camera );
+
+    bool IsRemoved() const { return m_removed.load(); }
+
+    // Blocks until the camera with the cached serial number is back, open and configured.
+    // Returns false if no configuration was cached, once *pStop is set, or if the camera
+    // is not back within timeoutMs (0: no limit); the device is then left destroyed.
+    bool Reconnect( Pylon::CBaslerUniversalInstantCamera& camera, const std::atomic<bool>* pStop = NULL,
+                    unsigned timeoutMs = 0 );
+
+    // Removal-to-reconfigured time of the last recovery.
+    double LastRecoveryMs() const { return m_lastRecoveryMs; }
+    unsigned Reconnects() const { return m_reconnects; }
+
+private:
+    std::atomic<bool> m_removed;
+    std::chrono::steady_clock::time_point m_removedAt;
+    std::mutex m_mutex;
+    Pylon::String_t m_serialNumber;
+    Pylon::String_t m_configuration;
+    double m_lastRecoveryMs;
+    unsigned m_reconnects;
+};
+
+#endif // CAMERAWATCHDOG_H
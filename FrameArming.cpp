@@ -0,0 +1,249 @@
+// FrameArming.cpp
+#include "FrameArming.h"
+
+#include <chrono>
+#include "MemoryBudget.h"
+
+CFrameArming::Config::Config()
+    : cameras( 2 )
+    , poolSize( 12 )
+    , maxPending( 4 )
+    , pairWindowNs( 1000000 )
+{
+}
+
+CFrameArming::CFrameArming( const Config& config )
+    : m_config( config )
+    , m_cameras( config.cameras )
+    , m_armed( 0 )
+    , m_claimed( 0 )
+    , m_missed( 0 )
+    , m_pairs( 0 )
+    , m_poolMisses( 0 )
+    , m_pAccount( NULL )
+{
+}
+
+CFrameArming::~CFrameArming()
+{
+    for (size_t c = 0; c < m_cameras.size(); ++c)
+    {
+        while (!m_cameras[c].pool.empty())
+        {
+            FreeBuffer( m_cameras[c], m_cameras[c].pool.size() - 1 );
+        }
+    }
+}
+
+void CFrameArming::AttachBudget( CMemoryBudget& budget )
+{
+    std::lock_guard<std::mutex> lock( m_mutex );
+    m_pAccount = &budget.Account( "arming.pool" );
+}
+
+uint64_t CFrameArming::HostNowNs()
+{
+    return (uint64_t) std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch() ).count();
+}
+
+void CFrameArming::OnExposureEnd( size_t camera, uint64_t frameId, uint64_t nowNs )
+{
+    std::lock_guard<std::mutex> lock( m_mutex );
+    if (camera >= m_cameras.size())
+    {
+        m_cameras.resize( camera + 1 );
+    }
+    Camera& c = m_cameras[camera];
+    if (c.pending.size() >= m_config.maxPending)
+    {
+        // The grabs for these never came (dropped or failed transfers).
+        c.pending.pop_front();
+    }
+    Pending pending;
+    pending.frameId = frameId;
+    pending.eventNs = nowNs;
+    pending.stereoPair = 0;
+    pending.buffer = TakeBuffer( c );
+
+    for (size_t other = 0; other < m_cameras.size(); ++other)
+    {
+        if (other == camera || m_cameras[other].pending.empty())
+        {
+            continue;
+        }
+        Pending& partner = m_cameras[other].pending.back();
+        const uint64_t apart = partner.eventNs > nowNs ? partner.eventNs - nowNs : nowNs - partner.eventNs;
+        if (apart <= m_config.pairWindowNs && (partner.stereoPair == 0 || pending.stereoPair == partner.stereoPair))
+        {
+            if (pending.stereoPair == 0)
+            {
+                pending.stereoPair = ++m_pairs;
+            }
+            partner.stereoPair = pending.stereoPair;
+        }
+    }
+    c.pending.push_back( pending );
+    ++m_armed;
+}
+
+bool CFrameArming::Claim( size_t camera, uint64_t frameId, int rows, int cols, int type, PipelineFrame& frame )
+{
+    std::lock_guard<std::mutex> lock( m_mutex );
+    if (camera >= m_cameras.size())
+    {
+        m_cameras.resize( camera + 1 );
+    }
+    Camera& c = m_cameras[camera];
+    c.rows = rows;
+    c.cols = cols;
+    c.type = type;
+
+    if (c.pending.empty())
+    {
+        ++m_missed;
+        return false;
+    }
+    size_t match = 0;
+    if (c.matching != Matching_Order)
+    {
+        while (match < c.pending.size() && c.pending[match].frameId != frameId)
+        {
+            ++match;
+        }
+        if (match < c.pending.size())
+        {
+            c.matching = Matching_Id;
+        }
+        else if (c.matching == Matching_Unknown && ++c.unmatched >= c_orderAfterClaims)
+        {
+            // Never one match: the event and the grab count differently.
+            c.matching = Matching_Order;
+            match = 0;
+        }
+        else
+        {
+            // This frame's event came late or was pushed out. Events of older frames
+            // are stale now; the later ones are kept for their grabs.
+            while (!c.pending.empty() && c.pending.front().frameId < frameId)
+            {
+                c.pending.pop_front();
+            }
+            ++m_missed;
+            return false;
+        }
+    }
+    // Events armed before the matched one belong to frames that were never delivered.
+    c.pending.erase( c.pending.begin(), c.pending.begin() + match );
+
+    Pending& pending = c.pending.front();
+    frame.exposureEndNs = pending.eventNs;
+    frame.stereoPair = pending.stereoPair;
+    if (!pending.buffer.empty() && pending.buffer.rows == rows && pending.buffer.cols == cols
+        && pending.buffer.type() == type)
+    {
+        frame.image = pending.buffer;
+        frame.pooledImage = m_pAccount != NULL;
+    }
+    c.pending.pop_front();
+    ++m_claimed;
+    return true;
+}
+
+cv::Mat CFrameArming::TakeBuffer( Camera& camera )
+{
+    if (camera.rows <= 0 || camera.cols <= 0)
+    {
+        return cv::Mat();
+    }
+    const bool shed = m_pAccount != NULL
+        && m_pAccount->Budget().CurrentPressure() >= CMemoryBudget::Pressure_FewerBuffers;
+    cv::Mat taken;
+    for (size_t i = 0; i < camera.pool.size() && taken.empty(); ++i)
+    {
+        cv::Mat& buffer = camera.pool[i];
+        // Only the pool holds it: the pipeline, sinks and pending events are done with it.
+        if (buffer.u != NULL && buffer.u->refcount == 1)
+        {
+            if (buffer.rows == camera.rows && buffer.cols == camera.cols && buffer.type() == camera.type)
+            {
+                taken = buffer;
+            }
+            else if (m_pAccount == NULL)
+            {
+                buffer.create( camera.rows, camera.cols, camera.type );
+                taken = buffer;
+            }
+            else
+            {
+                // Reallocated through the budget below.
+                FreeBuffer( camera, i-- );
+            }
+        }
+    }
+    if (shed)
+    {
+        // taken is referenced twice now, so only the other idle buffers go.
+        for (size_t i = camera.pool.size(); i-- > 0 && camera.pool.size() > c_minPoolSize; )
+        {
+            if (camera.pool[i].u->refcount == 1)
+            {
+                FreeBuffer( camera, i );
+            }
+        }
+    }
+    if (!taken.empty())
+    {
+        return taken;
+    }
+    const size_t bytes = (size_t) camera.rows * camera.cols * CV_ELEM_SIZE( camera.type );
+    if (camera.pool.size() < (shed ? c_minPoolSize : m_config.poolSize)
+        && (m_pAccount == NULL || m_pAccount->TryReserve( bytes )))
+    {
+        camera.pool.push_back( cv::Mat( camera.rows, camera.cols, camera.type ) );
+        return camera.pool.back();
+    }
+    ++m_poolMisses;
+    return cv::Mat();
+}
+
+// Called with m_mutex held. Holders of the buffer keep it alive; its bytes count no longer.
+void CFrameArming::FreeBuffer( Camera& camera, size_t index )
+{
+    cv::Mat& buffer = camera.pool[index];
+    if (m_pAccount != NULL)
+    {
+        m_pAccount->Release( buffer.total() * buffer.elemSize() );
+    }
+    camera.pool.erase( camera.pool.begin() + index );
+}
+
+uint64_t CFrameArming::Armed() const
+{
+    std::lock_guard<std::mutex> lock( m_mutex );
+    return m_armed;
+}
+
+uint64_t CFrameArming::Claimed() const
+{
+    std::lock_guard<std::mutex> lock( m_mutex );
+    return m_claimed;
+}
+
+uint64_t CFrameArming::Missed() const
+{
+    std::lock_guard<std::mutex> lock( m_mutex );
+    return m_missed;
+}
+
+uint64_t CFrameArming::Paired() const
+{
+    std::lock_guard<std::mutex> lock( m_mutex );
+    return m_pairs;
+}
+
+uint64_t CFrameArming::PoolMisses() const
+{
+    std::lock_guard<std::mutex> lock( m_mutex );
+    return m_poolMisses;
+}
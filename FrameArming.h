@@ -0,0 +1,116 @@
+// FrameArming.h
+/*
+    Prepares for a frame when the camera reports the end of its exposure, before the image
+    has been transferred.
+
+    OnExposureEnd() is called from the camera event handler. It takes a destination
+    buffer of the size the camera delivered last from a small per-camera pool and keeps it
+    for the frame. Pool buffers are reused only once nobody references them any more, so
+    their pages are already mapped and writing the converted image does not fault. The
+    event is also paired with the other cameras' exposure-end events: events within
+    pairWindowNs of each other (hardware-triggered stereo) get the same stereo pair id.
+
+    Claim() is called from OnImageGrabbed. It matches the grab with its armed event by
+    frame ID and hands the buffer, the event's host time and the pair id to the
+    PipelineFrame. A grab whose event is not pending (it came late, or was pushed out by
+    maxPending) is a miss, not given another frame's event. Only a camera whose first
+    c_orderAfterClaims grabs with events pending matched none of them is taken to count
+    events and grabs differently; its grabs are then matched with the oldest event.
+
+    With AttachBudget() the pool buffers are accounted against a CMemoryBudget. A pool
+    grows only as far as the budget allows; an event that gets no buffer counts as a pool
+    miss and its frame is converted into a buffer of its own as before. Under memory
+    pressure the pools keep c_minPoolSize buffers per camera and give idle ones back.
+
+    Times are host steady_clock ns taken when the event arrived, not camera timestamps.
+    Thread safe; the camera threads share one instance.
+*/
+#ifndef FRAMEARMING_H
+#define FRAMEARMING_H
+
+#include <deque>
+#include <mutex>
+#include <vector>
+#include <stdint.h>
+#include <opencv2/core.hpp>
+#include "Pipeline.h"
+
+class CMemoryAccount;
+class CMemoryBudget;
+
+class CFrameArming
+{
+public:
+    static const size_t c_minPoolSize = 2;
+    static const uint32_t c_orderAfterClaims = 8;
+
+    struct Config
+    {
+        Config();
+
+        size_t cameras;
+        size_t poolSize;            // Buffers kept per camera; should exceed the frames in flight.
+        size_t maxPending;          // Armed events per camera waiting for their grab.
+        uint64_t pairWindowNs;      // Exposure ends closer than this belong to one stereo pair.
+    };
+
+    explicit CFrameArming( const Config& config = Config() );
+    ~CFrameArming();
+
+    // Call before the first event. The budget must outlive this object.
+    void AttachBudget( CMemoryBudget& budget );
+
+    // Camera event thread, on exposure end. nowNs is HostNowNs() at the event.
+    void OnExposureEnd( size_t camera, uint64_t frameId, uint64_t nowNs );
+
+    // Grab thread. Sets frame.image to the reserved buffer (if it has rows x cols of type),
+    // frame.exposureEndNs and frame.stereoPair, and frame.pooledImage with a budget. Returns false if no event was armed for it.
+    bool Claim( size_t camera, uint64_t frameId, int rows, int cols, int type, PipelineFrame& frame );
+
+    static uint64_t HostNowNs();
+
+    uint64_t Armed() const;
+    uint64_t Claimed() const;
+    uint64_t Missed() const;        // Grabs without an armed event.
+    uint64_t Paired() const;        // Stereo pairs formed.
+    uint64_t PoolMisses() const;    // Armed events that found no free buffer.
+
+private:
+    struct Pending
+    {
+        uint64_t frameId;
+        uint64_t eventNs;
+        uint64_t stereoPair;
+        cv::Mat buffer;
+    };
+    enum Matching
+    {
+        Matching_Unknown,           // No frame ID has matched yet.
+        Matching_Id,                // Events and grabs share the frame ID.
+        Matching_Order              // They do not; the oldest event is the grab's.
+    };
+    struct Camera
+    {
+        Camera() : rows( 0 ), cols( 0 ), type( -1 ), matching( Matching_Unknown ), unmatched( 0 ) {}
+        std::deque<Pending> pending;
+        std::vector<cv::Mat> pool;
+        int rows, cols, type;       // Of the last claimed frame.
+        Matching matching;
+        uint32_t unmatched;         // Grabs with events pending but none of their ID, while Matching_Unknown.
+    };
+
+    cv::Mat TakeBuffer( Camera& camera );
+    void FreeBuffer( Camera& camera, size_t index );
+
+    Config m_config;
+    mutable std::mutex m_mutex;
+    std::vector<Camera> m_cameras;
+    uint64_t m_armed;
+    uint64_t m_claimed;
+    uint64_t m_missed;
+    uint64_t m_pairs;
+    uint64_t m_poolMisses;
+    CMemoryAccount* m_pAccount;     // NULL without a budget.
+};
+
+#endif // FRAMEARMING_H
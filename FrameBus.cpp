@@ -0,0 +1,331 @@
+// FrameBus.cpp
+#include "FrameBus.h"
+
+#include <new>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static_assert( ATOMIC_LLONG_LOCK_FREE == 2, "The frame bus needs lock-free 64-bit atomics to be shared between processes." );
+
+static const uint32_t c_frameBusMagic = 0x46425553; // "FBUS"
+static const uint32_t c_frameBusVersion = 1;
+static const size_t c_frameBusAlign = 64;
+
+static size_t AlignUp( size_t value )
+{
+    return (value + c_frameBusAlign - 1) & ~(c_frameBusAlign - 1);
+}
+
+std::string FrameBusName( size_t cameraIndex )
+{
+    return "/autonomous_robot_cam" + std::to_string( cameraIndex );
+}
+
+uint64_t FrameBusNowNs()
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+}
+
+CFrameBusWriter::CFrameBusWriter()
+    : m_pBase( NULL )
+    , m_mappedSize( 0 )
+    , m_slotStride( 0 )
+    , m_pHeader( NULL )
+    , m_sequence( 0 )
+    , m_nextSlot( 0 )
+{
+}
+
+CFrameBusWriter::~CFrameBusWriter()
+{
+    Close();
+}
+
+bool CFrameBusWriter::Create( const std::string& name, uint32_t slotCount, uint32_t slotSize )
+{
+    Close();
+    if (slotCount < 2)
+    {
+        return false;
+    }
+
+    m_slotStride = AlignUp( sizeof( FrameBusSlot ) ) + AlignUp( slotSize );
+    m_mappedSize = AlignUp( sizeof( FrameBusHeader ) ) + m_slotStride * slotCount;
+
+    // Start from a fresh object so readers of an older ring never see a layout change under them.
+    shm_unlink( name.c_str() );
+    int fd = shm_open( name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0666 );
+    if (fd < 0)
+    {
+        return false;
+    }
+    if (ftruncate( fd, (off_t) m_mappedSize ) != 0)
+    {
+        close( fd );
+        shm_unlink( name.c_str() );
+        return false;
+    }
+    void* p = mmap( NULL, m_mappedSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+    close( fd );
+    if (p == MAP_FAILED)
+    {
+        shm_unlink( name.c_str() );
+        return false;
+    }
+
+    m_name = name;
+    m_pBase = (uint8_t*) p;
+    m_pHeader = new (m_pBase) FrameBusHeader;
+    m_pHeader->magic.store( 0, std::memory_order_relaxed );
+    m_pHeader->version = c_frameBusVersion;
+    m_pHeader->slotCount = slotCount;
+    m_pHeader->slotSize = slotSize;
+    m_pHeader->head.store( 0, std::memory_order_relaxed );
+    m_pHeader->lastPublishNs.store( 0, std::memory_order_relaxed );
+    m_pHeader->maxPublishNs.store( 0, std::memory_order_relaxed );
+    m_pHeader->overwrites.store( 0, std::memory_order_relaxed );
+    for (uint32_t i = 0; i < slotCount; ++i)
+    {
+        FrameBusSlot* pSlot = new (m_pBase + AlignUp( sizeof( FrameBusHeader ) ) + m_slotStride * i) FrameBusSlot;
+        pSlot->seq.store( 0, std::memory_order_relaxed );
+        pSlot->refs.store( 0, std::memory_order_relaxed );
+        memset( &pSlot->meta, 0, sizeof( pSlot->meta ) );
+    }
+    m_sequence = 0;
+    m_nextSlot = 0;
+
+    // Readers check the magic last, so everything above is visible once it is set.
+    m_pHeader->magic.store( c_frameBusMagic, std::memory_order_release );
+    return true;
+}
+
+void CFrameBusWriter::Close()
+{
+    if (m_pBase == NULL)
+    {
+        return;
+    }
+    // Tell attached readers the ring is gone; their mapping stays valid until they detach.
+    m_pHeader->magic.store( 0, std::memory_order_release );
+    munmap( m_pBase, m_mappedSize );
+    shm_unlink( m_name.c_str() );
+    m_pBase = NULL;
+    m_pHeader = NULL;
+    m_mappedSize = 0;
+}
+
+FrameBusSlot* CFrameBusWriter::Slot( uint32_t index ) const
+{
+    return (FrameBusSlot*) (m_pBase + AlignUp( sizeof( FrameBusHeader ) ) + m_slotStride * index);
+}
+
+uint64_t CFrameBusWriter::Head() const
+{
+    return m_pHeader != NULL ? m_pHeader->head.load( std::memory_order_relaxed ) : 0;
+}
+
+bool CFrameBusWriter::Publish( const void* pData, const FrameBusMeta& meta )
+{
+    if (m_pBase == NULL || meta.size > m_pHeader->slotSize)
+    {
+        return false;
+    }
+    const uint64_t start = FrameBusNowNs();
+    const uint32_t slotCount = m_pHeader->slotCount;
+
+    // Prefer a slot nobody holds. Never wait: if every slot is held, take the oldest
+    // and let the reader detect the overwrite through the sequence check.
+    uint32_t index = m_nextSlot;
+    bool found = false;
+    for (uint32_t i = 0; i < slotCount; ++i)
+    {
+        uint32_t candidate = (m_nextSlot + i) % slotCount;
+        if (Slot( candidate )->refs.load( std::memory_order_relaxed ) == 0)
+        {
+            index = candidate;
+            found = true;
+            break;
+        }
+    }
+    if (!found)
+    {
+        m_pHeader->overwrites.fetch_add( 1, std::memory_order_relaxed );
+    }
+    m_nextSlot = (index + 1) % slotCount;
+
+    FrameBusSlot* pSlot = Slot( index );
+    const uint64_t sequence = ++m_sequence;
+    pSlot->seq.store( 2 * sequence - 1, std::memory_order_relaxed );
+    std::atomic_thread_fence( std::memory_order_release );
+
+    pSlot->meta = meta;
+    pSlot->meta.sequence = sequence;
+    memcpy( (uint8_t*) pSlot + AlignUp( sizeof( FrameBusSlot ) ), pData, meta.size );
+    pSlot->meta.publishNs = FrameBusNowNs();
+
+    pSlot->seq.store( 2 * sequence, std::memory_order_release );
+    m_pHeader->head.store( sequence, std::memory_order_release );
+
+    const uint64_t elapsed = FrameBusNowNs() - start;
+    m_pHeader->lastPublishNs.store( elapsed, std::memory_order_relaxed );
+    if (elapsed > m_pHeader->maxPublishNs.load( std::memory_order_relaxed ))
+    {
+        m_pHeader->maxPublishNs.store( elapsed, std::memory_order_relaxed );
+    }
+    return true;
+}
+
+CFrameBusReader::CFrameBusReader()
+    : m_pBase( NULL )
+    , m_mappedSize( 0 )
+    , m_slotStride( 0 )
+    , m_pHeader( NULL )
+    , m_lastSequence( 0 )
+    , m_skipped( 0 )
+{
+}
+
+CFrameBusReader::~CFrameBusReader()
+{
+    Detach();
+}
+
+bool CFrameBusReader::Attach( const std::string& name )
+{
+    Detach();
+    int fd = shm_open( name.c_str(), O_RDWR, 0 );
+    if (fd < 0)
+    {
+        return false;
+    }
+    struct stat st;
+    if (fstat( fd, &st ) != 0 || (size_t) st.st_size < sizeof( FrameBusHeader ))
+    {
+        close( fd );
+        return false;
+    }
+    void* p = mmap( NULL, (size_t) st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+    close( fd );
+    if (p == MAP_FAILED)
+    {
+        return false;
+    }
+
+    FrameBusHeader* pHeader = (FrameBusHeader*) p;
+    const size_t slotStride = AlignUp( sizeof( FrameBusSlot ) ) + AlignUp( pHeader->slotSize );
+    if (pHeader->magic.load( std::memory_order_acquire ) != c_frameBusMagic
+        || pHeader->version != c_frameBusVersion
+        || AlignUp( sizeof( FrameBusHeader ) ) + slotStride * pHeader->slotCount > (size_t) st.st_size)
+    {
+        munmap( p, (size_t) st.st_size );
+        return false;
+    }
+
+    m_pBase = (uint8_t*) p;
+    m_mappedSize = (size_t) st.st_size;
+    m_slotStride = slotStride;
+    m_pHeader = pHeader;
+    // Start at the current head so a late reader does not count history as lag.
+    m_lastSequence = pHeader->head.load( std::memory_order_acquire );
+    if (m_lastSequence > 0)
+    {
+        --m_lastSequence;
+    }
+    m_skipped = 0;
+    return true;
+}
+
+void CFrameBusReader::Detach()
+{
+    if (m_pBase == NULL)
+    {
+        return;
+    }
+    munmap( m_pBase, m_mappedSize );
+    m_pBase = NULL;
+    m_pHeader = NULL;
+    m_mappedSize = 0;
+}
+
+FrameBusSlot* CFrameBusReader::Slot( uint32_t index ) const
+{
+    return (FrameBusSlot*) (m_pBase + AlignUp( sizeof( FrameBusHeader ) ) + m_slotStride * index);
+}
+
+bool CFrameBusReader::IsStale() const
+{
+    return m_pHeader == NULL || m_pHeader->magic.load( std::memory_order_acquire ) != c_frameBusMagic;
+}
+
+uint64_t CFrameBusReader::Lag() const
+{
+    if (m_pHeader == NULL)
+    {
+        return 0;
+    }
+    uint64_t head = m_pHeader->head.load( std::memory_order_relaxed );
+    return head > m_lastSequence ? head - m_lastSequence : 0;
+}
+
+bool CFrameBusReader::AcquireLatest( FrameBusView& view )
+{
+    if (IsStale())
+    {
+        return false;
+    }
+    const uint32_t slotCount = m_pHeader->slotCount;
+
+    // Slots are not filled in order, so look for the newest complete one.
+    uint32_t bestSlot = 0;
+    uint64_t bestSeq = 0;
+    for (uint32_t i = 0; i < slotCount; ++i)
+    {
+        uint64_t seq = Slot( i )->seq.load( std::memory_order_acquire );
+        if ((seq & 1) == 0 && seq > bestSeq)
+        {
+            bestSeq = seq;
+            bestSlot = i;
+        }
+    }
+    if (bestSeq / 2 <= m_lastSequence)
+    {
+        return false;
+    }
+
+    FrameBusSlot* pSlot = Slot( bestSlot );
+    pSlot->refs.fetch_add( 1, std::memory_order_acq_rel );
+    view.meta = pSlot->meta;
+    std::atomic_thread_fence( std::memory_order_acquire );
+    if (pSlot->seq.load( std::memory_order_relaxed ) != bestSeq)
+    {
+        // The writer took the slot between the scan and the reference.
+        pSlot->refs.fetch_sub( 1, std::memory_order_release );
+        return false;
+    }
+
+    view.pData = (const uint8_t*) pSlot + AlignUp( sizeof( FrameBusSlot ) );
+    view.seq = bestSeq;
+    view.slot = bestSlot;
+    m_skipped += bestSeq / 2 - m_lastSequence - 1;
+    m_lastSequence = bestSeq / 2;
+    return true;
+}
+
+bool CFrameBusReader::Release( const FrameBusView& view )
+{
+    if (m_pBase == NULL)
+    {
+        return false;
+    }
+    FrameBusSlot* pSlot = Slot( view.slot );
+    std::atomic_thread_fence( std::memory_order_acquire );
+    bool intact = pSlot->seq.load( std::memory_order_relaxed ) == view.seq;
+    pSlot->refs.fetch_sub( 1, std::memory_order_release );
+    return intact;
+}
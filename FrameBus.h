@@ -0,0 +1,148 @@
+// FrameBus.h
+/*
+    Shared-memory frame bus.
+
+    Each camera thread owns one CFrameBusWriter that publishes every converted frame
+    into a POSIX shared-memory ring ("/autonomous_robot_cam<N>"). Other processes
+    (navigation, logging, debug viewers) open the same ring with CFrameBusReader and
+    get a pointer straight into the shared mapping, so no copy is made on the reader side.
+
+    The header is lock-free: each slot carries a sequence number used as a seqlock
+    (odd while the writer fills it) and a reference count that readers bump while they
+    hold the slot. The writer prefers slots with no references but never waits for
+    readers; a reader that held a slot for too long finds out on Release().
+*/
+#ifndef FRAMEBUS_H
+#define FRAMEBUS_H
+
+#include <atomic>
+#include <string>
+#include <stdint.h>
+#include <stddef.h>
+
+// Metadata published with every frame.
+struct FrameBusMeta
+{
+    uint64_t sequence;      // Publish sequence number, starts at 1.
+    uint64_t frameId;       // Block ID reported by the grab result.
+    uint64_t timestamp;     // Camera timestamp of the grab result (ticks).
+    uint64_t publishNs;     // CLOCK_MONOTONIC time the frame became visible to readers.
+    uint32_t cameraIndex;
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride;        // Bytes per row.
+    uint32_t pixelType;     // Pylon::EPixelType of the payload.
+    uint32_t size;          // Payload size in bytes.
+};
+
+// Shared header placed at offset 0 of the mapping.
+struct FrameBusHeader
+{
+    std::atomic<uint32_t> magic;    // Cleared by the writer when the ring is closed.
+    uint32_t version;
+    uint32_t slotCount;
+    uint32_t slotSize;              // Payload capacity of each slot.
+    std::atomic<uint64_t> head;     // Sequence number of the newest complete frame.
+    std::atomic<uint64_t> lastPublishNs;  // Duration of the last Publish() call.
+    std::atomic<uint64_t> maxPublishNs;
+    std::atomic<uint64_t> overwrites;     // Publishes that found every slot referenced and wrote into one anyway.
+};
+
+// Per-slot header, followed by slotSize bytes of payload.
+struct FrameBusSlot
+{
+    std::atomic<uint64_t> seq;      // 2*sequence when complete, odd while being written.
+    std::atomic<uint32_t> refs;
+    uint32_t reserved;
+    FrameBusMeta meta;
+};
+
+// Returns the shared-memory name used for a camera.
+std::string FrameBusName( size_t cameraIndex );
+
+// Monotonic clock shared by all processes on the machine.
+uint64_t FrameBusNowNs();
+
+class CFrameBusWriter
+{
+public:
+    CFrameBusWriter();
+    ~CFrameBusWriter();
+
+    // Creates (or recreates) the shared ring. Returns false if shm_open/mmap failed.
+    bool Create( const std::string& name, uint32_t slotCount, uint32_t slotSize );
+    void Close();
+    bool IsOpen() const { return m_pBase != NULL; }
+
+    // Copies the frame into the next free slot and makes it visible to readers.
+    // Frames bigger than slotSize are dropped and false is returned.
+    bool Publish( const void* pData, const FrameBusMeta& meta );
+
+    uint64_t Head() const;
+
+private:
+    CFrameBusWriter( const CFrameBusWriter& );
+    CFrameBusWriter& operator=( const CFrameBusWriter& );
+
+    FrameBusSlot* Slot( uint32_t index ) const;
+
+    std::string m_name;
+    uint8_t* m_pBase;
+    size_t m_mappedSize;
+    size_t m_slotStride;
+    FrameBusHeader* m_pHeader;
+    uint64_t m_sequence;
+    uint32_t m_nextSlot;
+};
+
+// A frame held by a reader. The payload stays valid until Release().
+struct FrameBusView
+{
+    const uint8_t* pData;
+    FrameBusMeta meta;
+    uint64_t seq;           // Slot sequence observed at acquisition.
+    uint32_t slot;
+};
+
+class CFrameBusReader
+{
+public:
+    CFrameBusReader();
+    ~CFrameBusReader();
+
+    // Maps an existing ring. Returns false if it does not exist yet or is incompatible.
+    bool Attach( const std::string& name );
+    void Detach();
+    bool IsAttached() const { return m_pBase != NULL; }
+
+    // Takes a reference on the newest frame newer than the last one acquired.
+    // Returns false if there is nothing new or the writer raced past the slot.
+    bool AcquireLatest( FrameBusView& view );
+
+    // Drops the reference. Returns false if the writer overwrote the slot while it was held,
+    // in which case the payload that was read must be discarded.
+    bool Release( const FrameBusView& view );
+
+    // True once the writer has closed or recreated the ring; Detach() and Attach() again.
+    bool IsStale() const;
+
+    // Number of frames published since the last one this reader acquired.
+    uint64_t Lag() const;
+    uint64_t Skipped() const { return m_skipped; }
+    const FrameBusHeader* Header() const { return m_pHeader; }
+
+private:
+    CFrameBusReader( const CFrameBusReader& );
+    CFrameBusReader& operator=( const CFrameBusReader& );
+
+    FrameBusSlot* Slot( uint32_t index ) const;
+
+    uint8_t* m_pBase;
+    size_t m_mappedSize;
+    size_t m_slotStride;
+    FrameBusHeader* m_pHeader;
+    uint64_t m_lastSequence;
+    uint64_t m_skipped;
+};
+
+#endif // FRAMEBUS_H
@@ -0,0 +1,182 @@
+// FrameQueue.h
+/*
+    Bounded hand-off queue between the camera threads and the pipeline workers.
+
+    Push() never blocks the camera thread: when the queue is full the oldest entry is
+    dropped, since a newer frame is always worth more to the robot than an old one.
+
+    Arm() announces an item that is about to arrive (e.g. on the camera's exposure-end
+    event): a consumer blocked in Pop() wakes up and polls, yielding in between, until
+    the item arrives or the spin time is over, so it does not pay the wake-up latency
+    of the condition variable once the item is pushed. It polls an atomic item count
+    without the mutex, so Push() never waits for the polling consumer; the spin should
+    be about as long as the item takes to arrive, since the consumer burns a core while
+    it polls.
+*/
+#ifndef FRAMEQUEUE_H
+#define FRAMEQUEUE_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+
+template <class T>
+class CFrameQueue
+{
+public:
+    explicit CFrameQueue( size_t capacity )
+        : m_capacity( capacity > 0 ? capacity : 1 )
+        , m_count( 0 )
+        , m_closed( false )
+        , m_dropped( 0 )
+        , m_armedUntilNs( 0 )
+    {
+    }
+
+    // Returns false if an older entry had to be dropped to make room.
+    bool Push( T&& item )
+    {
+        bool dropped = false;
+        {
+            std::lock_guard<std::mutex> lock( m_mutex );
+            if (m_items.size() >= m_capacity)
+            {
+                m_items.pop_front();
+                ++m_dropped;
+                dropped = true;
+            }
+            m_items.push_back( std::move( item ) );
+            m_count.store( m_items.size(), std::memory_order_release );
+        }
+        m_cond.notify_one();
+        return !dropped;
+    }
+
+    // Keeps at most limit (and at most the capacity) entries, moving the dropped ones into
+    // dropped so that the caller can account for them after the lock is released.
+    bool Push( T&& item, size_t limit, std::vector<T>& dropped )
+    {
+        const size_t count = dropped.size();
+        limit = limit > 0 && limit < m_capacity ? limit : m_capacity;
+        {
+            std::lock_guard<std::mutex> lock( m_mutex );
+            while (m_items.size() >= limit)
+            {
+                dropped.push_back( std::move( m_items.front() ) );
+                m_items.pop_front();
+                ++m_dropped;
+            }
+            m_items.push_back( std::move( item ) );
+            m_count.store( m_items.size(), std::memory_order_release );
+        }
+        m_cond.notify_one();
+        return dropped.size() == count;
+    }
+
+    // Blocks until an item is available. Returns false once the queue is closed and empty.
+    bool Pop( T& item )
+    {
+        std::unique_lock<std::mutex> lock( m_mutex );
+        while (m_items.empty() && !m_closed)
+        {
+            if (NowNs() < m_armedUntilNs.load( std::memory_order_relaxed ))
+            {
+                lock.unlock();
+                while (m_count.load( std::memory_order_acquire ) == 0 && !m_closed.load( std::memory_order_relaxed )
+                       && NowNs() < m_armedUntilNs.load( std::memory_order_relaxed ))
+                {
+                    std::this_thread::yield();
+                }
+                lock.lock();
+            }
+            else
+            {
+                m_cond.wait( lock );
+            }
+        }
+        if (m_items.empty())
+        {
+            return false;
+        }
+        item = std::move( m_items.front() );
+        m_items.pop_front();
+        m_count.store( m_items.size(), std::memory_order_release );
+        return true;
+    }
+
+    // Non-blocking variant of Pop().
+    bool TryPop( T& item )
+    {
+        std::lock_guard<std::mutex> lock( m_mutex );
+        if (m_items.empty())
+        {
+            return false;
+        }
+        item = std::move( m_items.front() );
+        m_items.pop_front();
+        m_count.store( m_items.size(), std::memory_order_release );
+        return true;
+    }
+
+    // Wakes one blocked Pop() to poll for up to spin.
+    void Arm( std::chrono::nanoseconds spin )
+    {
+        {
+            // Under the mutex, so that a consumer about to wait sees it.
+            std::lock_guard<std::mutex> lock( m_mutex );
+            const int64_t until = NowNs() + (int64_t) spin.count();
+            if (until > m_armedUntilNs.load( std::memory_order_relaxed ))
+            {
+                m_armedUntilNs.store( until, std::memory_order_relaxed );
+            }
+        }
+        m_cond.notify_one();
+    }
+
+    void Close()
+    {
+        {
+            std::lock_guard<std::mutex> lock( m_mutex );
+            m_closed = true;
+        }
+        m_cond.notify_all();
+    }
+
+    size_t Size() const
+    {
+        return m_count.load( std::memory_order_acquire );
+    }
+
+    size_t Capacity() const { return m_capacity; }
+
+    size_t Dropped() const
+    {
+        std::lock_guard<std::mutex> lock( m_mutex );
+        return m_dropped;
+    }
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    static int64_t NowNs()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>( Clock::now().time_since_epoch() ).count();
+    }
+
+    const size_t m_capacity;
+    mutable std::mutex m_mutex;
+    std::condition_variable m_cond;
+    std::deque<T> m_items;
+    std::atomic<size_t> m_count;            // m_items.size(), written under the mutex, polled without it.
+    std::atomic<bool> m_closed;
+    size_t m_dropped;
+    std::atomic<int64_t> m_armedUntilNs;    // steady_clock ns.
+};
+
+#endif // FRAMEQUEUE_H
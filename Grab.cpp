@@ -37,7 +37,21 @@
 #ifdef PYLON_WIN_BUILD
 #    include <pylon/PylonGUI.h>
 #endif
+#include <atomic>
 #include <mutex>          // std::mutex, std::lock
+#include "FrameArming.h"
+#include "FrameBus.h"
+#include "PreviewServer.h"
+#include "CameraWatchdog.h"
+#include "FrameQueue.h"
+#include "MemoryBudget.h"
+#include "MetricsRegistry.h"
+#include "MetricsServer.h"
+#include "Pipeline.h"
+#include "PipelineConfig.h"
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
 // Namespace for using pylon objects.
 using namespace Pylon;
 
@@ -46,6 +60,7 @@ using namespace std;
 // Namespace for using pylon universal instant camera parameters.
 using namespace Basler_UniversalCameraParams;
 static const size_t c_maxCamerasToUse = 2;
+static const int c_fewerGrabBuffers = 4;
 // Forward declarations for helper functions
 bool IsColorCamera( CBaslerUniversalInstantCamera& camera );
 void AutoGainOnce( CBaslerUniversalInstantCamera& camera );
@@ -54,8 +69,8 @@ void AutoExposureOnce( CBaslerUniversalInstantCamera& camera );
 void AutoExposureContinuous( CBaslerUniversalInstantCamera& camera );
 void AutoWhiteBalance( CBaslerUniversalInstantCamera& camera );
 std::mutex mtx; 
-// Number of images to be grabbed.
-static const uint32_t c_countOfImagesToGrab = 30;
+// Pipeline description used when no path is given on the command line.
+static const char* c_defaultPipelineConfig = "pipeline.yml";
 //Enumeration used for distinguishing different events.
 enum MyEvents
 {
@@ -63,17 +78,54 @@ enum MyEvents
     eMyEventOverrunEvent = 200
     // More events can be added here.
 };
-queue<std::pair<cv::Mat,std::string>> integer_queue;
+#ifdef USE_HIGHGUI
+struct DisplayFrame
+{
+    DisplayFrame() : budgetBytes( 0 ) {}
+    cv::Mat image;
+    std::string windowName;
+    size_t budgetBytes;     // Reserved in the "highgui.queue" account until the frame is shown or dropped.
+};
+// Only the newest couple of frames are kept for display.
+CFrameQueue<DisplayFrame> integer_queue(2);
+#endif
 int frame_num = 0;
+PipelineConfig pipeline_config;
+CPipeline* pipeline = NULL;
+CFrameArming* arming = NULL;    // Set when armOnExposureEnd is on.
+CMetricsRegistry metrics;       // Served on metricsPort / metricsSocket.
+CMemoryBudget* budget = NULL;   // Set before the camera threads start.
+std::atomic<bool> stopping( false );    // SIGINT/SIGTERM: camera threads stop grabbing and reconnecting.
+
+static void OnStopSignal( int )
+{
+    stopping = true;
+}
 //Example of an image event handler.
 // Example handler for camera events.
 class CSampleCameraEventHandler : public CBaslerUniversalCameraEventHandler
 {
 public:
+    explicit CSampleCameraEventHandler( size_t cameraIndex ) : m_cameraIndex( cameraIndex ) {}
+
     // Only very short processing tasks should be performed by this method. Otherwise, the event notification will block the
     // processing of images.
     virtual void OnCameraEvent( CBaslerUniversalInstantCamera& camera, intptr_t userProvidedId, GenApi::INode* /* pNode */ )
     {
+        if (userProvidedId == eMyExposureEndEvent && arming != NULL)
+        {
+            // The image is still being transferred: reserve its buffer, pair it with the
+            // other camera's exposure and wake a worker before anything else.
+            const uint64_t nowNs = CFrameArming::HostNowNs();
+            const uint64_t frameId = camera.EventExposureEndFrameID.IsReadable()
+                                     ? (uint64_t) camera.EventExposureEndFrameID.GetValue()
+                                     : (uint64_t) camera.ExposureEndEventFrameID.GetValue();
+            arming->OnExposureEnd( m_cameraIndex, frameId, nowNs );
+            if (pipeline != NULL)
+            {
+                pipeline->Arm( (uint64_t) pipeline_config.armSpinUs * 1000 );
+            }
+        }
         std::cout << std::endl;
         switch (userProvidedId)
         {
@@ -93,16 +145,30 @@ public:
                 break;
         }
     }
+
+private:
+    size_t m_cameraIndex;
 };
 class CSampleImageEventHandler : public CImageEventHandler
 {
 public:
+    CSampleImageEventHandler( CFrameBusWriter* pFrameBus, size_t cameraIndex )
+        : m_pFrameBus( pFrameBus )
+        , m_cameraIndex( cameraIndex )
+        , m_labels( CMetricsRegistry::Label( "camera", std::to_string( cameraIndex ) ) )
+        , m_frames( metrics.Counter( "robot_camera_frames_total", "Frames grabbed and converted.", m_labels ) )
+        , m_convertSeconds( metrics.Histogram( "robot_camera_convert_seconds", "Pixel format conversion time per frame.", m_labels ) )
+        , m_dropped( DroppedCounter( "queue_full" ) )
+        , m_skipped( DroppedCounter( "memory_pressure" ) )
+        , m_refused( DroppedCounter( "memory_budget" ) )
+    {
+        m_converter.OutputPixelFormat.SetValue(Pylon::PixelType_BGR8packed);
+        metrics.Rate( "robot_camera_fps", "Frames per second grabbed, between the last two scrapes.", m_labels, m_frames );
+    }
+
     virtual void OnImageGrabbed( CInstantCamera& camera, const CGrabResultPtr& ptrGrabResult)
     {
-        cv::Mat cameraImg;
-        CImageFormatConverter converter;
-                    converter.OutputPixelFormat.SetValue(Pylon::PixelType_BGR8packed);
-        CPylonImage targetImage;
+        PipelineFrame frame;
         cout << "CSampleImageEventHandler::OnImageGrabbed called." << std::endl;
         cout << std::endl;
   
@@ -111,10 +177,22 @@ public:
         if (ptrGrabResult->GrabSucceeded())
             {
 
-         // Create a target image
-                converter.Convert( targetImage, ptrGrabResult);
+         // Convert straight into a Mat the pipeline owns; the grab buffer goes back to pylon after this call.
+                // With arming, the Mat was already reserved on the exposure-end event and create() keeps it.
+                if (arming != NULL)
+                {
+                    arming->Claim( m_cameraIndex, ptrGrabResult->GetBlockID(), (int) ptrGrabResult->GetHeight(),
+                                   (int) ptrGrabResult->GetWidth(), CV_8UC3, frame );
+                }
+                frame.image.create( (int) ptrGrabResult->GetHeight(), (int) ptrGrabResult->GetWidth(), CV_8UC3 );
+                const uint64_t convertStart = CFrameArming::HostNowNs();
+                m_converter.Convert( frame.image.data, frame.image.total() * frame.image.elemSize(), ptrGrabResult );
+                m_convertSeconds.Observe( CFrameArming::HostNowNs() - convertStart );
+                m_frames.Add();
+                frame.cameraIndex = m_cameraIndex;
+                frame.frameId = ptrGrabResult->GetBlockID();
+                frame.timestamp = ptrGrabResult->GetTimeStamp();
                // intptr_t cameraContextValue = ptrGrabResult->GetCameraContext();
-                cameraImg= cv::Mat(ptrGrabResult->GetHeight(),ptrGrabResult->GetWidth(),CV_8UC3,(uint8_t*) targetImage.GetBuffer(),cv::Mat::AUTO_STEP);//,cv::Mat::AUTO_STEP
              //   cout <<"Camera "+ std::to_string(cameraContextValue)+ ": "<< cameras[cameraContextValue].GetDeviceInfo().GetModelName() <<endl;
                 // Access the image data
                 
@@ -124,25 +202,110 @@ public:
                 cout << "Gray value of first pixel: " << (uint32_t) pImageBuffer[0] << endl << endl;
                 //string windowName = "Live Video: Camera " + std::to_string(cameraContextValue);
            
-              string name = string(camera.GetDeviceInfo().GetDeviceIdx());
-              
-               string windowName = "Live Video: Camera " + name;
-                   integer_queue.push(std::make_pair(cameraImg,windowName));
-              //  cv::namedWindow(windowName, std::stoi(name));
-              
-               // cv::imshow(windowName, cameraImg);
-               // cv::waitKey(2);
+                // Hand the converted frame to other processes through the shared-memory ring.
+                if (m_pFrameBus != NULL && m_pFrameBus->IsOpen())
+                {
+                    FrameBusMeta meta = FrameBusMeta();
+                    meta.frameId = ptrGrabResult->GetBlockID();
+                    meta.timestamp = ptrGrabResult->GetTimeStamp();
+                    meta.cameraIndex = (uint32_t) m_cameraIndex;
+                    meta.width = ptrGrabResult->GetWidth();
+                    meta.height = ptrGrabResult->GetHeight();
+                    meta.stride = meta.width * 3;
+                    meta.pixelType = (uint32_t) PixelType_BGR8packed;
+                    meta.size = (uint32_t) (frame.image.total() * frame.image.elemSize());
+                    m_pFrameBus->Publish( frame.image.data, meta );
+                }
+
+                if (pipeline != NULL)
+                {
+                    switch (pipeline->Push( std::move( frame ) ))
+                    {
+                        case CPipeline::Push_DroppedOldest: m_dropped.Add(); break;
+                        case CPipeline::Push_Skipped:       m_skipped.Add(); break;
+                        case CPipeline::Push_Refused:       m_refused.Add(); break;
+                        default:                            break;
+                    }
+                }
         }
         else
             {
                 cout << "Error: " << std::hex << ptrGrabResult->GetErrorCode() << std::dec << " " << ptrGrabResult->GetErrorDescription() << endl;
+                // Failed grabs are rare; looking the series up here keeps one per error code.
+                char code[16];
+                snprintf( code, sizeof( code ), "0x%08x", (unsigned) ptrGrabResult->GetErrorCode() );
+                metrics.Counter( "robot_grab_errors_total", "Failed grabs by pylon error code.",
+                                 m_labels + "," + CMetricsRegistry::Label( "code", code ) ).Add();
             }   
             
      
     }
    
+private:
+    // queue_full: an older queued frame was evicted for this one; memory_pressure: this frame
+    // was skipped; memory_budget: this frame's bytes were refused.
+    CMetricCounter& DroppedCounter( const char* reason )
+    {
+        return metrics.Counter( "robot_camera_dropped_frames_total", "Frames lost when pushed into the pipeline, by reason.",
+                                m_labels + "," + CMetricsRegistry::Label( "reason", reason ) );
+    }
+
+    CFrameBusWriter* m_pFrameBus;
+    size_t m_cameraIndex;
+    CImageFormatConverter m_converter;
+    const std::string m_labels;
+    CMetricCounter& m_frames;
+    CMetricHistogram& m_convertSeconds;
+    CMetricCounter& m_dropped;
+    CMetricCounter& m_skipped;
+    CMetricCounter& m_refused;
+};
+
+// Pipeline sink feeding the MJPEG preview server.
+class CPreviewSink : public IPipelineSink
+{
+public:
+    explicit CPreviewSink( CPreviewServer& server ) : m_server( server ) {}
+    virtual void Consume( const PipelineFrame& frame )
+    {
+        m_server.SubmitFrame( frame.cameraIndex, frame.image );
+    }
+
+private:
+    CPreviewServer& m_server;
+};
+
+#ifdef USE_HIGHGUI
+// Pipeline sink feeding the HighGUI display thread.
+// The queued Mats keep the frame alive after the pipeline released its bytes, so they are
+// accounted again, unless the image belongs to a pool that accounts for it.
+class CHighGuiSink : public IPipelineSink
+{
+public:
+    explicit CHighGuiSink( CMemoryAccount& account ) : m_account( account ) {}
+    virtual void Consume( const PipelineFrame& frame )
+    {
+        DisplayFrame display;
+        display.budgetBytes = frame.pooledImage ? 0 : frame.image.total() * frame.image.elemSize();
+        if (!m_account.TryReserve( display.budgetBytes ))
+        {
+            return;     // The display is the first thing to go.
+        }
+        display.image = frame.image;
+        display.windowName = "Live Video: Camera " + std::to_string( frame.cameraIndex );
+        std::vector<DisplayFrame> dropped;
+        integer_queue.Push( std::move( display ), 0, dropped );
+        for (size_t i = 0; i < dropped.size(); ++i)
+        {
+            dropped[i].image.release();
+            m_account.Release( dropped[i].budgetBytes );
+        }
+    }
 
+private:
+    CMemoryAccount& m_account;
 };
+#endif
 
 //class Basler_CameraView
 //{
@@ -151,15 +314,30 @@ public:
    void Basler_CameraView(DeviceInfoList_t& device, size_t index)
     {
         PylonInitialize();
+        // Thread names label the per-thread CPU metrics; OnImageGrabbed runs on this thread.
+        pthread_setname_np( pthread_self(), ("camera" + std::to_string( index )).c_str() );
+        const std::string cameraLabels = CMetricsRegistry::Label( "camera", std::to_string( index ) );
         CTlFactory& tlFactory = CTlFactory::GetInstance();
+        // Declared before the camera so they outlive everything the camera holds on to:
+        // the image event handler publishes into the frame bus, and the grab buffers
+        // come from the pool that is kept across reconnects.
+        CFrameBusWriter frameBus;
+        CMemoryAccount& frameBusAccount = budget->Account( "framebus" );
+        size_t frameBusBytes = 0;
+        CPooledBufferFactory bufferFactory;
+        CDeviceRemovalWatchdog watchdog;
         CBaslerUniversalInstantCamera camera( tlFactory.CreateDevice( device[index] ));
         CGrabResultPtr ptrGrabResult;
-        CSampleCameraEventHandler* pHandler1 = new CSampleCameraEventHandler;
+        CSampleCameraEventHandler* pHandler1 = new CSampleCameraEventHandler( index );
         try
         {
                 cout << "Using device " << camera.GetDeviceInfo().GetModelName() << endl;
 
-                camera.RegisterImageEventHandler( new CSampleImageEventHandler, RegistrationMode_ReplaceAll, Cleanup_Delete );
+                camera.RegisterImageEventHandler( new CSampleImageEventHandler( &frameBus, index ), RegistrationMode_ReplaceAll, Cleanup_Delete );
+                camera.RegisterConfiguration( &watchdog, RegistrationMode_Append, Cleanup_None );
+                camera.SetBufferFactory( &bufferFactory, Cleanup_None );
+                bufferFactory.AttachMetrics( metrics, cameraLabels );
+                bufferFactory.AttachBudget( *budget );
    
                 camera.GrabCameraEvents = true;
 
@@ -170,24 +348,55 @@ public:
                 
 
         camera.Open();
+        const CameraSourceConfig& source = pipeline_config.SourceFor( index, string( camera.GetDeviceInfo().GetSerialNumber() ) );
+        // Load the default user set first; loading it after the settings below would undo them.
+                camera.UserSetSelector.SetValue(UserSetSelector_Default);
+                  camera.UserSetLoad.Execute();
         int minLowerLimit = camera.AutoGainLowerLimit.GetMin();
                 int maxUpperLimit = camera.AutoGainUpperLimit.GetMax();
                 camera.AutoGainLowerLimit.SetValue(minLowerLimit);
                 camera.AutoGainUpperLimit.SetValue(maxUpperLimit);
                 camera.AutoFunctionROIUseBrightness.SetValue(true);
-                camera.ExposureTime.SetValue(8333);
+                camera.ExposureTime.SetValue(source.exposureTime);
                 camera.GainAuto.SetValue("Continuous");
-                camera.AcquisitionFrameRateEnable = true;
-                camera.AcquisitionFrameRate = 30;
-                camera.UserSetSelector.SetValue(UserSetSelector_Default);
-                  camera.UserSetLoad.Execute();
-                camera.LineSelector.SetValue(LineSelector_Line4);
-                camera.LineMode.SetValue(LineMode_Input);
-               camera.TriggerSelector.SetValue(TriggerSelector_FrameStart);
-               camera.TriggerSource.SetValue(TriggerSource_Line4);
-                camera.TriggerMode.SetValue(TriggerMode_On);
-        CImageFormatConverter converter;
-                    converter.OutputPixelFormat.SetValue(Pylon::PixelType_BGR8packed);
+                camera.AcquisitionFrameRateEnable = source.frameRate > 0;
+                if (source.frameRate > 0)
+                {
+                    camera.AcquisitionFrameRate = source.frameRate;
+                }
+                if (!source.triggerLine.empty())
+                {
+                    camera.LineSelector.SetValue(source.triggerLine.c_str());
+                    camera.LineMode.SetValue(LineMode_Input);
+                    camera.TriggerSelector.SetValue(TriggerSelector_FrameStart);
+                    camera.TriggerSource.SetValue(source.triggerLine.c_str());
+                    camera.TriggerMode.SetValue(TriggerMode_On);
+                }
+                else
+                {
+                    camera.TriggerSelector.SetValue(TriggerSelector_FrameStart);
+                    camera.TriggerMode.SetValue(TriggerMode_Off);
+                }
+
+        // Size the shared-memory ring for the largest BGR8 image the sensor can deliver.
+        // Within the memory budget the ring gets fewer slots, or none.
+        const uint32_t maxFrameBytes = (uint32_t) (camera.Width.GetMax() * camera.Height.GetMax() * 3);
+        uint32_t frameBusSlots = source.frameBusSlots;
+        while (frameBusSlots > 0 && !frameBusAccount.TryReserve( (size_t) frameBusSlots * maxFrameBytes ))
+        {
+            frameBusSlots /= 2;
+        }
+        if (frameBusSlots < source.frameBusSlots)
+        {
+            cerr << "Frame bus " << FrameBusName( index ) << " limited to " << frameBusSlots << " slots by the memory budget" << endl;
+        }
+        frameBusBytes = (size_t) frameBusSlots * maxFrameBytes;
+        if (frameBusSlots > 0 && !frameBus.Create( FrameBusName( index ), frameBusSlots, maxFrameBytes ))
+        {
+            cerr << "Could not create shared-memory frame bus " << FrameBusName( index ) << endl;
+            frameBusAccount.Release( frameBusBytes );
+            frameBusBytes = 0;
+        }
 
         // Camera event processing must be activated first, the default is off.
         camera.RegisterCameraEventHandler( pHandler1, "EventExposureEndData", eMyExposureEndEvent, RegistrationMode_ReplaceAll, Cleanup_Delete );        
@@ -200,17 +409,63 @@ public:
             // scout-f, scout-g, and aviator GigE cameras use a different value
             camera.EventNotification.SetValue( EventNotification_GenICamEvent );
         }
+        // Remember serial number and settings so a reconnected camera comes back identical.
+        watchdog.CacheConfiguration( camera );
      
-        // Print the model name of the camera
-        // This smart pointer will receive the grab result data.
-        camera.StartGrabbing(GrabStrategy_OneByOne,GrabLoop_ProvidedByUser);
-
-        while(camera.IsGrabbing())
+        // Keep grabbing across device removals: the watchdog reattaches the camera and the
+        // handlers, frame bus and buffer pool stay as they are.
+        uint32_t imagesGrabbed = 0;
+        CMetricGauge& lineStatus = metrics.Gauge( "robot_camera_line_status", "Last read LineStatus of the selected line.", cameraLabels );
+        CMetricCounter& reconnects = metrics.Counter( "robot_camera_reconnects_total", "Recoveries after the camera was removed.", cameraLabels );
+        while (true)
         {
-                int64_t  status = camera.LineStatus.GetValue();
-                cout << "Line status: " << status << endl;
-                camera.RetrieveResult( 5000, ptrGrabResult, TimeoutHandling_ThrowException );
-                ptrGrabResult.Release();
+            try
+            {
+                // Close to the memory budget, ask pylon for fewer grab buffers (default 10).
+                if (budget->CurrentPressure() >= CMemoryBudget::Pressure_FewerBuffers)
+                {
+                    camera.MaxNumBuffer = c_fewerGrabBuffers;
+                }
+                // This smart pointer will receive the grab result data.
+                camera.StartGrabbing(GrabStrategy_OneByOne,GrabLoop_ProvidedByUser);
+
+                while(camera.IsGrabbing())
+                {
+                        if (stopping)
+                        {
+                            camera.StopGrabbing();
+                            break;
+                        }
+                        int64_t  status = camera.LineStatus.GetValue();
+                        cout << "Line status: " << status << endl;
+                        lineStatus.Set( (double) status );
+                        camera.RetrieveResult( 5000, ptrGrabResult, TimeoutHandling_ThrowException );
+                        ptrGrabResult.Release();
+                        if (pipeline_config.imagesToGrab > 0 && ++imagesGrabbed >= pipeline_config.imagesToGrab)
+                        {
+                            camera.StopGrabbing();
+                        }
+                }
+            }
+            catch (const GenericException&)
+            {
+                if (!camera.IsCameraDeviceRemoved())
+                {
+                    throw;
+                }
+            }
+            if (!camera.IsCameraDeviceRemoved())
+            {
+                break;
+            }
+            ptrGrabResult.Release();
+            if (!watchdog.Reconnect( camera, &stopping, pipeline_config.reconnectTimeoutS * 1000 ))
+            {
+                cerr << "Camera " << index << " is not grabbing any more." << endl;
+                break;
+            }
+            reconnects.Add();
+            cout << "Grab buffers allocated: " << bufferFactory.Allocations() << ", reused: " << bufferFactory.Reuses() << endl;
         }
 
         }
@@ -222,31 +477,39 @@ public:
          //   exitCode = 1;
         }
         
+    // pHandler1 was registered with Cleanup_Delete, so the camera deletes it.
     // Comment the following two lines to disable waiting on exit.
-    delete pHandler1;
     //cerr << endl << "Press enter to exit." << endl;
     //while (cin.get() != '\n');
+    frameBusAccount.Release( frameBusBytes );
     PylonTerminate();
     }
      
 //};
-void show_image(void)
+#ifdef USE_HIGHGUI
+void show_image(CMemoryAccount* pAccount)
 {
-    while(1){
-               if(integer_queue.size() > 1)
-            {
-
-                cv::namedWindow(integer_queue.back().second, cv::WINDOW_NORMAL);
-		cv::resizeWindow(integer_queue.back().second,300,700);
-                cv::imshow(integer_queue.back().second, integer_queue.back().first);
+    DisplayFrame image;
+    while(integer_queue.Pop(image)){
+                cv::namedWindow(image.windowName, cv::WINDOW_NORMAL);
+		cv::resizeWindow(image.windowName,300,700);
+                cv::imshow(image.windowName, image.image);
                 cv::waitKey(1);
-                integer_queue.pop();
-
-            }
+                image.image.release();
+                pAccount->Release( image.budgetBytes );
     }
 }
-int main( int /*argc*/, char* /*argv*/[] )
+#endif
+int main( int argc, char* argv[] )
 {
+        // The pipeline description comes from the first argument, or pipeline.yml in the working directory.
+        const string configPath = argc > 1 ? argv[1] : c_defaultPipelineConfig;
+        signal( SIGINT, OnStopSignal );
+        signal( SIGTERM, OnStopSignal );
+        if (!LoadPipelineConfig( configPath, pipeline_config ))
+        {
+            cerr << "No pipeline description at " << configPath << ", using built-in defaults." << endl;
+        }
         // Create an instant camera object with the camera device found first.
         DeviceInfoList_t devices;
         CBaslerUniversalInstantCameraArray cameras( min( devices.size(), c_maxCamerasToUse));
@@ -264,16 +527,119 @@ int main( int /*argc*/, char* /*argv*/[] )
                 throw RUNTIME_EXCEPTION( "No camera present." );
             }
 
+            // Declared first: the pools and queues below account against it until they are gone.
+            CMemoryBudget::Config budgetConfig;
+            budgetConfig.limitBytes = (size_t) pipeline_config.memoryBudgetMB * 1024 * 1024;
+            CMemoryBudget memoryBudget( budgetConfig );
+            budget = &memoryBudget;
+            memoryBudget.AttachMetrics( metrics );
+
+            // Instantiate the stage graph and its sinks from the pipeline description.
+            CPipeline processing( pipeline_config );
+            processing.AttachBudget( memoryBudget );
+            CFrameArming::Config armingConfig;
+            armingConfig.cameras = devices.size();
+            armingConfig.pairWindowNs = (uint64_t) pipeline_config.stereoPairWindowUs * 1000;
+            CFrameArming frameArming( armingConfig );
+            frameArming.AttachBudget( memoryBudget );
+            std::vector<std::unique_ptr<CPreviewServer>> previewServers;
+            std::vector<std::unique_ptr<IPipelineSink>> sinks;
+            for (size_t i = 0; i < pipeline_config.sinks.size(); ++i)
+            {
+                const SinkConfig& sinkConfig = pipeline_config.sinks[i];
+                if (sinkConfig.type == "preview")
+                {
+                    std::unique_ptr<CPreviewServer> server( new CPreviewServer( devices.size(), sinkConfig.port, sinkConfig.maxWidth, sinkConfig.jpegQuality ) );
+                    if (!server->Start())
+                    {
+                        cerr << "Could not start the preview server on port " << sinkConfig.port << endl;
+                        continue;
+                    }
+                    cout << "Live preview on http://127.0.0.1:" << sinkConfig.port << "/" << endl;
+                    sinks.push_back( std::unique_ptr<IPipelineSink>( new CPreviewSink( *server ) ) );
+                    previewServers.push_back( std::move( server ) );
+                }
+#ifdef USE_HIGHGUI
+                else if (sinkConfig.type == "highgui")
+                {
+                    CMemoryAccount& displayAccount = memoryBudget.Account( "highgui.queue" );
+                    sinks.push_back( std::unique_ptr<IPipelineSink>( new CHighGuiSink( displayAccount ) ) );
+                    thread_vec.push_back(std::thread(show_image, &displayAccount));
+                }
+#endif
+                else
+                {
+                    cerr << "Unknown or disabled pipeline sink '" << sinkConfig.type << "' ignored." << endl;
+                    continue;
+                }
+                processing.AddSink( sinks.back().get() );
+            }
+            processing.AttachMetrics( metrics );
+            metrics.CounterFunction( "robot_arming_missed_total", "Grabs without an armed exposure-end event.", "",
+                                     [&frameArming]() { return (double) frameArming.Missed(); } );
+            metrics.CounterFunction( "robot_arming_pool_misses_total", "Exposure-end events with no free frame buffer.", "",
+                                     [&frameArming]() { return (double) frameArming.PoolMisses(); } );
+            // Declared after the pipeline, so it stops serving before the pipeline goes away.
+            CMetricsServer metricsServer( metrics, pipeline_config.metricsPort, pipeline_config.metricsSocket );
+            if (pipeline_config.metricsPort != 0 || !pipeline_config.metricsSocket.empty())
+            {
+                if (metricsServer.Start())
+                {
+                    cout << "Metrics on " << (pipeline_config.metricsPort != 0 ? "http://127.0.0.1:" + std::to_string( pipeline_config.metricsPort ) + "/metrics " : "")
+                         << pipeline_config.metricsSocket << endl;
+                }
+                else
+                {
+                    cerr << "Could not start the metrics server on port " << pipeline_config.metricsPort
+                         << " / socket '" << pipeline_config.metricsSocket << "'" << endl;
+                }
+            }
+            processing.Start();
+            pipeline = &processing;
+            if (pipeline_config.armOnExposureEnd)
+            {
+                arming = &frameArming;
+            }
+            cout << "Pipeline: " << processing.StageCount() << " stages, " << sinks.size() << " sinks, "
+                 << pipeline_config.threadCount << " threads, queue of " << pipeline_config.queueSize << endl;
+
             for (size_t i = 0; i < devices.size(); ++i)
             {
         
                 thread_vec.push_back(std::thread(Basler_CameraView, std::ref(devices), i));
                 // Print the model name of the camera.
             }
-            thread_vec.push_back(std::thread(show_image));
-        for(std::thread &thread : thread_vec)
+        // Camera threads first; closing the pipeline then lets the workers drain and exit.
+        for(size_t i = 0; i < devices.size(); ++i)
+        {
+            thread_vec[thread_vec.size() - devices.size() + i].join();
+        }
+        pipeline = NULL;
+        arming = NULL;
+        processing.Stop();
+        if (processing.ExposureToStartFrames() > 0)
+        {
+            cout << "Exposure end to processing start: " << processing.AverageExposureToStartNs() / 1000 << " us average over "
+                 << processing.ExposureToStartFrames() << " frames, " << frameArming.Paired() << " stereo pairs, "
+                 << frameArming.Missed() << " grabs without an exposure event" << endl;
+        }
+        if (processing.Gated() > 0)
         {
-            thread.join();
+            cout << "Motion gate: skipped " << processing.Gated() << " of " << processing.Processed()
+                 << " frames, saved about " << processing.SavedNs() / 1000000 << " ms" << endl;
+        }
+        if (processing.Skipped() > 0 || processing.Downscaled() > 0 || processing.Refused() > 0)
+        {
+            cout << "Memory pressure: skipped " << processing.Skipped() << " frames, downscaled " << processing.Downscaled()
+                 << ", refused " << processing.Refused() << endl;
+        }
+        cout << "Memory by subsystem:" << endl << memoryBudget.Report();
+#ifdef USE_HIGHGUI
+        integer_queue.Close();
+#endif
+        for(size_t i = 0; i + devices.size() < thread_vec.size(); ++i)
+        {
+            thread_vec[i].join();
         }
         
         // Get all attached devices and exit application if no device is found.
@@ -310,8 +676,11 @@ int main( int /*argc*/, char* /*argv*/[] )
         */
        //;
     
-    cerr << endl << "Press enter to exit." << endl;
-    while (cin.get() != '\n');
+    if (!stopping)
+    {
+        cerr << endl << "Press enter to exit." << endl;
+        while (cin.get() != '\n');
+    }
 
     // Releases all pylon resources.
     PylonTerminate();
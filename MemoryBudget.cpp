@@ -0,0 +1,182 @@
+// MemoryBudget.cpp
+#include "MemoryBudget.h"
+
+#include <stdio.h>
+#include "MetricsRegistry.h"
+
+static void RaisePeak( std::atomic<size_t>& peak, size_t value )
+{
+    size_t current = peak.load( std::memory_order_relaxed );
+    while (value > current && !peak.compare_exchange_weak( current, value, std::memory_order_relaxed ))
+    {
+    }
+}
+
+CMemoryAccount::CMemoryAccount( CMemoryBudget& budget, const std::string& name )
+    : m_budget( budget )
+    , m_name( name )
+    , m_used( 0 )
+    , m_peak( 0 )
+    , m_refused( 0 )
+{
+}
+
+bool CMemoryAccount::TryReserve( size_t bytes )
+{
+    const size_t limit = m_budget.m_config.limitBytes;
+    size_t total = m_budget.m_used.load( std::memory_order_relaxed );
+    do
+    {
+        if (limit != 0 && (bytes > limit || total > limit - bytes))
+        {
+            m_refused.fetch_add( 1, std::memory_order_relaxed );
+            return false;
+        }
+    }
+    while (!m_budget.m_used.compare_exchange_weak( total, total + bytes, std::memory_order_relaxed ));
+    Add( bytes, total + bytes );
+    return true;
+}
+
+void CMemoryAccount::Charge( size_t bytes )
+{
+    const size_t total = m_budget.m_used.fetch_add( bytes, std::memory_order_relaxed ) + bytes;
+    Add( bytes, total );
+}
+
+void CMemoryAccount::Add( size_t bytes, size_t total )
+{
+    RaisePeak( m_budget.m_peak, total );
+    const size_t used = m_used.fetch_add( bytes, std::memory_order_relaxed ) + bytes;
+    RaisePeak( m_peak, used );
+}
+
+void CMemoryAccount::Release( size_t bytes )
+{
+    m_used.fetch_sub( bytes, std::memory_order_relaxed );
+    m_budget.m_used.fetch_sub( bytes, std::memory_order_relaxed );
+}
+
+CMemoryBudget::Config::Config()
+    : limitBytes( 0 )
+    , fewerBuffersAt( 0.6f )
+    , lowerResolutionAt( 0.75f )
+    , skipFramesAt( 0.9f )
+{
+}
+
+CMemoryBudget::CMemoryBudget( const Config& config )
+    : m_config( config )
+    , m_fewerBuffersBytes( (size_t) (config.limitBytes * (double) config.fewerBuffersAt) )
+    , m_lowerResolutionBytes( (size_t) (config.limitBytes * (double) config.lowerResolutionAt) )
+    , m_skipFramesBytes( (size_t) (config.limitBytes * (double) config.skipFramesAt) )
+    , m_used( 0 )
+    , m_peak( 0 )
+    , m_pMetrics( NULL )
+{
+}
+
+CMemoryBudget::~CMemoryBudget()
+{
+}
+
+CMemoryAccount& CMemoryBudget::Account( const std::string& name )
+{
+    std::lock_guard<std::mutex> lock( m_mutex );
+    for (size_t i = 0; i < m_accounts.size(); ++i)
+    {
+        if (m_accounts[i]->Name() == name)
+        {
+            return *m_accounts[i];
+        }
+    }
+    m_accounts.push_back( std::unique_ptr<CMemoryAccount>( new CMemoryAccount( *this, name ) ) );
+    if (m_pMetrics != NULL)
+    {
+        ExportAccount( *m_accounts.back() );
+    }
+    return *m_accounts.back();
+}
+
+CMemoryBudget::Pressure CMemoryBudget::CurrentPressure() const
+{
+    if (m_config.limitBytes == 0)
+    {
+        return Pressure_None;
+    }
+    const size_t used = Used();
+    if (used >= m_skipFramesBytes)
+    {
+        return Pressure_SkipFrames;
+    }
+    if (used >= m_lowerResolutionBytes)
+    {
+        return Pressure_LowerResolution;
+    }
+    return used >= m_fewerBuffersBytes ? Pressure_FewerBuffers : Pressure_None;
+}
+
+const char* CMemoryBudget::PressureName( Pressure pressure )
+{
+    switch (pressure)
+    {
+        case Pressure_FewerBuffers:     return "fewer buffers";
+        case Pressure_LowerResolution:  return "lower resolution";
+        case Pressure_SkipFrames:       return "skipping frames";
+        default:                        return "none";
+    }
+}
+
+std::string CMemoryBudget::Report() const
+{
+    static const double c_mb = 1024.0 * 1024.0;
+    char line[160];
+    std::string report;
+    std::lock_guard<std::mutex> lock( m_mutex );
+    for (size_t i = 0; i < m_accounts.size(); ++i)
+    {
+        const CMemoryAccount& account = *m_accounts[i];
+        snprintf( line, sizeof( line ), "  %-20s %9.1f MB now %9.1f MB peak %8llu refused\n", account.Name().c_str(),
+                  account.Used() / c_mb, account.Peak() / c_mb, (unsigned long long) account.Refused() );
+        report += line;
+    }
+    if (m_config.limitBytes != 0)
+    {
+        snprintf( line, sizeof( line ), "  %-20s %9.1f MB now %9.1f MB peak of %.1f MB%s\n", "total",
+                  Used() / c_mb, Peak() / c_mb, m_config.limitBytes / c_mb, Exceeded() ? ", EXCEEDED" : "" );
+    }
+    else
+    {
+        snprintf( line, sizeof( line ), "  %-20s %9.1f MB now %9.1f MB peak, no limit\n", "total", Used() / c_mb, Peak() / c_mb );
+    }
+    return report + line;
+}
+
+void CMemoryBudget::AttachMetrics( CMetricsRegistry& registry )
+{
+    std::lock_guard<std::mutex> lock( m_mutex );
+    m_pMetrics = &registry;
+    registry.GaugeFunction( "robot_memory_budget_bytes", "Memory budget, 0 without a limit.", "",
+                            [this]() { return (double) Limit(); } );
+    registry.GaugeFunction( "robot_memory_used_bytes", "Memory reserved against the budget by all subsystems.", "",
+                            [this]() { return (double) Used(); } );
+    registry.GaugeFunction( "robot_memory_pressure", "0 none, 1 fewer buffers, 2 lower resolution, 3 skipping frames.", "",
+                            [this]() { return (double) CurrentPressure(); } );
+    for (size_t i = 0; i < m_accounts.size(); ++i)
+    {
+        ExportAccount( *m_accounts[i] );
+    }
+}
+
+// Called with m_mutex held.
+void CMemoryBudget::ExportAccount( const CMemoryAccount& account )
+{
+    const std::string labels = CMetricsRegistry::Label( "subsystem", account.Name() );
+    const CMemoryAccount* pAccount = &account;
+    m_pMetrics->GaugeFunction( "robot_memory_subsystem_bytes", "Memory reserved by each subsystem.", labels,
+                               [pAccount]() { return (double) pAccount->Used(); } );
+    m_pMetrics->GaugeFunction( "robot_memory_subsystem_peak_bytes", "Highest memory reserved by each subsystem.", labels,
+                               [pAccount]() { return (double) pAccount->Peak(); } );
+    m_pMetrics->CounterFunction( "robot_memory_refused_total", "Reservations refused to stay within the budget.", labels,
+                                 [pAccount]() { return (double) pAccount->Refused(); } );
+}
@@ -0,0 +1,131 @@
+// MemoryBudget.h
+/*
+    Memory accounting against one global budget, for targets like the Jetson Nano where
+    the CPU and GPU share 4 GB.
+
+    Every pool and queue that holds frame-sized memory gets a CMemoryAccount from the
+    budget. It reserves bytes before it allocates or keeps them and releases them when
+    they are freed. TryReserve() fails rather than going over the limit, and the caller
+    does without: a pool does not grow, the pipeline drops the frame. Memory that cannot
+    be refused (pylon allocates its grab buffers itself) is Charge()d: it counts, may go
+    over the limit, and Exceeded() and the report say so.
+
+    CurrentPressure() tells the consumers how close the total is to the limit, so that they shed
+    memory before reservations start failing:
+        Pressure_FewerBuffers       pools stop growing past their minimum and give idle
+                                    buffers back, the pipeline queue is halved
+        Pressure_LowerResolution    frames are downscaled by two entering the pipeline
+        Pressure_SkipFrames         every other frame per camera is skipped
+    Each level includes the ones before it. Without a limit nothing is refused and the
+    pressure stays at Pressure_None, but the accounting and the report still work.
+
+    Reservations are a compare-and-swap on the total and never lock; accounts are created
+    under a mutex, normally at startup. Peaks are per account and for the total, so the
+    account peaks do not add up to the total peak.
+*/
+#ifndef MEMORYBUDGET_H
+#define MEMORYBUDGET_H
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+
+class CMemoryBudget;
+class CMetricsRegistry;
+
+class CMemoryAccount
+{
+public:
+    // False, and nothing reserved, if the bytes would take the total over the limit.
+    bool TryReserve( size_t bytes );
+    // Counts the bytes even if that goes over the limit.
+    void Charge( size_t bytes );
+    void Release( size_t bytes );
+
+    const std::string& Name() const { return m_name; }
+    size_t Used() const { return m_used.load( std::memory_order_relaxed ); }
+    size_t Peak() const { return m_peak.load( std::memory_order_relaxed ); }
+    uint64_t Refused() const { return m_refused.load( std::memory_order_relaxed ); }
+    CMemoryBudget& Budget() const { return m_budget; }
+
+private:
+    friend class CMemoryBudget;
+    CMemoryAccount( CMemoryBudget& budget, const std::string& name );
+    CMemoryAccount( const CMemoryAccount& );
+    CMemoryAccount& operator=( const CMemoryAccount& );
+
+    void Add( size_t bytes, size_t total );
+
+    CMemoryBudget& m_budget;
+    const std::string m_name;
+    std::atomic<size_t> m_used;
+    std::atomic<size_t> m_peak;
+    std::atomic<uint64_t> m_refused;
+};
+
+class CMemoryBudget
+{
+public:
+    enum Pressure
+    {
+        Pressure_None,
+        Pressure_FewerBuffers,
+        Pressure_LowerResolution,
+        Pressure_SkipFrames
+    };
+
+    struct Config
+    {
+        Config();
+
+        size_t limitBytes;          // 0: no limit, accounting only.
+        float fewerBuffersAt;       // Fractions of the limit where each pressure level starts.
+        float lowerResolutionAt;
+        float skipFramesAt;
+    };
+
+    explicit CMemoryBudget( const Config& config = Config() );
+    ~CMemoryBudget();
+
+    // The account with this name, created on first use; valid as long as the budget.
+    CMemoryAccount& Account( const std::string& name );
+
+    Pressure CurrentPressure() const;
+    size_t Limit() const { return m_config.limitBytes; }
+    size_t Used() const { return m_used.load( std::memory_order_relaxed ); }
+    size_t Peak() const { return m_peak.load( std::memory_order_relaxed ); }
+    // Charged memory took the total over the limit at some point.
+    bool Exceeded() const { return m_config.limitBytes != 0 && Peak() > m_config.limitBytes; }
+
+    // Current and peak MB and refused reservations per account, one line each.
+    std::string Report() const;
+
+    // Used and peak bytes per account (also of accounts created later), the limit and
+    // the pressure level as gauges. The registry must not be rendered after the budget is gone.
+    void AttachMetrics( CMetricsRegistry& registry );
+
+    static const char* PressureName( Pressure pressure );
+
+private:
+    friend class CMemoryAccount;
+    CMemoryBudget( const CMemoryBudget& );
+    CMemoryBudget& operator=( const CMemoryBudget& );
+
+    void ExportAccount( const CMemoryAccount& account );
+
+    Config m_config;
+    size_t m_fewerBuffersBytes;
+    size_t m_lowerResolutionBytes;
+    size_t m_skipFramesBytes;
+    std::atomic<size_t> m_used;
+    std::atomic<size_t> m_peak;
+    mutable std::mutex m_mutex;
+    std::vector<std::unique_ptr<CMemoryAccount> > m_accounts;
+    CMetricsRegistry* m_pMetrics;
+};
+
+#endif // MEMORYBUDGET_H
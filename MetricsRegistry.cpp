@@ -0,0 +1,449 @@
+// MetricsRegistry.cpp
+#include "MetricsRegistry.h"
+
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <unistd.h>
+
+__thread int t_metricStripe = -1;
+
+// Stripes below c_metricSharedStripe that no live thread owns.
+static std::mutex s_stripeMutex;
+static uint32_t s_freeStripes = (1u << c_metricSharedStripe) - 1;
+
+// Hands the thread's own stripe back when the thread exits.
+struct MetricStripeOwner
+{
+    ~MetricStripeOwner()
+    {
+        if (t_metricStripe >= 0 && t_metricStripe != c_metricSharedStripe)
+        {
+            // The mutex orders this thread's last plain stores before the next owner's.
+            std::lock_guard<std::mutex> lock( s_stripeMutex );
+            s_freeStripes |= 1u << t_metricStripe;
+        }
+        t_metricStripe = -1;
+    }
+};
+
+int AssignMetricStripe()
+{
+    static thread_local MetricStripeOwner s_owner;
+    (void) s_owner;
+    std::lock_guard<std::mutex> lock( s_stripeMutex );
+    if (s_freeStripes == 0)
+    {
+        t_metricStripe = c_metricSharedStripe;
+    }
+    else
+    {
+        t_metricStripe = __builtin_ctz( s_freeStripes );
+        s_freeStripes &= s_freeStripes - 1;
+    }
+    return t_metricStripe;
+}
+
+CMetricCounter::CMetricCounter()
+{
+    for (int i = 0; i < c_metricStripes; ++i)
+    {
+        m_stripes[i].value.store( 0, std::memory_order_relaxed );
+    }
+}
+
+uint64_t CMetricCounter::Value() const
+{
+    uint64_t value = 0;
+    for (int i = 0; i < c_metricStripes; ++i)
+    {
+        value += m_stripes[i].value.load( std::memory_order_relaxed );
+    }
+    return value;
+}
+
+CMetricGauge::CMetricGauge()
+    : m_value( 0.0 )
+{
+}
+
+void CMetricGauge::Add( double delta )
+{
+    double value = m_value.load( std::memory_order_relaxed );
+    while (!m_value.compare_exchange_weak( value, value + delta, std::memory_order_relaxed ))
+    {
+    }
+}
+
+CMetricHistogram::CMetricHistogram( int firstBoundShift, double scale )
+    : m_shift( firstBoundShift < 0 ? 0 : (firstBoundShift > 40 ? 40 : firstBoundShift) )
+    , m_scale( scale )
+{
+    for (int s = 0; s < c_metricStripes; ++s)
+    {
+        for (int b = 0; b < c_buckets; ++b)
+        {
+            m_stripes[s].counts[b].store( 0, std::memory_order_relaxed );
+        }
+        m_stripes[s].sum.store( 0, std::memory_order_relaxed );
+    }
+}
+
+void CMetricHistogram::Counts( uint64_t* pCumulative ) const
+{
+    uint64_t total = 0;
+    for (int b = 0; b < c_buckets; ++b)
+    {
+        for (int s = 0; s < c_metricStripes; ++s)
+        {
+            total += m_stripes[s].counts[b].load( std::memory_order_relaxed );
+        }
+        pCumulative[b] = total;
+    }
+}
+
+uint64_t CMetricHistogram::Sum() const
+{
+    uint64_t sum = 0;
+    for (int s = 0; s < c_metricStripes; ++s)
+    {
+        sum += m_stripes[s].sum.load( std::memory_order_relaxed );
+    }
+    return sum;
+}
+
+double CMetricHistogram::UpperBound( int bucket ) const
+{
+    return (double) (1ull << (m_shift + bucket)) * m_scale;
+}
+
+CMetricsRegistry::CMetricsRegistry()
+{
+}
+
+CMetricsRegistry::~CMetricsRegistry()
+{
+}
+
+std::string CMetricsRegistry::Label( const std::string& name, const std::string& value )
+{
+    std::string label = name + "=\"";
+    for (size_t i = 0; i < value.size(); ++i)
+    {
+        switch (value[i])
+        {
+            case '\\': label += "\\\\"; break;
+            case '"':  label += "\\\""; break;
+            case '\n': label += "\\n"; break;
+            default:   label += value[i]; break;
+        }
+    }
+    return label + "\"";
+}
+
+CMetricsRegistry::Series* CMetricsRegistry::Find( const std::string& name, const std::string& help,
+                                                  const std::string& labels, Type type, bool& created )
+{
+    created = false;
+    Family* pFamily = NULL;
+    for (size_t i = 0; i < m_families.size() && pFamily == NULL; ++i)
+    {
+        if (m_families[i]->name == name)
+        {
+            pFamily = m_families[i].get();
+        }
+    }
+    if (pFamily == NULL)
+    {
+        m_families.push_back( std::unique_ptr<Family>( new Family ) );
+        pFamily = m_families.back().get();
+        pFamily->name = name;
+        pFamily->help = help;
+        pFamily->type = type;
+    }
+    else if (pFamily->type != type)
+    {
+        return NULL;
+    }
+    for (size_t i = 0; i < pFamily->series.size(); ++i)
+    {
+        if (pFamily->series[i]->labels == labels)
+        {
+            return pFamily->series[i].get();
+        }
+    }
+    pFamily->series.push_back( std::unique_ptr<Series>( new Series ) );
+    pFamily->series.back()->labels = labels;
+    created = true;
+    return pFamily->series.back().get();
+}
+
+CMetricCounter& CMetricsRegistry::Counter( const std::string& name, const std::string& help, const std::string& labels )
+{
+    std::lock_guard<std::mutex> lock( m_mutex );
+    bool created;
+    Series* pSeries = Find( name, help, labels, Type_Counter, created );
+    if (pSeries == NULL)
+    {
+        m_detached.push_back( std::unique_ptr<Series>( new Series ) );
+        pSeries = m_detached.back().get();
+    }
+    if (!pSeries->pCounter)
+    {
+        pSeries->pCounter.reset( new CMetricCounter );
+    }
+    return *pSeries->pCounter;
+}
+
+CMetricGauge& CMetricsRegistry::Gauge( const std::string& name, const std::string& help, const std::string& labels )
+{
+    std::lock_guard<std::mutex> lock( m_mutex );
+    bool created;
+    Series* pSeries = Find( name, help, labels, Type_Gauge, created );
+    if (pSeries == NULL)
+    {
+        m_detached.push_back( std::unique_ptr<Series>( new Series ) );
+        pSeries = m_detached.back().get();
+    }
+    if (!pSeries->pGauge)
+    {
+        pSeries->pGauge.reset( new CMetricGauge );
+    }
+    return *pSeries->pGauge;
+}
+
+CMetricHistogram& CMetricsRegistry::Histogram( const std::string& name, const std::string& help, const std::string& labels,
+                                               int firstBoundShift, double scale )
+{
+    std::lock_guard<std::mutex> lock( m_mutex );
+    bool created;
+    Series* pSeries = Find( name, help, labels, Type_Histogram, created );
+    if (pSeries == NULL)
+    {
+        m_detached.push_back( std::unique_ptr<Series>( new Series ) );
+        pSeries = m_detached.back().get();
+    }
+    if (!pSeries->pHistogram)
+    {
+        pSeries->pHistogram.reset( new CMetricHistogram( firstBoundShift, scale ) );
+    }
+    return *pSeries->pHistogram;
+}
+
+void CMetricsRegistry::CounterFunction( const std::string& name, const std::string& help, const std::string& labels,
+                                        const std::function<double()>& function )
+{
+    std::lock_guard<std::mutex> lock( m_mutex );
+    bool created;
+    Series* pSeries = Find( name, help, labels, Type_Counter, created );
+    if (pSeries != NULL && created)
+    {
+        pSeries->function = function;
+    }
+}
+
+void CMetricsRegistry::GaugeFunction( const std::string& name, const std::string& help, const std::string& labels,
+                                      const std::function<double()>& function )
+{
+    std::lock_guard<std::mutex> lock( m_mutex );
+    bool created;
+    Series* pSeries = Find( name, help, labels, Type_Gauge, created );
+    if (pSeries != NULL && created)
+    {
+        pSeries->function = function;
+    }
+}
+
+// State of one Rate(); renders are serialized by the registry's mutex.
+struct MetricRateState
+{
+    const CMetricCounter* pCounter;
+    uint64_t lastValue;
+    std::chrono::steady_clock::time_point lastTime;
+    double rate;
+
+    double operator()()
+    {
+        const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        const double seconds = std::chrono::duration<double>( now - lastTime ).count();
+        // Renders in quick succession (two scrapers) keep the last rate.
+        if (seconds >= 0.1)
+        {
+            const uint64_t value = pCounter->Value();
+            rate = (value - lastValue) / seconds;
+            lastValue = value;
+            lastTime = now;
+        }
+        return rate;
+    }
+};
+
+void CMetricsRegistry::Rate( const std::string& name, const std::string& help, const std::string& labels,
+                             const CMetricCounter& counter )
+{
+    std::shared_ptr<MetricRateState> pState = std::make_shared<MetricRateState>();
+    pState->pCounter = &counter;
+    pState->lastValue = counter.Value();
+    pState->lastTime = std::chrono::steady_clock::now();
+    pState->rate = 0.0;
+    GaugeFunction( name, help, labels, [pState]() { return (*pState)(); } );
+}
+
+static void AppendValue( std::string& out, double value )
+{
+    char text[32];
+    snprintf( text, sizeof( text ), "%.15g", value );
+    out += text;
+}
+
+static void AppendValue( std::string& out, uint64_t value )
+{
+    char text[24];
+    snprintf( text, sizeof( text ), "%llu", (unsigned long long) value );
+    out += text;
+}
+
+static void AppendSeriesName( std::string& out, const std::string& name, const char* suffix,
+                              const std::string& labels, const std::string& extraLabel )
+{
+    out += name;
+    out += suffix;
+    if (!labels.empty() || !extraLabel.empty())
+    {
+        out += '{';
+        out += labels;
+        if (!labels.empty() && !extraLabel.empty())
+        {
+            out += ',';
+        }
+        out += extraLabel;
+        out += '}';
+    }
+    out += ' ';
+}
+
+std::string CMetricsRegistry::Render()
+{
+    static const char* c_typeNames[] = { "counter", "gauge", "histogram" };
+    std::string out;
+    out.reserve( 16384 );
+    std::lock_guard<std::mutex> lock( m_mutex );
+    for (size_t f = 0; f < m_families.size(); ++f)
+    {
+        const Family& family = *m_families[f];
+        out += "# HELP " + family.name + " " + family.help + "\n";
+        out += "# TYPE " + family.name + " " + c_typeNames[family.type] + "\n";
+        for (size_t s = 0; s < family.series.size(); ++s)
+        {
+            const Series& series = *family.series[s];
+            if (series.pHistogram)
+            {
+                const CMetricHistogram& histogram = *series.pHistogram;
+                uint64_t counts[CMetricHistogram::c_buckets];
+                histogram.Counts( counts );
+                for (int b = 0; b < CMetricHistogram::c_buckets; ++b)
+                {
+                    std::string le = "le=\"+Inf\"";
+                    if (b + 1 < CMetricHistogram::c_buckets)
+                    {
+                        char bound[40];
+                        snprintf( bound, sizeof( bound ), "le=\"%.9g\"", histogram.UpperBound( b ) );
+                        le = bound;
+                    }
+                    AppendSeriesName( out, family.name, "_bucket", series.labels, le );
+                    AppendValue( out, counts[b] );
+                    out += '\n';
+                }
+                AppendSeriesName( out, family.name, "_sum", series.labels, "" );
+                AppendValue( out, histogram.Sum() * histogram.Scale() );
+                out += '\n';
+                AppendSeriesName( out, family.name, "_count", series.labels, "" );
+                AppendValue( out, counts[CMetricHistogram::c_buckets - 1] );
+                out += '\n';
+                continue;
+            }
+            AppendSeriesName( out, family.name, "", series.labels, "" );
+            if (series.pCounter)
+            {
+                AppendValue( out, series.pCounter->Value() );
+            }
+            else if (series.pGauge)
+            {
+                AppendValue( out, series.pGauge->Value() );
+            }
+            else if (series.function)
+            {
+                AppendValue( out, series.function() );
+            }
+            else
+            {
+                out += '0';
+            }
+            out += '\n';
+        }
+    }
+    RenderThreadCpu( out );
+    return out;
+}
+
+void CMetricsRegistry::RenderThreadCpu( std::string& out ) const
+{
+    DIR* pDir = opendir( "/proc/self/task" );
+    if (pDir == NULL)
+    {
+        return;
+    }
+    const double secondsPerTick = 1.0 / (double) sysconf( _SC_CLK_TCK );
+    out += "# HELP process_thread_cpu_seconds_total User and system CPU time of each thread.\n";
+    out += "# TYPE process_thread_cpu_seconds_total counter\n";
+    struct dirent* pEntry;
+    while ((pEntry = readdir( pDir )) != NULL)
+    {
+        if (pEntry->d_name[0] == '.')
+        {
+            continue;
+        }
+        char path[300];
+        snprintf( path, sizeof( path ), "/proc/self/task/%s/stat", pEntry->d_name );
+        FILE* pFile = fopen( path, "r" );
+        if (pFile == NULL)
+        {
+            continue;       // The thread exited meanwhile.
+        }
+        char stat[512];
+        const size_t length = fread( stat, 1, sizeof( stat ) - 1, pFile );
+        fclose( pFile );
+        stat[length] = '\0';
+
+        // "tid (name) state ppid ...": the name may contain spaces and parentheses.
+        char* pOpen = strchr( stat, '(' );
+        char* pClose = strrchr( stat, ')' );
+        if (pOpen == NULL || pClose == NULL || pClose < pOpen)
+        {
+            continue;
+        }
+        const std::string name( pOpen + 1, pClose );
+        // utime and stime are fields 14 and 15; the state is field 3.
+        char* p = pClose + 2;
+        for (int field = 3; field < 14 && p != NULL; ++field)
+        {
+            p = strchr( p, ' ' );
+            p = p != NULL ? p + 1 : NULL;
+        }
+        if (p == NULL)
+        {
+            continue;
+        }
+        char* pEnd;
+        const unsigned long long utime = strtoull( p, &pEnd, 10 );
+        const unsigned long long stime = strtoull( pEnd, NULL, 10 );
+
+        AppendSeriesName( out, "process_thread_cpu_seconds_total", "",
+                          Label( "thread", name ) + "," + Label( "tid", pEntry->d_name ), "" );
+        AppendValue( out, (utime + stime) * secondsPerTick );
+        out += '\n';
+    }
+    closedir( pDir );
+}
@@ -0,0 +1,210 @@
+// MetricsRegistry.h
+/*
+    Process metrics, rendered in the Prometheus text format (see CMetricsServer).
+
+    Counters, gauges and histograms are looked up once by name and labels, which takes
+    the registry's mutex, and then updated through the returned reference, which stays
+    valid as long as the registry. Updates never lock:
+        counter     one cache line per stripe. A thread gets a stripe of its own on its
+                    first update (back when it exits), and as the only writer adds with a
+                    plain relaxed load and store, no locked instruction and no line
+                    bouncing between cores. Threads beyond c_metricStripes - 1 share the
+                    last stripe and use an atomic add.
+        gauge       one relaxed store.
+        histogram   power-of-two buckets, striped the same way: a count-leading-zeros and
+                    two adds.
+    Reading sums the stripes, so a render is not an atomic snapshot across metrics.
+
+    Values another class already keeps (queue depth, totals) are registered as functions
+    and only read when rendering. Render() also lists the CPU time of every thread of the
+    process from /proc/self/task, labelled with the thread names.
+*/
+#ifndef METRICSREGISTRY_H
+#define METRICSREGISTRY_H
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+static const int c_metricStripes = 16;
+static const int c_metricSharedStripe = c_metricStripes - 1;
+static const int c_metricCacheLine = 64;
+
+// The calling thread's stripe, -1 before its first update.
+// __thread rather than thread_local: other files read it without a TLS wrapper call.
+extern __thread int t_metricStripe;
+int AssignMetricStripe();
+
+inline int MetricStripe()
+{
+    const int stripe = t_metricStripe;
+    return stripe >= 0 ? stripe : AssignMetricStripe();
+}
+
+inline void MetricAdd( std::atomic<uint64_t>& value, uint64_t n, int stripe )
+{
+    if (stripe != c_metricSharedStripe)
+    {
+        value.store( value.load( std::memory_order_relaxed ) + n, std::memory_order_relaxed );
+    }
+    else
+    {
+        value.fetch_add( n, std::memory_order_relaxed );
+    }
+}
+
+class CMetricCounter
+{
+public:
+    CMetricCounter();
+
+    void Add( uint64_t n = 1 )
+    {
+        const int stripe = MetricStripe();
+        MetricAdd( m_stripes[stripe].value, n, stripe );
+    }
+    uint64_t Value() const;
+
+private:
+    CMetricCounter( const CMetricCounter& );
+    CMetricCounter& operator=( const CMetricCounter& );
+
+    struct Stripe
+    {
+        std::atomic<uint64_t> value;
+        char pad[c_metricCacheLine - sizeof( std::atomic<uint64_t> )];
+    };
+    Stripe m_stripes[c_metricStripes];
+};
+
+class CMetricGauge
+{
+public:
+    CMetricGauge();
+
+    void Set( double value ) { m_value.store( value, std::memory_order_relaxed ); }
+    void Add( double delta );
+    double Value() const { return m_value.load( std::memory_order_relaxed ); }
+
+private:
+    CMetricGauge( const CMetricGauge& );
+    CMetricGauge& operator=( const CMetricGauge& );
+
+    std::atomic<double> m_value;
+    char m_pad[c_metricCacheLine - sizeof( std::atomic<double> )];
+};
+
+// Bucket i counts the values up to firstBound << i (firstBound = 1 << firstBoundShift);
+// the last bucket counts everything above. Values are integers in some unit (ns by
+// default) and are multiplied by scale when rendered (1e-9: seconds).
+class CMetricHistogram
+{
+public:
+    static const int c_buckets = 24;
+
+    CMetricHistogram( int firstBoundShift, double scale );
+
+    void Observe( uint64_t value )
+    {
+        // Upper bounds are inclusive, as Prometheus' "le".
+        const uint64_t above = (value - (value != 0 ? 1 : 0)) >> m_shift;
+        int bucket = above == 0 ? 0 : 64 - __builtin_clzll( above );
+        bucket = bucket < c_buckets ? bucket : c_buckets - 1;
+        const int stripe = MetricStripe();
+        MetricAdd( m_stripes[stripe].counts[bucket], 1, stripe );
+        MetricAdd( m_stripes[stripe].sum, value, stripe );
+    }
+
+    // Cumulative counts per bucket, the last one being the total.
+    void Counts( uint64_t* pCumulative ) const;
+    uint64_t Sum() const;
+    double UpperBound( int bucket ) const;      // Scaled; the last bucket has no bound.
+    double Scale() const { return m_scale; }
+
+private:
+    CMetricHistogram( const CMetricHistogram& );
+    CMetricHistogram& operator=( const CMetricHistogram& );
+
+    struct Stripe
+    {
+        std::atomic<uint64_t> counts[c_buckets];
+        std::atomic<uint64_t> sum;
+        char pad[c_metricCacheLine - (c_buckets + 1) * sizeof( std::atomic<uint64_t> ) % c_metricCacheLine];
+    };
+    const int m_shift;
+    const double m_scale;
+    Stripe m_stripes[c_metricStripes];
+};
+
+class CMetricsRegistry
+{
+public:
+    CMetricsRegistry();
+    ~CMetricsRegistry();
+
+    // labels is what goes between the braces, e.g. Label( "camera", "0" ); empty for none.
+    // The same name and labels give the same metric. A name keeps the type and help text
+    // it was first registered with; asking for it as another type returns a detached metric.
+    CMetricCounter& Counter( const std::string& name, const std::string& help, const std::string& labels = "" );
+    CMetricGauge& Gauge( const std::string& name, const std::string& help, const std::string& labels = "" );
+    CMetricHistogram& Histogram( const std::string& name, const std::string& help, const std::string& labels = "",
+                                 int firstBoundShift = 10, double scale = 1e-9 );
+
+    // Read on every render, under the registry's mutex; must stay callable while the
+    // registry can be rendered. Registering the same name and labels again does nothing.
+    void CounterFunction( const std::string& name, const std::string& help, const std::string& labels,
+                          const std::function<double()>& function );
+    void GaugeFunction( const std::string& name, const std::string& help, const std::string& labels,
+                        const std::function<double()>& function );
+    // Per-second increase of counter between two renders, e.g. frames per second.
+    void Rate( const std::string& name, const std::string& help, const std::string& labels,
+               const CMetricCounter& counter );
+
+    // Prometheus text exposition format 0.0.4.
+    std::string Render();
+
+    // name="value" with the value escaped; join several with a comma.
+    static std::string Label( const std::string& name, const std::string& value );
+
+private:
+    CMetricsRegistry( const CMetricsRegistry& );
+    CMetricsRegistry& operator=( const CMetricsRegistry& );
+
+    enum Type
+    {
+        Type_Counter,
+        Type_Gauge,
+        Type_Histogram
+    };
+
+    struct Series
+    {
+        std::string labels;
+        std::unique_ptr<CMetricCounter> pCounter;
+        std::unique_ptr<CMetricGauge> pGauge;
+        std::unique_ptr<CMetricHistogram> pHistogram;
+        std::function<double()> function;
+    };
+
+    struct Family
+    {
+        std::string name;
+        std::string help;
+        Type type;
+        std::vector<std::unique_ptr<Series> > series;
+    };
+
+    // Finds or adds the series; NULL if the name is registered with another type.
+    Series* Find( const std::string& name, const std::string& help, const std::string& labels, Type type, bool& created );
+    void RenderThreadCpu( std::string& out ) const;
+
+    std::mutex m_mutex;
+    std::vector<std::unique_ptr<Family> > m_families;
+    std::vector<std::unique_ptr<Series> > m_detached;   // Type clashes, kept so references stay valid.
+};
+
+#endif // METRICSREGISTRY_H
@@ -0,0 +1,195 @@
+// MetricsServer.cpp
+#include "MetricsServer.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include "MetricsRegistry.h"
+
+CMetricsServer::CMetricsServer( CMetricsRegistry& registry, uint16_t port, const std::string& socketPath )
+    : m_registry( registry )
+    , m_port( port )
+    , m_socketPath( socketPath )
+    , m_running( false )
+    , m_tcpFd( -1 )
+    , m_unixFd( -1 )
+    , m_scrapes( 0 )
+{
+}
+
+CMetricsServer::~CMetricsServer()
+{
+    Stop();
+}
+
+bool CMetricsServer::Start()
+{
+    if (m_running)
+    {
+        return true;
+    }
+    if (m_port != 0)
+    {
+        m_tcpFd = socket( AF_INET, SOCK_STREAM, 0 );
+        int reuse = 1;
+        setsockopt( m_tcpFd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof( reuse ) );
+        struct sockaddr_in addr;
+        memset( &addr, 0, sizeof( addr ) );
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons( m_port );
+        addr.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+        if (m_tcpFd < 0 || bind( m_tcpFd, (struct sockaddr*) &addr, sizeof( addr ) ) != 0 || listen( m_tcpFd, 4 ) != 0)
+        {
+            Stop();
+            return false;
+        }
+    }
+    if (!m_socketPath.empty())
+    {
+        struct sockaddr_un addr;
+        memset( &addr, 0, sizeof( addr ) );
+        addr.sun_family = AF_UNIX;
+        if (m_socketPath.size() >= sizeof( addr.sun_path ))
+        {
+            Stop();
+            return false;
+        }
+        strcpy( addr.sun_path, m_socketPath.c_str() );
+        // A socket file left behind by a previous run would make bind() fail.
+        unlink( m_socketPath.c_str() );
+        m_unixFd = socket( AF_UNIX, SOCK_STREAM, 0 );
+        if (m_unixFd < 0 || bind( m_unixFd, (struct sockaddr*) &addr, sizeof( addr ) ) != 0 || listen( m_unixFd, 4 ) != 0)
+        {
+            Stop();
+            return false;
+        }
+    }
+    if (m_tcpFd < 0 && m_unixFd < 0)
+    {
+        return false;
+    }
+    m_running = true;
+    m_thread = std::thread( &CMetricsServer::ServeLoop, this );
+    return true;
+}
+
+void CMetricsServer::Stop()
+{
+    if (m_running)
+    {
+        m_running = false;
+        m_thread.join();
+    }
+    if (m_tcpFd >= 0)
+    {
+        close( m_tcpFd );
+        m_tcpFd = -1;
+    }
+    if (m_unixFd >= 0)
+    {
+        close( m_unixFd );
+        m_unixFd = -1;
+        unlink( m_socketPath.c_str() );
+    }
+}
+
+void CMetricsServer::ServeLoop()
+{
+    pthread_setname_np( pthread_self(), "metrics" );
+    while (m_running)
+    {
+        struct pollfd pfds[2];
+        nfds_t count = 0;
+        if (m_tcpFd >= 0)
+        {
+            pfds[count].fd = m_tcpFd;
+            pfds[count].events = POLLIN;
+            pfds[count].revents = 0;
+            ++count;
+        }
+        if (m_unixFd >= 0)
+        {
+            pfds[count].fd = m_unixFd;
+            pfds[count].events = POLLIN;
+            pfds[count].revents = 0;
+            ++count;
+        }
+        if (poll( pfds, count, 200 ) <= 0)
+        {
+            continue;
+        }
+        for (nfds_t i = 0; i < count; ++i)
+        {
+            if ((pfds[i].revents & POLLIN) == 0)
+            {
+                continue;
+            }
+            int fd = accept( pfds[i].fd, NULL, NULL );
+            if (fd >= 0)
+            {
+                Serve( fd );
+                close( fd );
+            }
+        }
+    }
+}
+
+void CMetricsServer::Serve( int fd )
+{
+    // One client at a time: do not let a stalled one hold up the next scrape for long.
+    struct timeval timeout;
+    timeout.tv_sec = 1;
+    timeout.tv_usec = 0;
+    setsockopt( fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof( timeout ) );
+    setsockopt( fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof( timeout ) );
+
+    char request[2048];
+    size_t length = 0;
+    while (length < sizeof( request ) - 1)
+    {
+        ssize_t n = recv( fd, request + length, sizeof( request ) - 1 - length, 0 );
+        if (n <= 0)
+        {
+            break;
+        }
+        length += (size_t) n;
+        request[length] = '\0';
+        if (strstr( request, "\r\n\r\n" ) != NULL)
+        {
+            break;
+        }
+    }
+    request[length] = '\0';
+
+    std::string response;
+    if (strncmp( request, "GET /metrics", 12 ) == 0 || strncmp( request, "GET / ", 6 ) == 0)
+    {
+        const std::string body = m_registry.Render();
+        response = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: "
+            + std::to_string( body.size() ) + "\r\nConnection: close\r\n\r\n" + body;
+        ++m_scrapes;
+    }
+    else
+    {
+        response = "HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+    }
+    const char* p = response.data();
+    size_t size = response.size();
+    while (size > 0)
+    {
+        ssize_t n = send( fd, p, size, MSG_NOSIGNAL );
+        if (n <= 0)
+        {
+            break;
+        }
+        p += n;
+        size -= (size_t) n;
+    }
+}
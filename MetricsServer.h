@@ -0,0 +1,49 @@
+// MetricsServer.h
+/*
+    Serves a CMetricsRegistry for Prometheus (or curl) on localhost:
+        http://127.0.0.1:<port>/metrics                          TCP, when port != 0
+        curl --unix-socket <socketPath> http://localhost/metrics  Unix socket, when a path is given
+
+    One thread accepts and answers one request at a time; a scrape only renders the
+    registry, so nothing on the camera or pipeline threads waits for it.
+*/
+#ifndef METRICSSERVER_H
+#define METRICSSERVER_H
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include <stdint.h>
+
+class CMetricsRegistry;
+
+class CMetricsServer
+{
+public:
+    CMetricsServer( CMetricsRegistry& registry, uint16_t port, const std::string& socketPath = "" );
+    ~CMetricsServer();
+
+    // Binds the TCP port on 127.0.0.1 and/or the Unix socket and starts the server thread.
+    bool Start();
+    void Stop();
+
+    uint64_t Scrapes() const { return m_scrapes; }
+
+private:
+    CMetricsServer( const CMetricsServer& );
+    CMetricsServer& operator=( const CMetricsServer& );
+
+    void ServeLoop();
+    void Serve( int fd );
+
+    CMetricsRegistry& m_registry;
+    const uint16_t m_port;
+    const std::string m_socketPath;
+    std::atomic<bool> m_running;
+    int m_tcpFd;
+    int m_unixFd;
+    std::thread m_thread;
+    std::atomic<uint64_t> m_scrapes;
+};
+
+#endif // METRICSSERVER_H
@@ -0,0 +1,195 @@
+// MotionGate.cpp
+#include "MotionGate.h"
+
+#include <cmath>
+#include <string.h>
+
+// Sixteen bytes / eight shorts / four ints per register: SSE on x86, NEON on aarch64.
+typedef uint8_t Byte16 __attribute__(( vector_size( 16 ) ));
+typedef uint16_t Short8 __attribute__(( vector_size( 16 ) ));
+typedef uint32_t Uint4 __attribute__(( vector_size( 16 ) ));
+
+static const uint32_t c_hashMultiplier = 0x9e3779b1u;
+static const uint64_t c_cellHashSeed = 0xcbf29ce484222325ull;
+static const uint64_t c_cellHashPrime = 0x100000001b3ull;
+// Each chunk adds at most 2 * 255 to a 16-bit lane.
+static const int c_chunksPerFlush = 65535 / 510;
+
+// Sum of n bytes and a hash of them.
+static inline void SumAndHash( const uint8_t* p, int n, uint32_t& sum, uint32_t& hash )
+{
+    Uint4 h = { 1u, 2u, 3u, 4u };
+    uint32_t total = 0;
+    int i = 0;
+    while (i + 16 <= n)
+    {
+        Short8 acc = { 0, 0, 0, 0, 0, 0, 0, 0 };
+        for (int chunk = 0; chunk < c_chunksPerFlush && i + 16 <= n; ++chunk, i += 16)
+        {
+            Byte16 bytes;
+            memcpy( &bytes, p + i, sizeof( bytes ) );
+            const Short8 pairs = (Short8) bytes;
+            acc += (pairs & 0xff) + (pairs >> 8);
+            // Shifts and adds only: a 32-bit lane multiply is not in baseline SSE2.
+            h = ((Uint4) bytes ^ h) + (h << 6) + (h >> 2);
+        }
+        for (int lane = 0; lane < 8; ++lane)
+        {
+            total += acc[lane];
+        }
+    }
+    uint32_t tail = h[0] ^ (h[1] * 3u) ^ (h[2] * 5u) ^ (h[3] * 7u);
+    for (; i < n; ++i)
+    {
+        total += p[i];
+        tail = (tail ^ p[i]) * c_hashMultiplier;
+    }
+    sum = total;
+    hash = tail;
+}
+
+CMotionGate::Config::Config()
+    : gridColumns( 32 )
+    , gridRows( 24 )
+    , rowStep( 4 )
+    , cellThreshold( 6.0f )
+    , changedFraction( 0.02f )
+    , refreshInterval( 30 )
+{
+}
+
+CMotionGate::CMotionGate( const Config& config )
+    : m_config( config )
+    , m_referenceRows( 0 )
+    , m_referenceCols( 0 )
+    , m_referenceType( -1 )
+    , m_sinceProcessed( 0 )
+    , m_changedFraction( 1.0f )
+    , m_frames( 0 )
+    , m_skipped( 0 )
+    , m_refreshes( 0 )
+    , m_identical( 0 )
+{
+    if (m_config.gridColumns < 1)
+    {
+        m_config.gridColumns = 1;
+    }
+    if (m_config.gridRows < 1)
+    {
+        m_config.gridRows = 1;
+    }
+    if (m_config.rowStep < 1)
+    {
+        m_config.rowStep = 1;
+    }
+    const size_t cells = (size_t) m_config.gridColumns * m_config.gridRows;
+    m_means.resize( cells );
+    m_hashes.resize( cells );
+    m_sums.resize( cells );
+    m_columnEdges.resize( m_config.gridColumns + 1 );
+}
+
+bool CMotionGate::Check( const cv::Mat& image )
+{
+    ++m_frames;
+    if (image.empty() || image.depth() != CV_8U)
+    {
+        return true;
+    }
+    ComputeSignature( image );
+
+    const size_t cells = m_means.size();
+    const bool haveReference = !m_referenceMeans.empty() && image.rows == m_referenceRows
+                               && image.cols == m_referenceCols && image.type() == m_referenceType;
+    bool identical = haveReference;
+    size_t changed = cells;
+    if (haveReference)
+    {
+        changed = 0;
+        for (size_t i = 0; i < cells; ++i)
+        {
+            if (m_hashes[i] == m_referenceHashes[i])
+            {
+                continue;
+            }
+            identical = false;
+            if (std::fabs( m_means[i] - m_referenceMeans[i] ) > m_config.cellThreshold)
+            {
+                ++changed;
+            }
+        }
+    }
+    m_changedFraction = (float) changed / cells;
+
+    bool process = m_changedFraction > m_config.changedFraction;
+    if (!process && m_config.refreshInterval > 0 && m_sinceProcessed >= m_config.refreshInterval)
+    {
+        process = true;
+        ++m_refreshes;
+    }
+    if (!process)
+    {
+        ++m_skipped;
+        ++m_sinceProcessed;
+        if (identical)
+        {
+            ++m_identical;
+        }
+        return false;
+    }
+
+    m_referenceMeans.swap( m_means );
+    m_referenceHashes.swap( m_hashes );
+    m_means.resize( cells );
+    m_hashes.resize( cells );
+    m_referenceRows = image.rows;
+    m_referenceCols = image.cols;
+    m_referenceType = image.type();
+    m_sinceProcessed = 0;
+    return true;
+}
+
+void CMotionGate::ComputeSignature( const cv::Mat& image )
+{
+    const int columns = m_config.gridColumns;
+    const int rows = m_config.gridRows;
+    const int width = image.cols * image.channels();
+    for (int gx = 0; gx <= columns; ++gx)
+    {
+        m_columnEdges[gx] = (int) ((int64_t) width * gx / columns);
+    }
+
+    for (int gy = 0; gy < rows; ++gy)
+    {
+        const int rowBegin = (int) ((int64_t) image.rows * gy / rows);
+        const int rowEnd = (int) ((int64_t) image.rows * (gy + 1) / rows);
+        uint32_t* pSums = &m_sums[gy * columns];
+        uint64_t* pHashes = &m_hashes[gy * columns];
+        for (int gx = 0; gx < columns; ++gx)
+        {
+            pSums[gx] = 0;
+            pHashes[gx] = c_cellHashSeed;
+        }
+
+        int rowsRead = 0;
+        for (int r = rowBegin; r < rowEnd; r += m_config.rowStep, ++rowsRead)
+        {
+            const uint8_t* p = image.ptr<uint8_t>( r );
+            for (int gx = 0; gx < columns; ++gx)
+            {
+                uint32_t sum;
+                uint32_t hash;
+                SumAndHash( p + m_columnEdges[gx], m_columnEdges[gx + 1] - m_columnEdges[gx], sum, hash );
+                pSums[gx] += sum;
+                pHashes[gx] = (pHashes[gx] ^ hash) * c_cellHashPrime;
+            }
+        }
+
+        float* pMeans = &m_means[gy * columns];
+        for (int gx = 0; gx < columns; ++gx)
+        {
+            const int bytes = rowsRead * (m_columnEdges[gx + 1] - m_columnEdges[gx]);
+            pMeans[gx] = bytes > 0 ? (float) pSums[gx] / bytes : 0.0f;
+        }
+    }
+}
@@ -0,0 +1,76 @@
+// MotionGate.h
+/*
+    Cheap change detection against the last processed frame.
+
+    The image is divided into gridColumns x gridRows cells. One pass over every rowStep-th
+    row produces, per cell, the mean byte value (the coarse signature) and a hash of the
+    bytes read. Sums are accumulated sixteen bytes per instruction with GCC/Clang vector
+    extensions (SSE on x86, NEON on the Jetson).
+
+    A cell whose hash equals the reference is unchanged without further work; otherwise it
+    counts as changed if its mean moved by more than cellThreshold grey levels, which sensor
+    noise does not. The frame is static when at most changedFraction of the cells changed.
+
+    The reference is only replaced by processed frames, so slow drift still accumulates
+    until it crosses the threshold. After refreshInterval consecutive skips the next frame
+    is processed regardless. Not thread safe; use one gate per camera.
+*/
+#ifndef MOTIONGATE_H
+#define MOTIONGATE_H
+
+#include <vector>
+#include <stdint.h>
+#include <opencv2/core.hpp>
+
+class CMotionGate
+{
+public:
+    struct Config
+    {
+        Config();
+
+        int gridColumns;
+        int gridRows;
+        int rowStep;                // Rows read per cell: every n-th.
+        float cellThreshold;        // Grey levels of mean change for a cell to count as changed.
+        float changedFraction;      // Of the cells; more than this and the frame is processed.
+        uint32_t refreshInterval;   // Consecutive skips before a forced refresh, 0 = never.
+    };
+
+    explicit CMotionGate( const Config& config = Config() );
+
+    // True if the frame should be processed; it then becomes the reference.
+    // image is 8 bits per channel; channels are treated as separate bytes. Other depths
+    // and empty images are always processed.
+    bool Check( const cv::Mat& image );
+
+    // Of the last Check() call.
+    float ChangedFraction() const { return m_changedFraction; }
+
+    uint64_t Frames() const { return m_frames; }
+    uint64_t Skipped() const { return m_skipped; }
+    uint64_t Refreshes() const { return m_refreshes; }
+    // Skipped frames whose every cell hash matched the reference.
+    uint64_t Identical() const { return m_identical; }
+
+private:
+    void ComputeSignature( const cv::Mat& image );
+
+    Config m_config;
+    // Current frame and reference, gridColumns * gridRows each.
+    std::vector<float> m_means, m_referenceMeans;
+    std::vector<uint64_t> m_hashes, m_referenceHashes;
+    std::vector<uint32_t> m_sums;
+    std::vector<int> m_columnEdges;     // Byte offset of each cell column, gridColumns + 1.
+    int m_referenceRows;
+    int m_referenceCols;
+    int m_referenceType;
+    uint32_t m_sinceProcessed;
+    float m_changedFraction;
+    uint64_t m_frames;
+    uint64_t m_skipped;
+    uint64_t m_refreshes;
+    uint64_t m_identical;
+};
+
+#endif // MOTIONGATE_H
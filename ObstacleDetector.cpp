@@ -0,0 +1,533 @@
+// ObstacleDetector.cpp
+#include "ObstacleDetector.h"
+
+#include <algorithm>
+#include <cmath>
+#include <string.h>
+#include <Eigen/Eigenvalues>
+
+// Four floats / ints per register: SSE on x86, NEON on aarch64.
+typedef float Float4 __attribute__(( vector_size( 16 ) ));
+typedef int32_t Int4 __attribute__(( vector_size( 16 ) ));
+
+static inline Float4 Load4( const float* p )
+{
+    Float4 v;
+    memcpy( &v, p, sizeof( v ) );
+    return v;
+}
+
+static const float c_dummyCoordinate = 1e6f;
+static const float c_minFloorRatio = 0.1f;      // Of the sample, for a plane to count as the floor.
+static const float c_warmStartRatio = 0.9f;     // Of the previous inlier share, to keep the plane.
+static const int c_refinePoints = 16384;
+
+static const float c_floorBias = 4096.0f;       // Voxel coordinates stay within +-maxRange / voxelSize.
+
+static const int c_keyBits = 21;
+static const int64_t c_keyOffset = 1 << (c_keyBits - 1);
+static const uint64_t c_keyMask = (1u << c_keyBits) - 1;
+
+static inline uint64_t VoxelKey( int64_t ix, int64_t iy, int64_t iz )
+{
+    return ((uint64_t) (ix + c_keyOffset) & c_keyMask) << (2 * c_keyBits)
+         | ((uint64_t) (iy + c_keyOffset) & c_keyMask) << c_keyBits
+         | ((uint64_t) (iz + c_keyOffset) & c_keyMask);
+}
+
+static inline int64_t VoxelCoordinate( uint64_t key, int axis )
+{
+    return (int64_t) ((key >> ((2 - axis) * c_keyBits)) & c_keyMask) - c_keyOffset;
+}
+
+CObstacleDetector::Config::Config()
+    : fx( 525.0f ), fy( 525.0f ), cx( 319.5f ), cy( 239.5f )
+    , depthScale( 0.001f )
+    , pixelStep( 1 )
+    , maxRange( 5.0f )
+    , up( 0.0f, -1.0f, 0.0f )
+    , maxTilt( 0.35f )
+    , inlierDistance( 0.02f )
+    , maxIterations( 64 )
+    , sampleSize( 1024 )
+    , minHeight( 0.05f )
+    , maxHeight( 1.5f )
+    , voxelSize( 0.1f )
+    , maxVoxels( 16384 )
+    , minClusterPoints( 30 )
+{
+}
+
+CObstacleDetector::CObstacleDetector( const Config& config )
+    : m_config( config )
+    , m_count( 0 )
+    , m_sampleCount( 0 )
+    , m_samplePadded( 0 )
+    , m_generation( 0 )
+    , m_droppedVoxels( 0 )
+    , m_havePlane( false )
+    , m_previousRatio( 0.0f )
+    , m_iterations( 0 )
+    , m_warmStarted( false )
+    , m_random( 0x9e3779b9u )
+{
+    m_config.up.normalize();
+    if (m_config.pixelStep < 1)
+    {
+        m_config.pixelStep = 1;
+    }
+    size_t tableSize = 1;
+    while (tableSize < 2 * (size_t) m_config.maxVoxels)
+    {
+        tableSize *= 2;
+    }
+    Voxel empty;
+    memset( &empty, 0, sizeof( empty ) );
+    m_voxels.assign( tableSize, empty );
+    m_occupied.reserve( m_config.maxVoxels );
+    m_stack.reserve( m_config.maxVoxels );
+    m_obstacles.reserve( 256 );
+    m_plane.normal = m_config.up;
+    m_plane.offset = 0.0f;
+}
+
+uint32_t CObstacleDetector::Random()
+{
+    // xorshift32: cheap and good enough to pick sample points.
+    m_random ^= m_random << 13;
+    m_random ^= m_random >> 17;
+    m_random ^= m_random << 5;
+    return m_random;
+}
+
+void CObstacleDetector::Reserve( size_t count )
+{
+    if (m_x.size() < count)
+    {
+        m_x.resize( count );
+        m_y.resize( count );
+        m_z.resize( count );
+        m_above.reserve( count );
+    }
+}
+
+bool CObstacleDetector::Detect( const cv::Mat& depth )
+{
+    if (depth.type() != CV_16UC1 && depth.type() != CV_32FC1)
+    {
+        m_obstacles.clear();
+        return false;
+    }
+    const int step = m_config.pixelStep;
+    if ((int) m_columnFactor.size() != depth.cols || (int) m_rowFactor.size() != depth.rows)
+    {
+        m_columnFactor.resize( depth.cols );
+        m_rowFactor.resize( depth.rows );
+        for (int u = 0; u < depth.cols; ++u)
+        {
+            m_columnFactor[u] = (u - m_config.cx) / m_config.fx;
+        }
+        for (int v = 0; v < depth.rows; ++v)
+        {
+            m_rowFactor[v] = (v - m_config.cy) / m_config.fy;
+        }
+    }
+    Reserve( (size_t) ((depth.rows + step - 1) / step) * ((depth.cols + step - 1) / step) );
+
+    size_t n = 0;
+    const float maxRange = m_config.maxRange;
+    for (int v = 0; v < depth.rows; v += step)
+    {
+        const float rowFactor = m_rowFactor[v];
+        if (depth.type() == CV_16UC1)
+        {
+            const uint16_t* p = depth.ptr<uint16_t>( v );
+            const float scale = m_config.depthScale;
+            for (int u = 0; u < depth.cols; u += step)
+            {
+                const float z = p[u] * scale;
+                if (z > 0.0f && z < maxRange)
+                {
+                    m_x[n] = m_columnFactor[u] * z;
+                    m_y[n] = rowFactor * z;
+                    m_z[n] = z;
+                    ++n;
+                }
+            }
+        }
+        else
+        {
+            const float* p = depth.ptr<float>( v );
+            for (int u = 0; u < depth.cols; u += step)
+            {
+                const float z = p[u];
+                if (z > 0.0f && z < maxRange)      // Also rejects NaN.
+                {
+                    m_x[n] = m_columnFactor[u] * z;
+                    m_y[n] = rowFactor * z;
+                    m_z[n] = z;
+                    ++n;
+                }
+            }
+        }
+    }
+    m_count = n;
+    return Run();
+}
+
+bool CObstacleDetector::Detect( const float* xyz, size_t count )
+{
+    Reserve( count );
+    size_t n = 0;
+    const float maxRange = m_config.maxRange;
+    for (size_t i = 0; i < count; ++i)
+    {
+        const float z = xyz[3 * i + 2];
+        if (z > 0.0f && z < maxRange && std::isfinite( xyz[3 * i] ) && std::isfinite( xyz[3 * i + 1] ))
+        {
+            m_x[n] = xyz[3 * i];
+            m_y[n] = xyz[3 * i + 1];
+            m_z[n] = z;
+            ++n;
+        }
+    }
+    m_count = n;
+    return Run();
+}
+
+bool CObstacleDetector::Run()
+{
+    m_obstacles.clear();
+    m_iterations = 0;
+    m_warmStarted = false;
+    if (m_count < 3)
+    {
+        return false;
+    }
+
+    m_sampleCount = m_count < (size_t) m_config.sampleSize ? m_count : (size_t) m_config.sampleSize;
+    m_samplePadded = (m_sampleCount + 3) & ~(size_t) 3;
+    if (m_sx.size() < m_samplePadded)
+    {
+        m_sx.resize( m_samplePadded );
+        m_sy.resize( m_samplePadded );
+        m_sz.resize( m_samplePadded );
+    }
+    for (size_t i = 0; i < m_sampleCount; ++i)
+    {
+        const size_t index = Random() % m_count;
+        m_sx[i] = m_x[index];
+        m_sy[i] = m_y[index];
+        m_sz[i] = m_z[index];
+    }
+    for (size_t i = m_sampleCount; i < m_samplePadded; ++i)
+    {
+        m_sx[i] = m_sy[i] = m_sz[i] = c_dummyCoordinate;
+    }
+
+    if (!FindPlane())
+    {
+        m_havePlane = false;
+        return false;
+    }
+    RefinePlane();
+    Cluster();
+    return true;
+}
+
+uint32_t CObstacleDetector::CountInliers( float a, float b, float c, float d ) const
+{
+    const Float4 va = { a, a, a, a };
+    const Float4 vb = { b, b, b, b };
+    const Float4 vc = { c, c, c, c };
+    const Float4 vd = { d, d, d, d };
+    const float t = m_config.inlierDistance;
+    const Float4 vt = { t, t, t, t };
+    const Float4 vnt = -vt;
+    Int4 count = { 0, 0, 0, 0 };
+    for (size_t i = 0; i < m_samplePadded; i += 4)
+    {
+        const Float4 distance = va * Load4( &m_sx[i] ) + vb * Load4( &m_sy[i] ) + vc * Load4( &m_sz[i] ) + vd;
+        // Comparisons give -1 in each lane where they hold.
+        count -= (distance < vt) & (distance > vnt);
+    }
+    return (uint32_t) (count[0] + count[1] + count[2] + count[3]);
+}
+
+bool CObstacleDetector::FindPlane()
+{
+    uint32_t bestCount = 0;
+    GroundPlane best = m_plane;
+    if (m_havePlane)
+    {
+        bestCount = CountInliers( m_plane.normal.x(), m_plane.normal.y(), m_plane.normal.z(), m_plane.offset );
+        const float ratio = (float) bestCount / m_sampleCount;
+        if (ratio >= c_minFloorRatio && ratio >= c_warmStartRatio * m_previousRatio)
+        {
+            m_warmStarted = true;
+            m_previousRatio = ratio;
+            return true;
+        }
+    }
+
+    const float minCos = std::cos( m_config.maxTilt );
+    const double logFailure = std::log( 0.01 );     // 99% confidence of one all-inlier draw.
+    int required = m_config.maxIterations;
+    while (m_iterations < required && m_iterations < m_config.maxIterations)
+    {
+        ++m_iterations;
+        const size_t i0 = Random() % m_sampleCount;
+        const size_t i1 = Random() % m_sampleCount;
+        const size_t i2 = Random() % m_sampleCount;
+        const Eigen::Vector3f p0( m_sx[i0], m_sy[i0], m_sz[i0] );
+        const Eigen::Vector3f p1( m_sx[i1], m_sy[i1], m_sz[i1] );
+        const Eigen::Vector3f p2( m_sx[i2], m_sy[i2], m_sz[i2] );
+        Eigen::Vector3f normal = (p1 - p0).cross( p2 - p0 );
+        const float length = normal.norm();
+        if (length < 1e-6f)
+        {
+            continue;
+        }
+        normal /= length;
+        float cosine = normal.dot( m_config.up );
+        if (cosine < 0.0f)
+        {
+            normal = -normal;
+            cosine = -cosine;
+        }
+        if (cosine < minCos)
+        {
+            continue;
+        }
+        const float offset = -normal.dot( p0 );
+        const uint32_t count = CountInliers( normal.x(), normal.y(), normal.z(), offset );
+        if (count > bestCount)
+        {
+            bestCount = count;
+            best.normal = normal;
+            best.offset = offset;
+            const double w = (double) bestCount / m_sampleCount;
+            const double allInliers = w * w * w;
+            if (allInliers >= 1.0)
+            {
+                break;
+            }
+            required = (int) std::ceil( logFailure / std::log( 1.0 - allInliers ) );
+        }
+    }
+
+    const float ratio = (float) bestCount / m_sampleCount;
+    if (ratio < c_minFloorRatio)
+    {
+        return false;
+    }
+    m_plane = best;
+    m_havePlane = true;
+    m_previousRatio = ratio;
+    return true;
+}
+
+void CObstacleDetector::RefinePlane()
+{
+    const size_t stride = m_count > (size_t) c_refinePoints ? m_count / c_refinePoints : 1;
+    const Eigen::Vector3f normal = m_plane.normal;
+    const float offset = m_plane.offset;
+    const float t = m_config.inlierDistance;
+    Eigen::Vector3d sum = Eigen::Vector3d::Zero();
+    Eigen::Matrix3d sumOuter = Eigen::Matrix3d::Zero();
+    size_t n = 0;
+    for (size_t i = 0; i < m_count; i += stride)
+    {
+        const float distance = normal.x() * m_x[i] + normal.y() * m_y[i] + normal.z() * m_z[i] + offset;
+        if (distance < t && distance > -t)
+        {
+            const Eigen::Vector3d p( m_x[i], m_y[i], m_z[i] );
+            sum += p;
+            sumOuter += p * p.transpose();
+            ++n;
+        }
+    }
+    if (n < 3)
+    {
+        return;
+    }
+    const Eigen::Vector3d centroid = sum / (double) n;
+    const Eigen::Matrix3d covariance = sumOuter / (double) n - centroid * centroid.transpose();
+    Eigen::SelfAdjointEigenSolver<Eigen::Matrix3d> solver( covariance );
+    // Eigenvalues are sorted ascending: the floor normal is the direction of least spread.
+    Eigen::Vector3f refined = solver.eigenvectors().col( 0 ).cast<float>();
+    if (refined.dot( m_config.up ) < 0.0f)
+    {
+        refined = -refined;
+    }
+    if (refined.dot( m_config.up ) < std::cos( m_config.maxTilt ))
+    {
+        return;
+    }
+    m_plane.normal = refined;
+    m_plane.offset = -refined.dot( centroid.cast<float>() );
+}
+
+int32_t CObstacleDetector::FindVoxel( uint64_t key ) const
+{
+    const size_t mask = m_voxels.size() - 1;
+    size_t slot = (size_t) ((key * 0x9e3779b97f4a7c15ull) >> 32) & mask;
+    while (m_voxels[slot].generation == m_generation)
+    {
+        if (m_voxels[slot].key == key)
+        {
+            return (int32_t) slot;
+        }
+        slot = (slot + 1) & mask;
+    }
+    return -1;
+}
+
+void CObstacleDetector::Cluster()
+{
+    if (++m_generation == 0)
+    {
+        // Wrapped: stale slots could match the new generation.
+        for (size_t i = 0; i < m_voxels.size(); ++i)
+        {
+            m_voxels[i].generation = 0;
+        }
+        m_generation = 1;
+    }
+    m_occupied.clear();
+    m_droppedVoxels = 0;
+
+    // Heights four points at a time; most of the points are floor and are rejected here.
+    const Eigen::Vector3f normal = m_plane.normal;
+    const Float4 va = { normal.x(), normal.x(), normal.x(), normal.x() };
+    const Float4 vb = { normal.y(), normal.y(), normal.y(), normal.y() };
+    const Float4 vc = { normal.z(), normal.z(), normal.z(), normal.z() };
+    const Float4 vd = { m_plane.offset, m_plane.offset, m_plane.offset, m_plane.offset };
+    const Float4 vmin = { m_config.minHeight, m_config.minHeight, m_config.minHeight, m_config.minHeight };
+    const Float4 vmax = { m_config.maxHeight, m_config.maxHeight, m_config.maxHeight, m_config.maxHeight };
+    m_above.clear();
+    size_t i = 0;
+    for (; i + 4 <= m_count; i += 4)
+    {
+        const Float4 height = va * Load4( &m_x[i] ) + vb * Load4( &m_y[i] ) + vc * Load4( &m_z[i] ) + vd;
+        const Int4 above = (height >= vmin) & (height <= vmax);
+        if ((above[0] | above[1] | above[2] | above[3]) == 0)
+        {
+            continue;
+        }
+        for (int lane = 0; lane < 4; ++lane)
+        {
+            if (above[lane])
+            {
+                m_above.push_back( (uint32_t) (i + lane) );
+            }
+        }
+    }
+    for (; i < m_count; ++i)
+    {
+        const float height = normal.x() * m_x[i] + normal.y() * m_y[i] + normal.z() * m_z[i] + m_plane.offset;
+        if (height >= m_config.minHeight && height <= m_config.maxHeight)
+        {
+            m_above.push_back( (uint32_t) i );
+        }
+    }
+
+    const size_t mask = m_voxels.size() - 1;
+    const float inverse = 1.0f / m_config.voxelSize;
+    uint64_t lastKey = 0;
+    int64_t lastSlot = -1;
+    for (size_t a = 0; a < m_above.size(); ++a)
+    {
+        const uint32_t index = m_above[a];
+        const float x = m_x[index], y = m_y[index], z = m_z[index];
+        // Truncation of a positive value is floor(); avoids a libm call per coordinate.
+        const uint64_t key = VoxelKey( (int64_t) (x * inverse + c_floorBias) - (int64_t) c_floorBias,
+                                       (int64_t) (y * inverse + c_floorBias) - (int64_t) c_floorBias,
+                                       (int64_t) (z * inverse + c_floorBias) - (int64_t) c_floorBias );
+        // Points arrive in raster order, so runs of them fall into the same voxel.
+        if (key != lastKey || lastSlot < 0)
+        {
+            size_t slot = (size_t) ((key * 0x9e3779b97f4a7c15ull) >> 32) & mask;
+            while (m_voxels[slot].generation == m_generation && m_voxels[slot].key != key)
+            {
+                slot = (slot + 1) & mask;
+            }
+            lastKey = key;
+            lastSlot = (int64_t) slot;
+        }
+        Voxel& voxel = m_voxels[lastSlot];
+        if (voxel.generation != m_generation)
+        {
+            if (m_occupied.size() >= m_config.maxVoxels)
+            {
+                ++m_droppedVoxels;
+                lastSlot = -1;
+                continue;
+            }
+            voxel.key = key;
+            voxel.generation = m_generation;
+            voxel.points = 0;
+            voxel.component = -1;
+            voxel.min[0] = voxel.max[0] = x;
+            voxel.min[1] = voxel.max[1] = y;
+            voxel.min[2] = voxel.max[2] = z;
+            m_occupied.push_back( (uint32_t) lastSlot );
+        }
+        ++voxel.points;
+        voxel.min[0] = std::min( voxel.min[0], x );
+        voxel.min[1] = std::min( voxel.min[1], y );
+        voxel.min[2] = std::min( voxel.min[2], z );
+        voxel.max[0] = std::max( voxel.max[0], x );
+        voxel.max[1] = std::max( voxel.max[1], y );
+        voxel.max[2] = std::max( voxel.max[2], z );
+    }
+
+    // Connected components over the 26-neighbourhood.
+    int32_t components = 0;
+    for (size_t o = 0; o < m_occupied.size(); ++o)
+    {
+        Voxel& seed = m_voxels[m_occupied[o]];
+        if (seed.component >= 0)
+        {
+            continue;
+        }
+        seed.component = components;
+        m_stack.clear();
+        m_stack.push_back( m_occupied[o] );
+        ObstacleBox box;
+        box.min = Eigen::Vector3f( seed.min[0], seed.min[1], seed.min[2] );
+        box.max = Eigen::Vector3f( seed.max[0], seed.max[1], seed.max[2] );
+        box.points = 0;
+        while (!m_stack.empty())
+        {
+            const Voxel& voxel = m_voxels[m_stack.back()];
+            m_stack.pop_back();
+            box.points += voxel.points;
+            box.min = box.min.cwiseMin( Eigen::Vector3f( voxel.min[0], voxel.min[1], voxel.min[2] ) );
+            box.max = box.max.cwiseMax( Eigen::Vector3f( voxel.max[0], voxel.max[1], voxel.max[2] ) );
+            const int64_t ix = VoxelCoordinate( voxel.key, 0 );
+            const int64_t iy = VoxelCoordinate( voxel.key, 1 );
+            const int64_t iz = VoxelCoordinate( voxel.key, 2 );
+            for (int dx = -1; dx <= 1; ++dx)
+            {
+                for (int dy = -1; dy <= 1; ++dy)
+                {
+                    for (int dz = -1; dz <= 1; ++dz)
+                    {
+                        const int32_t neighbor = FindVoxel( VoxelKey( ix + dx, iy + dy, iz + dz ) );
+                        if (neighbor >= 0 && m_voxels[neighbor].component < 0)
+                        {
+                            m_voxels[neighbor].component = components;
+                            m_stack.push_back( (uint32_t) neighbor );
+                        }
+                    }
+                }
+            }
+        }
+        ++components;
+        if (box.points >= m_config.minClusterPoints)
+        {
+            m_obstacles.push_back( box );
+        }
+    }
+}
@@ -0,0 +1,131 @@
+// ObstacleDetector.h
+/*
+    Floor plane and obstacle boxes from a depth map or point cloud.
+
+    1. Depth pixels are back-projected into structure-of-arrays x/y/z buffers (camera frame:
+       x right, y down, z forward).
+    2. RANSAC fits the floor on a random sample of the points. Plane hypotheses are scored
+       four points per instruction with GCC/Clang vector extensions, which compile to SSE on
+       x86 and NEON on the Jetson. The previous frame's plane is scored first: if it still
+       explains the sample about as well as before, no new hypotheses are drawn at all.
+       Hypotheses tilted more than maxTilt from the expected up direction are skipped.
+    3. The winning plane is refined by least squares on its inliers.
+    4. Points between minHeight and maxHeight above the floor are binned into a voxel hash;
+       connected occupied voxels form one obstacle, reported as an axis-aligned box.
+
+    All buffers are members sized on first use and reused, so a steady stream of
+    same-sized frames does not allocate. Not thread safe; use one detector per camera.
+*/
+#ifndef OBSTACLEDETECTOR_H
+#define OBSTACLEDETECTOR_H
+
+#include <vector>
+#include <stdint.h>
+#include <Eigen/Core>
+#include <opencv2/core.hpp>
+
+// normal . p + offset = 0, normal is unit length and points up, away from the floor.
+struct GroundPlane
+{
+    Eigen::Vector3f normal;
+    float offset;
+};
+
+struct ObstacleBox
+{
+    Eigen::Vector3f min;            // m, camera frame
+    Eigen::Vector3f max;
+    uint32_t points;
+};
+
+class CObstacleDetector
+{
+public:
+    struct Config
+    {
+        Config();
+
+        float fx, fy, cx, cy;       // Depth camera intrinsics, pixels.
+        float depthScale;           // m per unit of a CV_16UC1 depth map.
+        int pixelStep;              // Use every n-th pixel in both directions.
+        float maxRange;             // m, farther points are ignored.
+        Eigen::Vector3f up;         // Expected floor normal in the camera frame.
+        float maxTilt;              // rad between a floor hypothesis and up.
+        float inlierDistance;       // m
+        int maxIterations;          // RANSAC hypotheses per frame.
+        int sampleSize;             // Points scored per hypothesis.
+        float minHeight;            // m above the floor for a point to be an obstacle.
+        float maxHeight;            // m, e.g. the robot's height.
+        float voxelSize;            // m
+        uint32_t maxVoxels;         // Occupied voxels per frame; the hash table is twice this.
+        uint32_t minClusterPoints;  // Smaller clusters are treated as noise.
+    };
+
+    explicit CObstacleDetector( const Config& config = Config() );
+
+    // depth is CV_16UC1 (scaled by depthScale, 0 = invalid) or CV_32FC1 in m.
+    // Returns false if no floor was found; obstacles are then empty.
+    bool Detect( const cv::Mat& depth );
+    // count interleaved x, y, z points in the camera frame.
+    bool Detect( const float* xyz, size_t count );
+
+    const GroundPlane& Plane() const { return m_plane; }
+    const std::vector<ObstacleBox>& Obstacles() const { return m_obstacles; }
+    // Hands the obstacles over without copying them; the detector keeps the vector passed in
+    // (and its capacity) for the next Detect().
+    void SwapObstacles( std::vector<ObstacleBox>& obstacles ) { m_obstacles.swap( obstacles ); }
+
+    // Of the last Detect() call.
+    size_t Points() const { return m_count; }
+    int Iterations() const { return m_iterations; }
+    bool WarmStarted() const { return m_warmStarted; }
+    uint32_t DroppedVoxels() const { return m_droppedVoxels; }
+
+private:
+    struct Voxel
+    {
+        uint64_t key;
+        uint32_t generation;        // Slot is empty unless this equals m_generation.
+        uint32_t points;
+        int32_t component;
+        float min[3];
+        float max[3];
+    };
+
+    void Reserve( size_t count );
+    bool Run();
+    bool FindPlane();
+    void RefinePlane();
+    void Cluster();
+    uint32_t CountInliers( float a, float b, float c, float d ) const;
+    int32_t FindVoxel( uint64_t key ) const;
+    uint32_t Random();
+
+    Config m_config;
+
+    std::vector<float> m_x, m_y, m_z;
+    size_t m_count;
+    std::vector<uint32_t> m_above;  // Indices of the points between minHeight and maxHeight.
+    // RANSAC sample, padded to a multiple of 4 with far-away dummies.
+    std::vector<float> m_sx, m_sy, m_sz;
+    size_t m_sampleCount;
+    size_t m_samplePadded;
+    // Back-projection factors per column and row.
+    std::vector<float> m_columnFactor, m_rowFactor;
+
+    std::vector<Voxel> m_voxels;
+    std::vector<uint32_t> m_occupied;
+    std::vector<uint32_t> m_stack;
+    uint32_t m_generation;
+    uint32_t m_droppedVoxels;
+
+    GroundPlane m_plane;
+    bool m_havePlane;
+    float m_previousRatio;          // Inlier share of the plane on the previous frame.
+    int m_iterations;
+    bool m_warmStarted;
+    uint32_t m_random;
+    std::vector<ObstacleBox> m_obstacles;
+};
+
+#endif // OBSTACLEDETECTOR_H
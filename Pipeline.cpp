@@ -0,0 +1,483 @@
+// Pipeline.cpp
+#include "Pipeline.h"
+
+#include <chrono>
+#include <iostream>
+#include <string.h>
+#include <pthread.h>
+#include <opencv2/imgproc/imgproc.hpp>
+#include "MemoryBudget.h"
+#include "MetricsRegistry.h"
+
+void GrayOp::operator()( PipelineFrame& frame )
+{
+    if (frame.image.channels() == 3)
+    {
+        cv::Mat gray;
+        cv::cvtColor( frame.image, gray, cv::COLOR_BGR2GRAY );
+        frame.image = gray;
+    }
+}
+
+void DownscaleOp::operator()( PipelineFrame& frame )
+{
+    if (m_factor > 0.0 && m_factor < 1.0)
+    {
+        cv::Mat scaled;
+        cv::resize( frame.image, scaled, cv::Size(), m_factor, m_factor, cv::INTER_AREA );
+        frame.image = scaled;
+    }
+}
+
+IPipelineStage* CreatePipelineStage( const StageConfig& config )
+{
+    if (config.type == "gray")
+    {
+        return new CStageAdapter<GrayOp>( GrayOp(), "gray" );
+    }
+    if (config.type == "downscale")
+    {
+        return new CStageAdapter<DownscaleOp>( DownscaleOp( config.factor ), "downscale" );
+    }
+    if (config.type == "gain")
+    {
+        return new CStageAdapter<CPixelOp<GainPixel> >( CPixelOp<GainPixel>( GainPixel( config.gain ) ), "gain" );
+    }
+    if (config.type == "threshold")
+    {
+        return new CStageAdapter<CPixelOp<ThresholdPixel> >( CPixelOp<ThresholdPixel>( ThresholdPixel( config.threshold ) ), "threshold" );
+    }
+    if (config.type == "obstacles")
+    {
+        CObstacleDetector::Config detector;
+        detector.fx = detector.fy = (float) config.focalLength;
+        detector.voxelSize = (float) config.voxelSize;
+        return new CStageAdapter<ObstacleOp>( ObstacleOp( detector ), "obstacles" );
+    }
+    if (config.type == "motiongate")
+    {
+        CMotionGate::Config gate;
+        gate.cellThreshold = (float) config.cellThreshold;
+        gate.refreshInterval = config.refreshInterval;
+        return new CStageAdapter<MotionGateOp>( MotionGateOp( gate ), "motiongate" );
+    }
+    return NULL;
+}
+
+ObstacleOp::ObstacleOp( const CObstacleDetector::Config& config )
+    : m_shared( std::make_shared<Shared>() )
+{
+    m_shared->config = config;
+}
+
+void ObstacleOp::operator()( PipelineFrame& frame )
+{
+    if (frame.depth.empty())
+    {
+        return;
+    }
+    Camera& camera = CameraFor( frame.cameraIndex );
+    std::lock_guard<std::mutex> lock( camera.mutex );
+    if (!camera.pDetector)
+    {
+        CObstacleDetector::Config config = m_shared->config;
+        config.cx = (frame.depth.cols - 1) * 0.5f;
+        config.cy = (frame.depth.rows - 1) * 0.5f;
+        camera.pDetector.reset( new CObstacleDetector( config ) );
+    }
+    camera.pDetector->Detect( frame.depth );
+    // The detector gets the spare, which has capacity from earlier frames, for the next Detect().
+    frame.obstacles.swap( camera.spare );
+    camera.pDetector->SwapObstacles( frame.obstacles );
+}
+
+void ObstacleOp::Recycle( PipelineFrame& frame )
+{
+    if (frame.depth.empty())
+    {
+        return;
+    }
+    Camera& camera = CameraFor( frame.cameraIndex );
+    std::lock_guard<std::mutex> lock( camera.mutex );
+    if (frame.obstacles.capacity() > camera.spare.capacity())
+    {
+        frame.obstacles.clear();
+        frame.obstacles.swap( camera.spare );
+    }
+}
+
+ObstacleOp::Camera& ObstacleOp::CameraFor( size_t cameraIndex )
+{
+    std::lock_guard<std::mutex> lock( m_shared->mutex );
+    while (m_shared->cameras.size() <= cameraIndex)
+    {
+        m_shared->cameras.push_back( std::unique_ptr<Camera>( new Camera ) );
+    }
+    return *m_shared->cameras[cameraIndex];
+}
+
+MotionGateOp::MotionGateOp( const CMotionGate::Config& config )
+    : m_shared( std::make_shared<Shared>() )
+{
+    m_shared->config = config;
+}
+
+void MotionGateOp::operator()( PipelineFrame& frame )
+{
+    Camera* pCamera;
+    {
+        std::lock_guard<std::mutex> lock( m_shared->mutex );
+        while (m_shared->cameras.size() <= frame.cameraIndex)
+        {
+            m_shared->cameras.push_back( std::unique_ptr<Camera>( new Camera( m_shared->config ) ) );
+        }
+        pCamera = m_shared->cameras[frame.cameraIndex].get();
+    }
+
+    std::lock_guard<std::mutex> lock( pCamera->mutex );
+    frame.staticScene = !pCamera->gate.Check( frame.image );
+}
+
+CPipeline::CPipeline( const PipelineConfig& config )
+    : m_queue( config.queueSize )
+    , m_threadCount( config.threadCount > 0 ? config.threadCount : 1 )
+    , m_processed( 0 )
+    , m_sequence( 0 )
+    , m_gated( 0 )
+    , m_savedNs( 0 )
+    , m_gatedStagesNs( 0 )
+    , m_exposureToStartFrames( 0 )
+    , m_exposureToStartNs( 0 )
+    , m_pFrameAccount( NULL )
+    , m_skipped( 0 )
+    , m_downscaled( 0 )
+    , m_refused( 0 )
+{
+    if (config.schedulerWorkers > 0)
+    {
+        m_scheduler.reset( new CTaskScheduler( config.schedulerWorkers ) );
+    }
+    for (size_t i = 0; i < config.stages.size(); ++i)
+    {
+        IPipelineStage* pStage = CreatePipelineStage( config.stages[i] );
+        if (pStage == NULL)
+        {
+            std::cerr << "Unknown pipeline stage '" << config.stages[i].type << "' ignored." << std::endl;
+            continue;
+        }
+        m_stages.push_back( std::unique_ptr<IPipelineStage>( pStage ) );
+    }
+    m_gateIndex = 0;
+    while (m_gateIndex < m_stages.size() && strcmp( m_stages[m_gateIndex]->Name(), "motiongate" ) != 0)
+    {
+        ++m_gateIndex;
+    }
+}
+
+CPipeline::~CPipeline()
+{
+    Stop();
+}
+
+void CPipeline::AddSink( IPipelineSink* pSink )
+{
+    m_sinks.push_back( pSink );
+}
+
+void CPipeline::AttachMetrics( CMetricsRegistry& registry )
+{
+    m_stageSeconds.clear();
+    for (size_t i = 0; i < m_stages.size(); ++i)
+    {
+        const std::string labels = CMetricsRegistry::Label( "stage", m_stages[i]->Name() ) + ","
+            + CMetricsRegistry::Label( "position", std::to_string( i ) );
+        m_stageSeconds.push_back( &registry.Histogram( "robot_pipeline_stage_seconds",
+            "Time spent in each pipeline stage per frame.", labels ) );
+    }
+    registry.GaugeFunction( "robot_pipeline_queue_depth", "Frames waiting for a pipeline worker.", "",
+                            [this]() { return (double) QueueDepth(); } );
+    registry.CounterFunction( "robot_pipeline_dropped_frames_total",
+                              "Frames dropped because the workers fell behind.", "",
+                              [this]() { return (double) Dropped(); } );
+    registry.CounterFunction( "robot_pipeline_processed_frames_total", "Frames through all stages and sinks.", "",
+                              [this]() { return (double) Processed(); } );
+    registry.CounterFunction( "robot_pipeline_gated_frames_total",
+                              "Frames on which the motion gate skipped the remaining stages.", "",
+                              [this]() { return (double) Gated(); } );
+    registry.CounterFunction( "robot_pipeline_gate_saved_seconds_total",
+                              "Estimated stage time not spent on frames the motion gate skipped.", "",
+                              [this]() { return SavedNs() * 1e-9; } );
+    registry.CounterFunction( "robot_pipeline_skipped_frames_total", "Frames skipped under memory pressure.", "",
+                              [this]() { return (double) Skipped(); } );
+    registry.CounterFunction( "robot_pipeline_downscaled_frames_total", "Frames downscaled under memory pressure.", "",
+                              [this]() { return (double) Downscaled(); } );
+    registry.CounterFunction( "robot_pipeline_refused_frames_total", "Frames refused by the memory budget.", "",
+                              [this]() { return (double) Refused(); } );
+}
+
+void CPipeline::AttachBudget( CMemoryBudget& budget )
+{
+    m_pFrameAccount = &budget.Account( "pipeline.frames" );
+}
+
+void CPipeline::Start()
+{
+    if (m_scheduler)
+    {
+        return;
+    }
+    for (size_t i = 0; i < m_threadCount; ++i)
+    {
+        m_workers.push_back( std::thread( &CPipeline::WorkerLoop, this ) );
+    }
+}
+
+void CPipeline::Stop()
+{
+    if (m_scheduler)
+    {
+        m_frameTasks.Wait( *m_scheduler );
+    }
+    m_queue.Close();
+    for (size_t i = 0; i < m_workers.size(); ++i)
+    {
+        m_workers[i].join();
+    }
+    m_workers.clear();
+}
+
+CPipeline::PushResult CPipeline::Push( PipelineFrame&& frame )
+{
+    size_t queueLimit = m_queue.Capacity();
+    if (m_pFrameAccount != NULL)
+    {
+        const PushResult result = Admit( frame, queueLimit );
+        if (result != Push_Queued)
+        {
+            return result;
+        }
+    }
+    frame.sequence = ++m_sequence;
+    if (!m_scheduler)
+    {
+        if (m_pFrameAccount == NULL)
+        {
+            return m_queue.Push( std::move( frame ) ) ? Push_Queued : Push_DroppedOldest;
+        }
+        std::vector<PipelineFrame> dropped;
+        const bool kept = m_queue.Push( std::move( frame ), queueLimit, dropped );
+        for (size_t i = 0; i < dropped.size(); ++i)
+        {
+            ReleaseFrame( dropped[i] );
+        }
+        return kept ? Push_Queued : Push_DroppedOldest;
+    }
+
+    // Same bound as the queue: frames that fell more than queueSize behind are cancelled.
+    const uint64_t sequence = frame.sequence;
+    if (sequence > queueLimit)
+    {
+        m_scheduler->RaisePriorityFloor( sequence - queueLimit );
+    }
+    frame.pScheduler = m_scheduler.get();
+    std::shared_ptr<PipelineFrame> pFrame;
+    if (m_pFrameAccount == NULL)
+    {
+        pFrame = std::make_shared<PipelineFrame>( std::move( frame ) );
+    }
+    else
+    {
+        // Cancelled tasks release the frame's bytes too, when the task is destroyed.
+        pFrame.reset( new PipelineFrame( std::move( frame ) ), [this]( PipelineFrame* p )
+        {
+            ReleaseFrame( *p );
+            delete p;
+        } );
+    }
+    m_scheduler->Submit( [this, pFrame]()
+    {
+        ProcessFrame( *pFrame );
+        RecycleFrame( *pFrame );
+    }, sequence, &m_frameTasks );
+    return Push_Queued;
+}
+
+static size_t MatBytes( const cv::Mat& mat )
+{
+    return mat.total() * mat.elemSize();
+}
+
+CPipeline::PushResult CPipeline::Admit( PipelineFrame& frame, size_t& queueLimit )
+{
+    const CMemoryBudget::Pressure pressure = m_pFrameAccount->Budget().CurrentPressure();
+    if (pressure >= CMemoryBudget::Pressure_SkipFrames && (frame.frameId & 1) != 0)
+    {
+        ++m_skipped;
+        return Push_Skipped;
+    }
+    if (pressure >= CMemoryBudget::Pressure_LowerResolution && frame.image.rows > 1 && frame.image.cols > 1)
+    {
+        cv::Mat scaled;
+        cv::resize( frame.image, scaled, cv::Size(), 0.5, 0.5, cv::INTER_AREA );
+        frame.image = scaled;
+        frame.pooledImage = false;
+        if (!frame.depth.empty())
+        {
+            // Depth is not averaged across edges.
+            cv::resize( frame.depth, scaled, cv::Size(), 0.5, 0.5, cv::INTER_NEAREST );
+            frame.depth = scaled;
+        }
+        ++m_downscaled;
+    }
+    if (pressure >= CMemoryBudget::Pressure_FewerBuffers)
+    {
+        queueLimit = queueLimit > 1 ? queueLimit / 2 : 1;
+    }
+    const size_t bytes = (frame.pooledImage ? 0 : MatBytes( frame.image )) + MatBytes( frame.depth );
+    if (!m_pFrameAccount->TryReserve( bytes ))
+    {
+        ++m_refused;
+        return Push_Refused;
+    }
+    frame.budgetBytes = bytes;
+    return Push_Queued;
+}
+
+// Frees the frame's buffers (as far as the pipeline holds them) before releasing their bytes.
+void CPipeline::ReleaseFrame( PipelineFrame& frame )
+{
+    const size_t bytes = frame.budgetBytes;
+    if (bytes != 0)
+    {
+        frame = PipelineFrame();
+        m_pFrameAccount->Release( bytes );
+    }
+}
+
+void CPipeline::Arm( uint64_t spinNs )
+{
+    if (!m_scheduler)
+    {
+        m_queue.Arm( std::chrono::nanoseconds( spinNs ) );
+    }
+}
+
+uint64_t CPipeline::AverageExposureToStartNs() const
+{
+    const uint64_t frames = m_exposureToStartFrames;
+    return frames > 0 ? m_exposureToStartNs / frames : 0;
+}
+
+CPipeline::LastOutput& CPipeline::LastOutputFor( size_t cameraIndex )
+{
+    std::lock_guard<std::mutex> lock( m_lastOutputMutex );
+    while (m_lastOutputs.size() <= cameraIndex)
+    {
+        m_lastOutputs.push_back( std::unique_ptr<LastOutput>( new LastOutput ) );
+    }
+    return *m_lastOutputs[cameraIndex];
+}
+
+size_t CPipeline::Dropped() const
+{
+    size_t dropped = m_queue.Dropped();
+    if (m_scheduler)
+    {
+        std::vector<CTaskScheduler::WorkerStats> stats = m_scheduler->GetWorkerStats();
+        for (size_t i = 0; i < stats.size(); ++i)
+        {
+            dropped += stats[i].tasksCancelled;
+        }
+    }
+    return dropped;
+}
+
+void CPipeline::ProcessFrame( PipelineFrame& frame )
+{
+    typedef std::chrono::steady_clock Clock;
+    if (frame.exposureEndNs != 0)
+    {
+        const uint64_t now = (uint64_t) std::chrono::duration_cast<std::chrono::nanoseconds>( Clock::now().time_since_epoch() ).count();
+        if (now > frame.exposureEndNs)
+        {
+            m_exposureToStartNs += now - frame.exposureEndNs;
+            ++m_exposureToStartFrames;
+        }
+    }
+    Clock::time_point gatedStart;
+    bool timed = false;
+    const bool observe = !m_stageSeconds.empty();
+    Clock::time_point stageStart = observe ? Clock::now() : Clock::time_point();
+    for (size_t i = 0; i < m_stages.size(); ++i)
+    {
+        m_stages[i]->Process( frame );
+        if (observe)
+        {
+            const Clock::time_point now = Clock::now();
+            m_stageSeconds[i]->Observe( (uint64_t) std::chrono::duration_cast<std::chrono::nanoseconds>( now - stageStart ).count() );
+            stageStart = now;
+        }
+        if (i == m_gateIndex)
+        {
+            if (frame.staticScene)
+            {
+                ++m_gated;
+                m_savedNs += m_gatedStagesNs.load( std::memory_order_relaxed );
+                break;
+            }
+            gatedStart = Clock::now();
+            timed = true;
+        }
+    }
+    if (timed)
+    {
+        // Average over about the last eight processed frames; racing workers may lose an update.
+        const int64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>( Clock::now() - gatedStart ).count();
+        const int64_t average = (int64_t) m_gatedStagesNs.load( std::memory_order_relaxed );
+        m_gatedStagesNs.store( (uint64_t) (average == 0 ? ns : average + (ns - average) / 8 ), std::memory_order_relaxed );
+    }
+    if (timed && m_gateIndex + 1 < m_stages.size())
+    {
+        LastOutput& last = LastOutputFor( frame.cameraIndex );
+        std::lock_guard<std::mutex> lock( last.mutex );
+        last.image = frame.image;
+        last.obstacles = frame.obstacles;
+        last.valid = true;
+    }
+    else if (frame.staticScene && m_gateIndex + 1 < m_stages.size())
+    {
+        // The gate only skips once the camera has a reference, i.e. after a processed frame.
+        LastOutput& last = LastOutputFor( frame.cameraIndex );
+        std::lock_guard<std::mutex> lock( last.mutex );
+        if (last.valid)
+        {
+            frame.image = last.image;
+            frame.obstacles = last.obstacles;
+        }
+    }
+    for (size_t i = 0; i < m_sinks.size(); ++i)
+    {
+        m_sinks[i]->Consume( frame );
+    }
+    ++m_processed;
+}
+
+void CPipeline::WorkerLoop()
+{
+    pthread_setname_np( pthread_self(), "pipeline" );
+    PipelineFrame frame;
+    while (m_queue.Pop( frame ))
+    {
+        ProcessFrame( frame );
+        RecycleFrame( frame );
+        ReleaseFrame( frame );
+    }
+}
+
+void CPipeline::RecycleFrame( PipelineFrame& frame )
+{
+    for (size_t i = 0; i < m_stages.size(); ++i)
+    {
+        m_stages[i]->Recycle( frame );
+    }
+}
@@ -0,0 +1,347 @@
+// Pipeline.h
+/*
+    Stage graph built from a PipelineConfig.
+
+    The graph is a chain of IPipelineStage objects followed by IPipelineSink objects.
+    The only virtual calls are IPipelineStage::Process() and Recycle(), once per stage per
+    frame. Each stage is a CStageAdapter<Op> instantiated for a concrete operation, so the
+    inner loops of the operation (e.g. the per-pixel functor of CPixelOp) are compiled and
+    inlined for that stage and never dispatch per pixel.
+
+    Frames enter through Push() from the camera threads. By default they are processed
+    by threadCount workers pulling from a bounded CFrameQueue. With schedulerWorkers > 0
+    each frame becomes a task on a work-stealing CTaskScheduler instead: the newest frame
+    is picked first, frames more than queueSize behind the newest are cancelled, and
+    stages split their work into tasks on the same pool (see CPixelOp).
+
+    A "motiongate" stage marks frames whose camera sees the same scene as on its last
+    processed frame as staticScene; the stages after it are then skipped for that frame.
+    The sinks still see it, with the image and obstacles of that camera's last processed
+    frame copied in, so that they never get a half-processed image or a missing obstacle
+    list. The time the skipped stages took on recent processed frames is added up as the
+    estimated CPU saved.
+
+    With AttachMetrics() each stage's time is observed into a latency histogram (two
+    clock reads per stage), and the queue depth and frame totals are read on scrapes.
+
+    With AttachBudget() the frames in the pipeline are accounted against a CMemoryBudget.
+    Push() reserves a frame's image and depth bytes (not an image from an accounted pool,
+    see pooledImage) and does not queue the frame if the budget refuses them (Refused());
+    the bytes are released once the frame is processed, dropped or cancelled. Under memory
+    pressure Push() keeps at most half of queueSize frames, halves the resolution of the
+    frames entering, and then skips the frames with an odd frame ID. Buffers the stages
+    allocate while they run are not accounted.
+*/
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <stdint.h>
+#include <opencv2/core.hpp>
+#include "FrameQueue.h"
+#include "MotionGate.h"
+#include "ObstacleDetector.h"
+#include "PipelineConfig.h"
+#include "TaskScheduler.h"
+
+class CMemoryAccount;
+class CMemoryBudget;
+class CMetricHistogram;
+class CMetricsRegistry;
+
+struct PipelineFrame
+{
+    PipelineFrame()
+        : cameraIndex( 0 ), frameId( 0 ), timestamp( 0 ), sequence( 0 ), pScheduler( NULL ), staticScene( false )
+        , exposureEndNs( 0 ), stereoPair( 0 ), pooledImage( false ), budgetBytes( 0 ) {}
+
+    cv::Mat image;
+    size_t cameraIndex;
+    uint64_t frameId;
+    uint64_t timestamp;
+    uint64_t sequence;              // Pipeline-wide arrival order, used as task priority.
+    CTaskScheduler* pScheduler;     // Set when stages may split work into tasks.
+    cv::Mat depth;                  // CV_16UC1 or CV_32FC1, aligned with image; empty without a depth source.
+    std::vector<ObstacleBox> obstacles;     // Filled by the "obstacles" stage.
+    bool staticScene;               // Set by the "motiongate" stage; later stages did not run.
+    uint64_t exposureEndNs;         // Host steady_clock ns of the exposure-end event, 0 if none (see CFrameArming).
+    uint64_t stereoPair;            // Same non-zero id on the frames of one triggered stereo pair.
+    bool pooledImage;               // image is a buffer of a pool that accounts for it itself.
+    size_t budgetBytes;             // Reserved by the pipeline for this frame; set by Push().
+};
+
+class IPipelineStage
+{
+public:
+    virtual ~IPipelineStage() {}
+    virtual void Process( PipelineFrame& frame ) = 0;
+    // Called once the sinks are done with a frame that went through Push(), so that the
+    // stage can take back buffers it handed to the frame.
+    virtual void Recycle( PipelineFrame& ) {}
+    virtual const char* Name() const = 0;
+};
+
+class IPipelineSink
+{
+public:
+    virtual ~IPipelineSink() {}
+    virtual void Consume( const PipelineFrame& frame ) = 0;
+};
+
+// Wraps a concrete operation; Op::operator()(PipelineFrame&) is resolved at compile time.
+// Operations with buffers to take back specialize Recycle() (see ObstacleOp).
+template <class Op>
+class CStageAdapter : public IPipelineStage
+{
+public:
+    CStageAdapter( const Op& op, const char* name ) : m_op( op ), m_name( name ) {}
+    virtual void Process( PipelineFrame& frame ) { m_op( frame ); }
+    virtual void Recycle( PipelineFrame& ) {}
+    virtual const char* Name() const { return m_name; }
+
+private:
+    Op m_op;
+    const char* m_name;
+};
+
+// Applies an 8-bit per-pixel functor in place. PixelFn is inlined into the row loop.
+// With a scheduler on the frame, the rows are processed as strips of c_stripRows in parallel.
+template <class PixelFn>
+struct CPixelOp
+{
+    static const int c_stripRows = 64;
+
+    explicit CPixelOp( const PixelFn& fn ) : m_fn( fn ) {}
+
+    void operator()( PipelineFrame& frame )
+    {
+        cv::Mat& image = frame.image;
+        if (frame.pScheduler != NULL && image.rows > c_stripRows)
+        {
+            frame.pScheduler->ParallelFor( 0, image.rows, c_stripRows,
+                [this, &image]( int begin, int end ) { ProcessRows( image, begin, end ); }, frame.sequence );
+        }
+        else
+        {
+            ProcessRows( image, 0, image.rows );
+        }
+    }
+
+    void ProcessRows( cv::Mat& image, int begin, int end ) const
+    {
+        const int width = image.cols * image.channels();
+        for (int r = begin; r < end; ++r)
+        {
+            uint8_t* p = image.ptr<uint8_t>( r );
+            for (int i = 0; i < width; ++i)
+            {
+                p[i] = m_fn( p[i] );
+            }
+        }
+    }
+
+    PixelFn m_fn;
+};
+
+struct GainPixel
+{
+    explicit GainPixel( double gain ) : m_gain( (int) (gain * 256.0 + 0.5) ) {}
+    uint8_t operator()( uint8_t v ) const
+    {
+        int scaled = (v * m_gain) >> 8;
+        return (uint8_t) (scaled > 255 ? 255 : scaled);
+    }
+    int m_gain;     // 8.8 fixed point.
+};
+
+struct ThresholdPixel
+{
+    explicit ThresholdPixel( int threshold ) : m_threshold( threshold ) {}
+    uint8_t operator()( uint8_t v ) const { return v > m_threshold ? 255 : 0; }
+    int m_threshold;
+};
+
+// Stages are shared by all workers, so operations keep no per-frame state.
+struct GrayOp
+{
+    void operator()( PipelineFrame& frame );
+};
+
+struct DownscaleOp
+{
+    explicit DownscaleOp( double factor ) : m_factor( factor ) {}
+    void operator()( PipelineFrame& frame );
+    double m_factor;
+};
+
+// The exception: the obstacle detector warm-starts from the previous frame's floor, so
+// each camera has its own detector, used by one worker at a time. Frames without depth
+// pass through unchanged. The obstacle vectors go round between the detector, the frame
+// and a spare per camera that Recycle() refills, so that filling frame.obstacles does not
+// allocate.
+class ObstacleOp
+{
+public:
+    explicit ObstacleOp( const CObstacleDetector::Config& config );
+    void operator()( PipelineFrame& frame );
+    void Recycle( PipelineFrame& frame );
+
+private:
+    struct Camera
+    {
+        std::mutex mutex;
+        std::unique_ptr<CObstacleDetector> pDetector;   // Created on the first depth frame.
+        std::vector<ObstacleBox> spare;                 // Swapped into the next frame.
+    };
+    struct Shared
+    {
+        CObstacleDetector::Config config;
+        std::mutex mutex;
+        std::vector<std::unique_ptr<Camera> > cameras;
+    };
+    std::shared_ptr<Shared> m_shared;   // Copies of the op share the detectors.
+
+    Camera& CameraFor( size_t cameraIndex );
+};
+
+template <>
+inline void CStageAdapter<ObstacleOp>::Recycle( PipelineFrame& frame )
+{
+    m_op.Recycle( frame );
+}
+
+// Keeps one CMotionGate per camera, like ObstacleOp keeps detectors.
+class MotionGateOp
+{
+public:
+    explicit MotionGateOp( const CMotionGate::Config& config );
+    void operator()( PipelineFrame& frame );
+
+private:
+    struct Camera
+    {
+        explicit Camera( const CMotionGate::Config& config ) : gate( config ) {}
+        std::mutex mutex;
+        CMotionGate gate;
+    };
+    struct Shared
+    {
+        CMotionGate::Config config;
+        std::mutex mutex;
+        std::vector<std::unique_ptr<Camera> > cameras;
+    };
+    std::shared_ptr<Shared> m_shared;
+};
+
+// Creates the stage for one entry of the config. Returns NULL for an unknown type.
+IPipelineStage* CreatePipelineStage( const StageConfig& config );
+
+class CPipeline
+{
+public:
+    explicit CPipeline( const PipelineConfig& config );
+    ~CPipeline();
+
+    // Sinks are not owned and must outlive the pipeline.
+    void AddSink( IPipelineSink* pSink );
+    // Call before Start(). The registry must not be rendered after the pipeline is destroyed.
+    void AttachMetrics( CMetricsRegistry& registry );
+    // Call before Start(). The budget must outlive the pipeline.
+    void AttachBudget( CMemoryBudget& budget );
+
+    void Start();
+    void Stop();
+
+    // What Push() did with a frame.
+    enum PushResult
+    {
+        Push_Queued,            // Nothing was dropped.
+        Push_DroppedOldest,     // Queued, and an older frame was dropped to make room.
+        Push_Skipped,           // Skipped under memory pressure.
+        Push_Refused            // Not queued: the memory budget refused its bytes.
+    };
+
+    // Called from the camera threads.
+    PushResult Push( PipelineFrame&& frame );
+
+    // Called on a camera's exposure-end event: a waiting worker polls for up to spinNs so
+    // that it picks the frame up as soon as it is pushed. No effect with the scheduler.
+    void Arm( uint64_t spinNs );
+
+    // Runs every stage and sink on the calling thread.
+    void ProcessFrame( PipelineFrame& frame );
+
+    size_t StageCount() const { return m_stages.size(); }
+    uint64_t Processed() const { return m_processed; }
+    size_t Dropped() const;
+    size_t QueueDepth() const { return m_queue.Size(); }
+    // Frames on which the motion gate skipped the remaining stages.
+    uint64_t Gated() const { return m_gated; }
+    // Estimated stage time not spent on gated frames.
+    uint64_t SavedNs() const { return m_savedNs; }
+    // Frames skipped and frames downscaled under memory pressure.
+    uint64_t Skipped() const { return m_skipped; }
+    uint64_t Downscaled() const { return m_downscaled; }
+    // Frames not queued because the memory budget refused their bytes.
+    uint64_t Refused() const { return m_refused; }
+    // Exposure end to the first stage, over frames with exposureEndNs set.
+    uint64_t ExposureToStartFrames() const { return m_exposureToStartFrames; }
+    uint64_t AverageExposureToStartNs() const;
+    // NULL unless schedulerWorkers > 0.
+    CTaskScheduler* Scheduler() const { return m_scheduler.get(); }
+
+private:
+    CPipeline( const CPipeline& );
+    CPipeline& operator=( const CPipeline& );
+
+    // The output a gated frame is given, per camera, from the last frame that passed the
+    // gate. The image is shared, not copied: nothing writes to a frame's image after its
+    // stages ran, and pools do not reuse a buffer that is still referenced. It keeps one
+    // image per camera alive that the memory budget does not account.
+    struct LastOutput
+    {
+        LastOutput() : valid( false ) {}
+        std::mutex mutex;
+        bool valid;
+        cv::Mat image;
+        std::vector<ObstacleBox> obstacles;
+    };
+
+    void WorkerLoop();
+    LastOutput& LastOutputFor( size_t cameraIndex );
+    // Lets every stage take back its buffers once the frame is done with.
+    void RecycleFrame( PipelineFrame& frame );
+    // Applies the memory pressure to a frame and reserves its bytes; Push_Queued to keep it.
+    PushResult Admit( PipelineFrame& frame, size_t& queueLimit );
+    void ReleaseFrame( PipelineFrame& frame );
+
+    std::vector<std::unique_ptr<IPipelineStage> > m_stages;
+    std::vector<IPipelineSink*> m_sinks;
+    std::vector<CMetricHistogram*> m_stageSeconds;  // Per stage; empty without metrics.
+    CFrameQueue<PipelineFrame> m_queue;
+    size_t m_threadCount;
+    std::vector<std::thread> m_workers;
+    std::atomic<uint64_t> m_processed;
+    std::atomic<uint64_t> m_sequence;
+    size_t m_gateIndex;                         // First "motiongate" stage, or StageCount() if none.
+    std::atomic<uint64_t> m_gated;
+    std::atomic<uint64_t> m_savedNs;
+    std::atomic<uint64_t> m_gatedStagesNs;      // Running average over processed frames.
+    std::mutex m_lastOutputMutex;
+    std::vector<std::unique_ptr<LastOutput> > m_lastOutputs;
+    std::atomic<uint64_t> m_exposureToStartFrames;
+    std::atomic<uint64_t> m_exposureToStartNs;  // Sum.
+    CMemoryAccount* m_pFrameAccount;            // NULL without a budget.
+    std::atomic<uint64_t> m_skipped;
+    std::atomic<uint64_t> m_downscaled;
+    std::atomic<uint64_t> m_refused;
+    CTaskGroup m_frameTasks;
+    std::unique_ptr<CTaskScheduler> m_scheduler;    // Declared last: its destructor drains tasks that use the members above.
+};
+
+#endif // PIPELINE_H
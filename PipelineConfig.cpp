@@ -0,0 +1,175 @@
+// PipelineConfig.cpp
+#include "PipelineConfig.h"
+
+#include <opencv2/core.hpp>
+
+CameraSourceConfig::CameraSourceConfig()
+    : exposureTime( 8333 )
+    , frameRate( 30 )
+    , triggerLine( "Line4" )
+    , frameBusSlots( 8 )
+{
+}
+
+StageConfig::StageConfig()
+    : factor( 0.5 )
+    , gain( 1.0 )
+    , threshold( 128 )
+    , focalLength( 525.0 )
+    , voxelSize( 0.1 )
+    , cellThreshold( 6.0 )
+    , refreshInterval( 30 )
+{
+}
+
+SinkConfig::SinkConfig()
+    : type( "preview" )
+    , port( 8080 )
+    , maxWidth( 640 )
+    , jpegQuality( 70 )
+{
+}
+
+PipelineConfig::PipelineConfig()
+    : sinks( 1 )
+    , queueSize( 8 )
+    , threadCount( 1 )
+    , schedulerWorkers( 0 )
+    , imagesToGrab( 0 )
+    , armOnExposureEnd( false )
+    , armSpinUs( 2500 )
+    , stereoPairWindowUs( 1000 )
+    , metricsPort( 8081 )
+    , reconnectTimeoutS( 0 )
+    , memoryBudgetMB( 0 )
+{
+}
+
+const CameraSourceConfig& PipelineConfig::SourceFor( size_t cameraIndex, const std::string& serialNumber ) const
+{
+    static const CameraSourceConfig defaults;
+    for (size_t i = 0; i < sources.size(); ++i)
+    {
+        if (!sources[i].serialNumber.empty() && sources[i].serialNumber == serialNumber)
+        {
+            return sources[i];
+        }
+    }
+    // Sources without a serial number are handed out in enumeration order.
+    if (cameraIndex < sources.size() && sources[cameraIndex].serialNumber.empty())
+    {
+        return sources[cameraIndex];
+    }
+    return defaults;
+}
+
+static void ReadValue( const cv::FileNode& node, double& value )
+{
+    if (!node.empty())
+    {
+        value = (double) node;
+    }
+}
+
+static void ReadValue( const cv::FileNode& node, int& value )
+{
+    if (!node.empty())
+    {
+        value = (int) node;
+    }
+}
+
+static void ReadValue( const cv::FileNode& node, std::string& value )
+{
+    if (!node.empty())
+    {
+        value = (std::string) node;
+    }
+}
+
+template <class T>
+static void ReadUnsigned( const cv::FileNode& node, T& value )
+{
+    if (!node.empty() && (int) node >= 0)
+    {
+        value = (T) (int) node;
+    }
+}
+
+bool LoadPipelineConfig( const std::string& path, PipelineConfig& config )
+{
+    cv::FileStorage fs;
+    if (!fs.open( path, cv::FileStorage::READ ))
+    {
+        return false;
+    }
+    cv::FileNode root = fs.root();
+
+    ReadUnsigned( root["queueSize"], config.queueSize );
+    ReadUnsigned( root["threads"], config.threadCount );
+    ReadUnsigned( root["schedulerWorkers"], config.schedulerWorkers );
+    ReadUnsigned( root["imagesToGrab"], config.imagesToGrab );
+    int armOnExposureEnd = config.armOnExposureEnd ? 1 : 0;
+    ReadValue( root["armOnExposureEnd"], armOnExposureEnd );
+    config.armOnExposureEnd = armOnExposureEnd != 0;
+    ReadUnsigned( root["armSpinUs"], config.armSpinUs );
+    ReadUnsigned( root["stereoPairWindowUs"], config.stereoPairWindowUs );
+    ReadUnsigned( root["metricsPort"], config.metricsPort );
+    ReadValue( root["metricsSocket"], config.metricsSocket );
+    ReadUnsigned( root["reconnectTimeoutS"], config.reconnectTimeoutS );
+    ReadUnsigned( root["memoryBudgetMB"], config.memoryBudgetMB );
+
+    cv::FileNode sources = root["sources"];
+    if (sources.isSeq())
+    {
+        config.sources.clear();
+        for (cv::FileNodeIterator it = sources.begin(); it != sources.end(); ++it)
+        {
+            cv::FileNode node = *it;
+            CameraSourceConfig source;
+            ReadValue( node["serialNumber"], source.serialNumber );
+            ReadValue( node["exposureTime"], source.exposureTime );
+            ReadValue( node["frameRate"], source.frameRate );
+            ReadValue( node["triggerLine"], source.triggerLine );
+            ReadUnsigned( node["frameBusSlots"], source.frameBusSlots );
+            config.sources.push_back( source );
+        }
+    }
+
+    cv::FileNode stages = root["stages"];
+    if (stages.isSeq())
+    {
+        config.stages.clear();
+        for (cv::FileNodeIterator it = stages.begin(); it != stages.end(); ++it)
+        {
+            cv::FileNode node = *it;
+            StageConfig stage;
+            ReadValue( node["type"], stage.type );
+            ReadValue( node["factor"], stage.factor );
+            ReadValue( node["gain"], stage.gain );
+            ReadValue( node["threshold"], stage.threshold );
+            ReadValue( node["focalLength"], stage.focalLength );
+            ReadValue( node["voxelSize"], stage.voxelSize );
+            ReadValue( node["cellThreshold"], stage.cellThreshold );
+            ReadUnsigned( node["refreshInterval"], stage.refreshInterval );
+            config.stages.push_back( stage );
+        }
+    }
+
+    cv::FileNode sinks = root["sinks"];
+    if (sinks.isSeq())
+    {
+        config.sinks.clear();
+        for (cv::FileNodeIterator it = sinks.begin(); it != sinks.end(); ++it)
+        {
+            cv::FileNode node = *it;
+            SinkConfig sink;
+            ReadValue( node["type"], sink.type );
+            ReadUnsigned( node["port"], sink.port );
+            ReadValue( node["maxWidth"], sink.maxWidth );
+            ReadValue( node["jpegQuality"], sink.jpegQuality );
+            config.sinks.push_back( sink );
+        }
+    }
+    return true;
+}
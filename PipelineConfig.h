@@ -0,0 +1,78 @@
+// PipelineConfig.h
+/*
+    Declarative pipeline description.
+
+    Loaded with cv::FileStorage, so the same file can be written as YAML or JSON
+    (see pipeline.yml). Every field has a default that matches what main() used
+    to hard-code, so a missing or partial file still gives the old behavior.
+*/
+#ifndef PIPELINECONFIG_H
+#define PIPELINECONFIG_H
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+struct CameraSourceConfig
+{
+    CameraSourceConfig();
+
+    std::string serialNumber;   // Empty: take the next enumerated device.
+    double exposureTime;        // us
+    double frameRate;           // Hz, 0 disables the frame rate limit.
+    std::string triggerLine;    // e.g. "Line4". Empty: free running.
+    uint32_t frameBusSlots;     // Shared-memory ring size, 0 disables the frame bus.
+};
+
+struct StageConfig
+{
+    StageConfig();
+
+    std::string type;           // "gray", "downscale", "gain", "threshold", "obstacles" or "motiongate".
+    double factor;              // downscale
+    double gain;                // gain
+    int threshold;              // threshold
+    double focalLength;         // obstacles: depth camera focal length, pixels
+    double voxelSize;           // obstacles: m
+    double cellThreshold;       // motiongate: grey levels of change for a grid cell to count as moved
+    uint32_t refreshInterval;   // motiongate: skipped frames before one is processed anyway, 0 = never
+};
+
+struct SinkConfig
+{
+    SinkConfig();
+
+    std::string type;           // "preview" or "highgui".
+    uint16_t port;              // preview
+    int maxWidth;               // preview
+    int jpegQuality;            // preview
+};
+
+struct PipelineConfig
+{
+    PipelineConfig();
+
+    std::vector<CameraSourceConfig> sources;
+    std::vector<StageConfig> stages;
+    std::vector<SinkConfig> sinks;
+    size_t queueSize;           // Frames buffered between the cameras and the workers.
+    size_t threadCount;         // Pipeline worker threads.
+    size_t schedulerWorkers;    // Work-stealing pool size; 0 keeps the plain worker threads.
+    uint32_t imagesToGrab;      // Per camera, 0 grabs until the program is stopped.
+    bool armOnExposureEnd;      // Prepare for each frame on the camera's exposure-end event (see CFrameArming).
+    uint32_t armSpinUs;         // How long a worker woken by the event polls for the frame; about the transfer time.
+    uint32_t stereoPairWindowUs;    // Exposure ends closer than this form a stereo pair.
+    uint16_t metricsPort;       // Prometheus metrics on 127.0.0.1, 0 = off.
+    std::string metricsSocket;  // Unix socket path for the same metrics, empty = off.
+    uint32_t reconnectTimeoutS; // A removed camera's thread gives up after this long, 0 = keeps trying until stopped.
+    uint32_t memoryBudgetMB;    // Frame buffers, pools and queues together, 0 = no limit (see CMemoryBudget).
+
+    // Source settings for the camera at the given enumeration index.
+    const CameraSourceConfig& SourceFor( size_t cameraIndex, const std::string& serialNumber ) const;
+};
+
+// Reads a YAML or JSON pipeline description. Throws cv::Exception if the file exists but is malformed.
+// Returns false and leaves the defaults in place if the file cannot be opened.
+bool LoadPipelineConfig( const std::string& path, PipelineConfig& config );
+
+#endif // PIPELINECONFIG_H
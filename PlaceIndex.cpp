@@ -0,0 +1,587 @@
+// PlaceIndex.cpp
+#include "PlaceIndex.h"
+
+#include <algorithm>
+#include <cmath>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const char c_magic[8] = { 'P', 'L', 'A', 'C', 'E', 'I', 'X', '1' };
+static const uint32_t c_version = 1;
+
+#if defined( __POPCNT__ ) || defined( __aarch64__ ) || defined( __ARM_NEON )
+// One instruction per 64 bits (POPCNT, or CNT + ADDV on NEON).
+static inline int Popcount256( const uint64_t* a, const uint64_t* b )
+{
+    return __builtin_popcountll( a[0] ^ b[0] ) + __builtin_popcountll( a[1] ^ b[1] )
+         + __builtin_popcountll( a[2] ^ b[2] ) + __builtin_popcountll( a[3] ^ b[3] );
+}
+#else
+// Baseline x86-64 has no POPCNT and the builtin becomes a library call: count bits in
+// parallel on two 128-bit registers instead (SSE2).
+typedef uint64_t Uint64x2 __attribute__(( vector_size( 16 ) ));
+
+static inline Uint64x2 ByteCounts( Uint64x2 v )
+{
+    v = v - ((v >> 1) & 0x5555555555555555ull);
+    v = (v & 0x3333333333333333ull) + ((v >> 2) & 0x3333333333333333ull);
+    return (v + (v >> 4)) & 0x0f0f0f0f0f0f0f0full;
+}
+
+static inline int Popcount256( const uint64_t* a, const uint64_t* b )
+{
+    Uint64x2 a0, a1, b0, b1;
+    memcpy( &a0, a, sizeof( a0 ) );
+    memcpy( &a1, a + 2, sizeof( a1 ) );
+    memcpy( &b0, b, sizeof( b0 ) );
+    memcpy( &b1, b + 2, sizeof( b1 ) );
+    // Bytes hold at most 16 after the add and at most 128 after folding eight of them.
+    Uint64x2 sum = ByteCounts( a0 ^ b0 ) + ByteCounts( a1 ^ b1 );
+    sum = sum + (sum >> 8);
+    sum = sum + (sum >> 16);
+    sum = sum + (sum >> 32);
+    return (int) ((sum[0] & 0xff) + (sum[1] & 0xff));
+}
+#endif
+
+// Nodes and words of a tree as Train() builds it; false if it would not fit the header.
+static bool TreeSize( uint32_t branching, uint32_t depth, uint64_t& nodes, uint64_t& words )
+{
+    if (branching < 2 || branching > 256 || depth < 1)
+    {
+        return false;
+    }
+    nodes = 1;
+    words = 1;
+    for (uint32_t level = 0; level < depth; ++level)
+    {
+        words *= branching;
+        nodes += words;
+        if (nodes > UINT32_MAX)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+static size_t Align8( size_t bytes )
+{
+    return (bytes + 7) & ~(size_t) 7;
+}
+
+CPlaceIndex::Config::Config()
+    : branching( 16 )
+    , depth( 4 )
+    , trainIterations( 5 )
+    , stopWordFraction( 0.3f )
+{
+}
+
+CPlaceIndex::CPlaceIndex( const Config& config )
+    : m_config( config )
+    , m_nodeCount( 0 )
+    , m_words( 0 )
+    , m_firstLeaf( 0 )
+    , m_keyframes( 0 )
+    , m_pNodes( NULL )
+    , m_pBaseOffsets( NULL )
+    , m_pBasePostings( NULL )
+    , m_basePostingCount( 0 )
+    , m_pMapping( NULL )
+    , m_mappingBytes( 0 )
+    , m_deltaPostingCount( 0 )
+    , m_random( 0x9e3779b9u )
+{
+}
+
+CPlaceIndex::~CPlaceIndex()
+{
+    Reset();
+}
+
+void CPlaceIndex::Reset()
+{
+    if (m_pMapping != NULL)
+    {
+        munmap( m_pMapping, m_mappingBytes );
+        m_pMapping = NULL;
+        m_mappingBytes = 0;
+    }
+    m_pNodes = NULL;
+    m_pBaseOffsets = NULL;
+    m_pBasePostings = NULL;
+    m_basePostingCount = 0;
+    m_ownNodes.clear();
+    m_ownOffsets.clear();
+    m_delta.clear();
+    m_deltaPostingCount = 0;
+    m_documentFrequency.clear();
+    m_scores.clear();
+    m_wordCounts.clear();
+    m_usedWords.clear();
+    m_keyframes = 0;
+    m_nodeCount = 0;
+    m_words = 0;
+    m_firstLeaf = 0;
+}
+
+int CPlaceIndex::Distance( const uint8_t* a, const uint8_t* b )
+{
+    uint64_t wa[4];
+    uint64_t wb[4];
+    memcpy( wa, a, sizeof( wa ) );
+    memcpy( wb, b, sizeof( wb ) );
+    return Popcount256( wa, wb );
+}
+
+uint32_t CPlaceIndex::Random()
+{
+    m_random = m_random * 1664525u + 1013904223u;
+    return m_random >> 8;
+}
+
+void CPlaceIndex::Train( const uint8_t* descriptors, size_t count )
+{
+    Reset();
+    if (m_config.branching < 2)
+    {
+        m_config.branching = 2;
+    }
+    if (m_config.branching > 256)
+    {
+        m_config.branching = 256;   // Child indices are bytes while training.
+    }
+    if (m_config.depth < 1)
+    {
+        m_config.depth = 1;
+    }
+    size_t levelNodes = 1;
+    m_nodeCount = 1;
+    for (int level = 0; level < m_config.depth; ++level)
+    {
+        levelNodes *= m_config.branching;
+        m_nodeCount += levelNodes;
+    }
+    m_words = levelNodes;
+    m_firstLeaf = m_nodeCount - m_words;
+
+    std::vector<Node> data( count );
+    memcpy( data.data(), descriptors, count * sizeof( Node ) );
+    std::vector<uint32_t> indices( count );
+    for (size_t i = 0; i < count; ++i)
+    {
+        indices[i] = (uint32_t) i;
+    }
+    Node zero;
+    memset( &zero, 0, sizeof( zero ) );
+    m_ownNodes.assign( m_nodeCount, zero );
+    TrainNode( 0, 0, data.data(), indices.data(), indices.data() + count );
+
+    m_ownOffsets.assign( m_words + 1, 0 );
+    m_pNodes = m_ownNodes.data();
+    m_pBaseOffsets = m_ownOffsets.data();
+    m_delta.resize( m_words );
+    m_documentFrequency.assign( m_words, 0 );
+    m_wordCounts.assign( m_words, 0 );
+}
+
+void CPlaceIndex::TrainNode( size_t node, int level, const Node* pDescriptors, uint32_t* pBegin, uint32_t* pEnd )
+{
+    if (level == m_config.depth)
+    {
+        return;
+    }
+    const int k = m_config.branching;
+    const size_t first = node * k + 1;
+    Node* pCenters = &m_ownNodes[first];
+    const size_t n = pEnd - pBegin;
+
+    // Seed with distinct random members; with fewer members than children the rest
+    // repeat the parent, so every subtree is defined and descends the same way.
+    for (int c = 0; c < k; ++c)
+    {
+        pCenters[c] = (size_t) c < n ? pDescriptors[pBegin[c]] : m_ownNodes[node];
+    }
+    if (n > (size_t) k)
+    {
+        for (int c = 0; c < k; ++c)
+        {
+            std::swap( pBegin[c], pBegin[c + Random() % (n - c)] );
+            pCenters[c] = pDescriptors[pBegin[c]];
+        }
+    }
+
+    std::vector<uint8_t> assignment( n );
+    std::vector<uint32_t> bitCounts( (size_t) k * 256 );
+    std::vector<uint32_t> members( k );
+    for (int iteration = 0; iteration <= m_config.trainIterations; ++iteration)
+    {
+        for (size_t i = 0; i < n; ++i)
+        {
+            const Node& d = pDescriptors[pBegin[i]];
+            int best = 0;
+            int bestDistance = Popcount256( d.bits, pCenters[0].bits );
+            for (int c = 1; c < k; ++c)
+            {
+                const int distance = Popcount256( d.bits, pCenters[c].bits );
+                if (distance < bestDistance)
+                {
+                    bestDistance = distance;
+                    best = c;
+                }
+            }
+            assignment[i] = (uint8_t) best;
+        }
+        if (iteration == m_config.trainIterations || n <= (size_t) k)
+        {
+            break;
+        }
+
+        // Each center becomes the bitwise majority of its members.
+        std::fill( bitCounts.begin(), bitCounts.end(), 0 );
+        std::fill( members.begin(), members.end(), 0 );
+        for (size_t i = 0; i < n; ++i)
+        {
+            const Node& d = pDescriptors[pBegin[i]];
+            uint32_t* pCounts = &bitCounts[assignment[i] * 256];
+            for (int w = 0; w < 4; ++w)
+            {
+                for (uint64_t bits = d.bits[w]; bits != 0; bits &= bits - 1)
+                {
+                    ++pCounts[w * 64 + __builtin_ctzll( bits )];
+                }
+            }
+            ++members[assignment[i]];
+        }
+        for (int c = 0; c < k; ++c)
+        {
+            if (members[c] == 0)
+            {
+                continue;
+            }
+            const uint32_t* pCounts = &bitCounts[c * 256];
+            for (int w = 0; w < 4; ++w)
+            {
+                uint64_t bits = 0;
+                for (int b = 0; b < 64; ++b)
+                {
+                    if (2 * pCounts[w * 64 + b] > members[c])
+                    {
+                        bits |= 1ull << b;
+                    }
+                }
+                pCenters[c].bits[w] = bits;
+            }
+        }
+    }
+
+    // Group the members by child and descend.
+    std::vector<uint32_t> sorted( n );
+    std::vector<size_t> start( k + 1, 0 );
+    for (size_t i = 0; i < n; ++i)
+    {
+        ++start[assignment[i] + 1];
+    }
+    for (int c = 0; c < k; ++c)
+    {
+        start[c + 1] += start[c];
+    }
+    std::vector<size_t> cursor( start.begin(), start.end() - 1 );
+    for (size_t i = 0; i < n; ++i)
+    {
+        sorted[cursor[assignment[i]]++] = pBegin[i];
+    }
+    std::copy( sorted.begin(), sorted.end(), pBegin );
+    for (int c = 0; c < k; ++c)
+    {
+        TrainNode( first + c, level + 1, pDescriptors, pBegin + start[c], pBegin + start[c + 1] );
+    }
+}
+
+uint32_t CPlaceIndex::WordOf( const Node& descriptor ) const
+{
+    const int k = m_config.branching;
+    size_t node = 0;
+    for (int level = 0; level < m_config.depth; ++level)
+    {
+        const size_t first = node * k + 1;
+        size_t best = first;
+        int bestDistance = Popcount256( descriptor.bits, m_pNodes[first].bits );
+        for (int c = 1; c < k; ++c)
+        {
+            const int distance = Popcount256( descriptor.bits, m_pNodes[first + c].bits );
+            if (distance < bestDistance)
+            {
+                bestDistance = distance;
+                best = first + c;
+            }
+        }
+        node = best;
+    }
+    return (uint32_t) (node - m_firstLeaf);
+}
+
+uint32_t CPlaceIndex::Word( const uint8_t* descriptor ) const
+{
+    Node d;
+    memcpy( &d, descriptor, sizeof( d ) );
+    return WordOf( d );
+}
+
+void CPlaceIndex::CountWords( const uint8_t* descriptors, size_t count )
+{
+    for (size_t i = 0; i < count; ++i)
+    {
+        Node d;
+        memcpy( &d, descriptors + i * c_descriptorBytes, sizeof( d ) );
+        const uint32_t word = WordOf( d );
+        if (m_wordCounts[word]++ == 0)
+        {
+            m_usedWords.push_back( word );
+        }
+    }
+}
+
+uint32_t CPlaceIndex::AddKeyframe( const uint8_t* descriptors, size_t count )
+{
+    const uint32_t keyframe = m_keyframes++;
+    m_scores.push_back( 0.0f );
+    if (!Trained() || count == 0)
+    {
+        return keyframe;
+    }
+    CountWords( descriptors, count );
+    const float inverse = 1.0f / count;
+    for (size_t i = 0; i < m_usedWords.size(); ++i)
+    {
+        const uint32_t word = m_usedWords[i];
+        Posting posting;
+        posting.keyframe = keyframe;
+        posting.weight = m_wordCounts[word] * inverse;
+        m_delta[word].push_back( posting );
+        ++m_documentFrequency[word];
+        m_wordCounts[word] = 0;
+    }
+    m_deltaPostingCount += m_usedWords.size();
+    m_usedWords.clear();
+    return keyframe;
+}
+
+static bool BetterMatch( const CPlaceIndex::Match& a, const CPlaceIndex::Match& b )
+{
+    return a.score > b.score;
+}
+
+void CPlaceIndex::Query( const uint8_t* descriptors, size_t count, size_t maxResults, uint32_t before,
+                         std::vector<Match>& results )
+{
+    results.clear();
+    if (!Trained() || count == 0 || m_keyframes == 0 || maxResults == 0)
+    {
+        return;
+    }
+    CountWords( descriptors, count );
+    const float keyframes = (float) m_keyframes;
+    const float stopLimit = m_config.stopWordFraction * keyframes;
+    const float inverse = 1.0f / count;
+    for (size_t i = 0; i < m_usedWords.size(); ++i)
+    {
+        const uint32_t word = m_usedWords[i];
+        const uint32_t frequency = m_documentFrequency[word];
+        const float share = m_wordCounts[word] * inverse;
+        m_wordCounts[word] = 0;
+        if (frequency == 0 || frequency > stopLimit)
+        {
+            continue;
+        }
+        const float idf = std::log( keyframes / frequency );
+        const float weight = share * idf * idf;
+
+        // Postings are in keyframe order, base before delta.
+        const Posting* pPosting = m_pBasePostings + m_pBaseOffsets[word];
+        const Posting* pEnd = m_pBasePostings + m_pBaseOffsets[word + 1];
+        for (; pPosting != pEnd && pPosting->keyframe < before; ++pPosting)
+        {
+            m_scores[pPosting->keyframe] += weight * pPosting->weight;
+        }
+        const std::vector<Posting>& delta = m_delta[word];
+        for (size_t p = 0; p < delta.size() && delta[p].keyframe < before; ++p)
+        {
+            m_scores[delta[p].keyframe] += weight * delta[p].weight;
+        }
+    }
+    m_usedWords.clear();
+
+    // A query shares words with most keyframes, so a dense pass over the scores is cheaper
+    // than keeping a list of the touched ones.
+    const uint32_t end = std::min( before, m_keyframes );
+    for (uint32_t keyframe = 0; keyframe < end; ++keyframe)
+    {
+        const float score = m_scores[keyframe];
+        if (score <= 0.0f || (results.size() == maxResults && score <= results.back().score))
+        {
+            continue;
+        }
+        Match match;
+        match.keyframe = keyframe;
+        match.score = score;
+        if (results.size() == maxResults)
+        {
+            results.pop_back();
+        }
+        results.insert( std::upper_bound( results.begin(), results.end(), match, BetterMatch ), match );
+    }
+    std::fill( m_scores.begin(), m_scores.begin() + end, 0.0f );
+}
+
+bool CPlaceIndex::Save( const std::string& path ) const
+{
+    if (!Trained())
+    {
+        return false;
+    }
+    // Written next to the target and renamed, so a mapped file of the same name stays valid.
+    const std::string temporary = path + ".tmp";
+    FILE* pFile = fopen( temporary.c_str(), "wb" );
+    if (pFile == NULL)
+    {
+        return false;
+    }
+
+    FileHeader header;
+    memset( &header, 0, sizeof( header ) );
+    memcpy( header.magic, c_magic, sizeof( c_magic ) );
+    header.version = c_version;
+    header.branching = (uint32_t) m_config.branching;
+    header.depth = (uint32_t) m_config.depth;
+    header.words = (uint32_t) m_words;
+    header.nodes = (uint32_t) m_nodeCount;
+    header.keyframes = m_keyframes;
+    header.postings = m_basePostingCount + m_deltaPostingCount;
+
+    bool ok = fwrite( &header, sizeof( header ), 1, pFile ) == 1;
+    ok = ok && fwrite( m_pNodes, sizeof( Node ), m_nodeCount, pFile ) == m_nodeCount;
+    ok = ok && fwrite( m_documentFrequency.data(), sizeof( uint32_t ), m_words, pFile ) == m_words;
+    const uint64_t padding = 0;
+    const size_t padBytes = Align8( m_words * sizeof( uint32_t ) ) - m_words * sizeof( uint32_t );
+    ok = ok && fwrite( &padding, 1, padBytes, pFile ) == padBytes;
+
+    uint64_t offset = 0;
+    for (size_t w = 0; w <= m_words && ok; ++w)
+    {
+        ok = fwrite( &offset, sizeof( offset ), 1, pFile ) == 1;
+        if (w < m_words)
+        {
+            offset += m_pBaseOffsets[w + 1] - m_pBaseOffsets[w] + m_delta[w].size();
+        }
+    }
+    for (size_t w = 0; w < m_words && ok; ++w)
+    {
+        const size_t base = (size_t) (m_pBaseOffsets[w + 1] - m_pBaseOffsets[w]);
+        ok = fwrite( m_pBasePostings + m_pBaseOffsets[w], sizeof( Posting ), base, pFile ) == base;
+        ok = ok && fwrite( m_delta[w].data(), sizeof( Posting ), m_delta[w].size(), pFile ) == m_delta[w].size();
+    }
+    ok = fclose( pFile ) == 0 && ok;
+    if (!ok || rename( temporary.c_str(), path.c_str() ) != 0)
+    {
+        unlink( temporary.c_str() );
+        return false;
+    }
+    return true;
+}
+
+bool CPlaceIndex::Open( const std::string& path )
+{
+    const int fd = open( path.c_str(), O_RDONLY );
+    if (fd < 0)
+    {
+        return false;
+    }
+    struct stat info;
+    if (fstat( fd, &info ) != 0 || (size_t) info.st_size < sizeof( FileHeader ))
+    {
+        close( fd );
+        return false;
+    }
+    const size_t bytes = (size_t) info.st_size;
+    void* pMapping = mmap( NULL, bytes, PROT_READ, MAP_SHARED, fd, 0 );
+    close( fd );
+    if (pMapping == MAP_FAILED)
+    {
+        return false;
+    }
+
+    // Queries index with these fields without further checks, so a truncated or corrupt
+    // file is rejected here rather than read out of bounds later.
+    const uint8_t* pBytes = (const uint8_t*) pMapping;
+    FileHeader header;
+    memcpy( &header, pBytes, sizeof( header ) );
+    uint64_t nodes = 0;
+    uint64_t words = 0;
+    bool valid = memcmp( header.magic, c_magic, sizeof( c_magic ) ) == 0 && header.version == c_version
+                 && TreeSize( header.branching, header.depth, nodes, words )
+                 && header.nodes == nodes && header.words == words;
+    const size_t nodesAt = sizeof( FileHeader );
+    const size_t frequencyAt = nodesAt + (size_t) header.nodes * sizeof( Node );
+    const size_t offsetsAt = frequencyAt + Align8( (size_t) header.words * sizeof( uint32_t ) );
+    const size_t postingsAt = offsetsAt + ((size_t) header.words + 1) * sizeof( uint64_t );
+    valid = valid && postingsAt <= bytes && header.postings <= (bytes - postingsAt) / sizeof( Posting );
+    if (valid)
+    {
+        const uint64_t* pOffsets = (const uint64_t*) (pBytes + offsetsAt);
+        valid = pOffsets[0] == 0 && pOffsets[header.words] == header.postings;
+        for (size_t w = 0; valid && w < header.words; ++w)
+        {
+            valid = pOffsets[w] <= pOffsets[w + 1];
+        }
+        const Posting* pPostings = (const Posting*) (pBytes + postingsAt);
+        for (uint64_t p = 0; valid && p < header.postings; ++p)
+        {
+            valid = pPostings[p].keyframe < header.keyframes;
+        }
+    }
+    if (!valid)
+    {
+        munmap( pMapping, bytes );
+        return false;
+    }
+
+    Reset();
+    m_pMapping = pMapping;
+    m_mappingBytes = bytes;
+    m_config.branching = (int) header.branching;
+    m_config.depth = (int) header.depth;
+    m_nodeCount = header.nodes;
+    m_words = header.words;
+    m_firstLeaf = m_nodeCount - m_words;
+    m_keyframes = header.keyframes;
+    m_pNodes = (const Node*) (pBytes + nodesAt);
+    m_pBaseOffsets = (const uint64_t*) (pBytes + offsetsAt);
+    m_pBasePostings = (const Posting*) (pBytes + postingsAt);
+    m_basePostingCount = header.postings;
+
+    const uint32_t* pFrequency = (const uint32_t*) (pBytes + frequencyAt);
+    m_documentFrequency.assign( pFrequency, pFrequency + m_words );
+    m_delta.resize( m_words );
+    m_wordCounts.assign( m_words, 0 );
+    m_scores.assign( m_keyframes, 0.0f );
+    return true;
+}
+
+size_t CPlaceIndex::MemoryBytes() const
+{
+    size_t bytes = m_ownNodes.capacity() * sizeof( Node ) + m_ownOffsets.capacity() * sizeof( uint64_t )
+                 + m_delta.capacity() * sizeof( std::vector<Posting> )
+                 + m_documentFrequency.capacity() * sizeof( uint32_t ) + m_wordCounts.capacity() * sizeof( uint32_t )
+                 + m_scores.capacity() * sizeof( float );
+    for (size_t w = 0; w < m_delta.size(); ++w)
+    {
+        bytes += m_delta[w].capacity() * sizeof( Posting );
+    }
+    return bytes;
+}
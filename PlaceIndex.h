@@ -0,0 +1,154 @@
+// PlaceIndex.h
+/*
+    Place recognition over keyframes described by 256-bit binary descriptors (ORB), for
+    loop closure.
+
+    Vocabulary: a tree with `branching` children per node and `depth` levels, trained by
+    hierarchical k-majority clustering (k-means under Hamming distance, centers are the
+    bitwise majority of their members). A descriptor's word is the leaf reached by
+    descending to the nearest child at each level, i.e. branching * depth distances.
+    Distances are popcounts of XORed descriptors: the POPCNT instruction or NEON CNT where
+    the compiler targets them, otherwise a SWAR count on GCC/Clang vector extensions.
+
+    Inverted index: for every word, the keyframes that contain it with the word's share of
+    the keyframe's descriptors. A query scores keyframes by the tf-idf dot product over
+    the words it shares with them, skipping words seen in more than stopWordFraction of
+    the keyframes, and returns the best few.
+
+    Storage: postings of one word are contiguous (offsets into one array), so the index
+    costs 8 bytes per posting plus the vocabulary. Save() writes exactly that layout; Open()
+    maps such a file read-only and queries it in place, so a restart does not rebuild or
+    copy anything. Keyframes added after Open() go to in-memory per-word lists that
+    queries search as well; the next Save() merges them.
+
+    File layout, little endian, every section 8-byte aligned:
+        FileHeader
+        nodes x 32 bytes        vocabulary nodes, level order, children of n at n * branching + 1
+        words x uint32          keyframes containing each word
+        (words + 1) x uint64    offset of each word's postings
+        postings x Posting
+
+    Not thread safe.
+*/
+#ifndef PLACEINDEX_H
+#define PLACEINDEX_H
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <stddef.h>
+
+class CPlaceIndex
+{
+public:
+    static const int c_descriptorBytes = 32;
+
+    struct Config
+    {
+        Config();
+
+        int branching;
+        int depth;                  // Words = branching ^ depth.
+        int trainIterations;        // k-majority rounds per node.
+        float stopWordFraction;     // Of the keyframes; more common words are not scored.
+    };
+
+    struct Match
+    {
+        uint32_t keyframe;
+        float score;
+    };
+
+    explicit CPlaceIndex( const Config& config = Config() );
+    ~CPlaceIndex();
+
+    // Builds the vocabulary from count descriptors of c_descriptorBytes each and empties the index.
+    void Train( const uint8_t* descriptors, size_t count );
+    bool Trained() const { return m_pNodes != NULL; }
+
+    // Returns the keyframe's id; ids count up from 0.
+    uint32_t AddKeyframe( const uint8_t* descriptors, size_t count );
+
+    // The best maxResults keyframes with id < before, highest score first. Pass
+    // Keyframes() - n to ignore the last n keyframes (the robot's immediate past).
+    void Query( const uint8_t* descriptors, size_t count, size_t maxResults, uint32_t before,
+                std::vector<Match>& results );
+
+    bool Save( const std::string& path ) const;
+    // Replaces the index with a saved one, mapped read-only. Returns false, keeping the
+    // current index, if the file is not a complete index as Save() writes it.
+    bool Open( const std::string& path );
+
+    uint32_t Word( const uint8_t* descriptor ) const;
+    static int Distance( const uint8_t* a, const uint8_t* b );
+
+    size_t Keyframes() const { return m_keyframes; }
+    size_t Words() const { return m_words; }
+    size_t Postings() const { return (size_t) m_basePostingCount + m_deltaPostingCount; }
+    // Heap bytes; a mapped file counts only for what was added after Open().
+    size_t MemoryBytes() const;
+    bool Mapped() const { return m_pMapping != NULL; }
+
+private:
+    struct Node
+    {
+        uint64_t bits[4];
+    };
+
+    struct Posting
+    {
+        uint32_t keyframe;
+        float weight;               // Share of the keyframe's descriptors in this word.
+    };
+
+    struct FileHeader
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t branching;
+        uint32_t depth;
+        uint32_t words;
+        uint32_t nodes;
+        uint32_t keyframes;
+        uint64_t postings;
+        uint64_t reserved[3];
+    };
+
+    CPlaceIndex( const CPlaceIndex& );
+    CPlaceIndex& operator=( const CPlaceIndex& );
+
+    void Reset();
+    void TrainNode( size_t node, int level, const Node* pDescriptors, uint32_t* pBegin, uint32_t* pEnd );
+    uint32_t WordOf( const Node& descriptor ) const;
+    void CountWords( const uint8_t* descriptors, size_t count );
+    uint32_t Random();
+
+    Config m_config;
+    size_t m_nodeCount;
+    size_t m_words;
+    size_t m_firstLeaf;
+    uint32_t m_keyframes;
+
+    // Vocabulary and base postings: in m_own* after Train(), or in the mapping after Open().
+    const Node* m_pNodes;
+    const uint64_t* m_pBaseOffsets;
+    const Posting* m_pBasePostings;
+    uint64_t m_basePostingCount;
+    std::vector<Node> m_ownNodes;
+    std::vector<uint64_t> m_ownOffsets;
+    void* m_pMapping;
+    size_t m_mappingBytes;
+
+    // Postings added since Train() or Open(), per word.
+    std::vector<std::vector<Posting> > m_delta;
+    size_t m_deltaPostingCount;
+    std::vector<uint32_t> m_documentFrequency;
+
+    // Query and insert scratch.
+    std::vector<float> m_scores;            // Per keyframe, zero between calls.
+    std::vector<uint32_t> m_wordCounts;     // Per word, zero between calls.
+    std::vector<uint32_t> m_usedWords;
+    uint32_t m_random;
+};
+
+#endif // PLACEINDEX_H
@@ -0,0 +1,382 @@
+// PreviewServer.cpp
+#include "PreviewServer.h"
+
+#include <chrono>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+
+// About two encoded frames. A larger (autotuned) send buffer would queue seconds of old
+// frames for a slow client instead of letting it skip to the newest one.
+static const int c_clientSendBuffer = 128 * 1024;
+
+static uint64_t NowNs()
+{
+    return (uint64_t) std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch() ).count();
+}
+
+static uint64_t ThreadCpuNs()
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_THREAD_CPUTIME_ID, &ts );
+    return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+}
+
+CPreviewServer::CPreviewServer( size_t cameraCount, uint16_t port, int maxWidth, int jpegQuality )
+    : m_port( port )
+    , m_maxWidth( maxWidth )
+    , m_jpegQuality( jpegQuality )
+    , m_channels( cameraCount )
+    , m_running( false )
+    , m_listenFd( -1 )
+    , m_boundPort( port )
+    , m_framesSubmitted( 0 )
+    , m_framesEncoded( 0 )
+    , m_framesSent( 0 )
+    , m_framesSkipped( 0 )
+    , m_encodeNs( 0 )
+    , m_encoderCpuNs( 0 )
+    , m_submitToSentNs( 0 )
+    , m_clients( 0 )
+{
+    for (size_t i = 0; i < m_channels.size(); ++i)
+    {
+        m_channels[i].pendingSubmitNs = 0;
+        m_channels[i].hasPending = false;
+        m_channels[i].sequence = 0;
+    }
+}
+
+CPreviewServer::~CPreviewServer()
+{
+    Stop();
+}
+
+bool CPreviewServer::Start()
+{
+    if (m_running)
+    {
+        return true;
+    }
+    m_listenFd = socket( AF_INET, SOCK_STREAM, 0 );
+    if (m_listenFd < 0)
+    {
+        return false;
+    }
+    int reuse = 1;
+    setsockopt( m_listenFd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof( reuse ) );
+
+    struct sockaddr_in addr;
+    memset( &addr, 0, sizeof( addr ) );
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons( m_port );
+    addr.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+    if (bind( m_listenFd, (struct sockaddr*) &addr, sizeof( addr ) ) != 0 || listen( m_listenFd, 8 ) != 0)
+    {
+        close( m_listenFd );
+        m_listenFd = -1;
+        return false;
+    }
+    socklen_t addrLength = sizeof( addr );
+    if (getsockname( m_listenFd, (struct sockaddr*) &addr, &addrLength ) == 0)
+    {
+        m_boundPort = ntohs( addr.sin_port );
+    }
+
+    m_running = true;
+    m_encoderThread = std::thread( &CPreviewServer::EncoderLoop, this );
+    m_acceptThread = std::thread( &CPreviewServer::AcceptLoop, this );
+    return true;
+}
+
+void CPreviewServer::Stop()
+{
+    if (!m_running)
+    {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock( m_mutex );
+        m_running = false;
+        for (size_t i = 0; i < m_clientFds.size(); ++i)
+        {
+            shutdown( m_clientFds[i], SHUT_RDWR );
+        }
+    }
+    m_pendingCond.notify_all();
+    m_encodedCond.notify_all();
+
+    m_acceptThread.join();
+    m_encoderThread.join();
+    close( m_listenFd );
+    m_listenFd = -1;
+
+    // Client threads are detached; wait until the last one has closed its socket.
+    std::unique_lock<std::mutex> lock( m_mutex );
+    while (m_clients.load() != 0)
+    {
+        m_encodedCond.wait( lock );
+    }
+}
+
+void CPreviewServer::SubmitFrame( size_t cameraIndex, const cv::Mat& bgrImage )
+{
+    if (!m_running || cameraIndex >= m_channels.size() || bgrImage.empty())
+    {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock( m_mutex );
+        Channel& channel = m_channels[cameraIndex];
+        // copyTo() reuses the pending buffer once it has the right size, so this is a plain copy.
+        bgrImage.copyTo( channel.pending );
+        channel.pendingSubmitNs = NowNs();
+        channel.hasPending = true;
+    }
+    ++m_framesSubmitted;
+    m_pendingCond.notify_one();
+}
+
+void CPreviewServer::EncoderLoop()
+{
+    pthread_setname_np( pthread_self(), "preview-encode" );
+    cv::Mat work;
+    cv::Mat scaled;
+    std::vector<int> params;
+    params.push_back( cv::IMWRITE_JPEG_QUALITY );
+    params.push_back( m_jpegQuality );
+    size_t next = 0;
+
+    while (true)
+    {
+        size_t cameraIndex = 0;
+        uint64_t submitNs = 0;
+        {
+            std::unique_lock<std::mutex> lock( m_mutex );
+            bool found = false;
+            while (m_running && !found)
+            {
+                // Round robin so one busy camera cannot starve the other.
+                for (size_t i = 0; i < m_channels.size() && !found; ++i)
+                {
+                    size_t candidate = (next + i) % m_channels.size();
+                    if (m_channels[candidate].hasPending)
+                    {
+                        cameraIndex = candidate;
+                        found = true;
+                    }
+                }
+                if (!found)
+                {
+                    m_pendingCond.wait( lock );
+                }
+            }
+            if (!m_running)
+            {
+                break;
+            }
+            Channel& channel = m_channels[cameraIndex];
+            // Swap instead of copy; the old work buffer becomes the next pending buffer.
+            cv::swap( work, channel.pending );
+            submitNs = channel.pendingSubmitNs;
+            channel.hasPending = false;
+            next = cameraIndex + 1;
+        }
+
+        const uint64_t start = NowNs();
+        const uint64_t cpuStart = ThreadCpuNs();
+        if (work.cols > m_maxWidth)
+        {
+            int height = (int) ((int64_t) work.rows * m_maxWidth / work.cols);
+            cv::resize( work, scaled, cv::Size( m_maxWidth, height ), 0, 0, cv::INTER_AREA );
+        }
+        else
+        {
+            scaled = work;
+        }
+        std::shared_ptr<EncodedFrame> pFrame = std::make_shared<EncodedFrame>();
+        cv::imencode( ".jpg", scaled, pFrame->jpeg, params );
+        pFrame->submitNs = submitNs;
+        m_encodeNs += NowNs() - start;
+        m_encoderCpuNs += ThreadCpuNs() - cpuStart;
+
+        {
+            std::lock_guard<std::mutex> lock( m_mutex );
+            Channel& channel = m_channels[cameraIndex];
+            pFrame->sequence = ++channel.sequence;
+            channel.latest = pFrame;
+        }
+        ++m_framesEncoded;
+        m_encodedCond.notify_all();
+    }
+}
+
+void CPreviewServer::AcceptLoop()
+{
+    while (m_running)
+    {
+        struct pollfd pfd;
+        pfd.fd = m_listenFd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        if (poll( &pfd, 1, 200 ) <= 0)
+        {
+            continue;
+        }
+        int fd = accept( m_listenFd, NULL, NULL );
+        if (fd < 0)
+        {
+            continue;
+        }
+        int sendBuffer = c_clientSendBuffer;
+        setsockopt( fd, SOL_SOCKET, SO_SNDBUF, &sendBuffer, sizeof( sendBuffer ) );
+        {
+            std::lock_guard<std::mutex> lock( m_mutex );
+            if (!m_running)
+            {
+                close( fd );
+                break;
+            }
+            m_clientFds.push_back( fd );
+            ++m_clients;
+        }
+        std::thread( &CPreviewServer::ClientLoop, this, fd ).detach();
+    }
+}
+
+bool CPreviewServer::SendAll( int fd, const void* pData, size_t size )
+{
+    const char* p = (const char*) pData;
+    while (size > 0)
+    {
+        ssize_t n = send( fd, p, size, MSG_NOSIGNAL );
+        if (n <= 0)
+        {
+            return false;
+        }
+        p += n;
+        size -= (size_t) n;
+    }
+    return true;
+}
+
+void CPreviewServer::ClientLoop( int fd )
+{
+    // Only the request line matters; read until the end of the headers or 2 KB.
+    char request[2048];
+    size_t length = 0;
+    while (length < sizeof( request ) - 1)
+    {
+        ssize_t n = recv( fd, request + length, sizeof( request ) - 1 - length, 0 );
+        if (n <= 0)
+        {
+            break;
+        }
+        length += (size_t) n;
+        request[length] = '\0';
+        if (strstr( request, "\r\n\r\n" ) != NULL)
+        {
+            break;
+        }
+    }
+    request[length] = '\0';
+
+    unsigned cameraIndex = 0;
+    if (sscanf( request, "GET /cam%u", &cameraIndex ) == 1 && cameraIndex < m_channels.size())
+    {
+        static const char header[] =
+            "HTTP/1.0 200 OK\r\n"
+            "Cache-Control: no-cache\r\n"
+            "Connection: close\r\n"
+            "Content-Type: multipart/x-mixed-replace; boundary=frame\r\n\r\n";
+        bool ok = SendAll( fd, header, sizeof( header ) - 1 );
+        uint64_t sent = 0;
+        while (ok)
+        {
+            std::shared_ptr<const EncodedFrame> pFrame;
+            {
+                std::unique_lock<std::mutex> lock( m_mutex );
+                const Channel& channel = m_channels[cameraIndex];
+                while (m_running && !(channel.latest && channel.latest->sequence > sent))
+                {
+                    m_encodedCond.wait( lock );
+                }
+                if (!m_running)
+                {
+                    break;
+                }
+                pFrame = channel.latest;
+            }
+            // Anything encoded while this client was still sending is skipped, not queued.
+            if (sent != 0 && pFrame->sequence > sent + 1)
+            {
+                m_framesSkipped += pFrame->sequence - sent - 1;
+            }
+            char partHeader[128];
+            int partLength = snprintf( partHeader, sizeof( partHeader ),
+                "--frame\r\nContent-Type: image/jpeg\r\nContent-Length: %zu\r\n\r\n", pFrame->jpeg.size() );
+            ok = SendAll( fd, partHeader, (size_t) partLength )
+                && SendAll( fd, pFrame->jpeg.data(), pFrame->jpeg.size() )
+                && SendAll( fd, "\r\n", 2 );
+            if (ok)
+            {
+                sent = pFrame->sequence;
+                ++m_framesSent;
+                m_submitToSentNs += NowNs() - pFrame->submitNs;
+            }
+        }
+    }
+    else if (strncmp( request, "GET / ", 6 ) == 0)
+    {
+        std::string body = "<html><body>";
+        for (size_t i = 0; i < m_channels.size(); ++i)
+        {
+            body += "<img src=\"/cam" + std::to_string( i ) + "\"/>";
+        }
+        body += "</body></html>";
+        std::string response = "HTTP/1.0 200 OK\r\nContent-Type: text/html\r\nContent-Length: "
+            + std::to_string( body.size() ) + "\r\nConnection: close\r\n\r\n" + body;
+        SendAll( fd, response.data(), response.size() );
+    }
+    else
+    {
+        static const char notFound[] = "HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+        SendAll( fd, notFound, sizeof( notFound ) - 1 );
+    }
+
+    std::lock_guard<std::mutex> lock( m_mutex );
+    for (size_t i = 0; i < m_clientFds.size(); ++i)
+    {
+        if (m_clientFds[i] == fd)
+        {
+            m_clientFds.erase( m_clientFds.begin() + i );
+            break;
+        }
+    }
+    close( fd );
+    --m_clients;
+    m_encodedCond.notify_all();
+}
+
+CPreviewServer::Stats CPreviewServer::GetStats() const
+{
+    Stats stats;
+    stats.framesSubmitted = m_framesSubmitted;
+    stats.framesEncoded = m_framesEncoded;
+    stats.framesSent = m_framesSent;
+    stats.framesSkipped = m_framesSkipped;
+    stats.encodeNs = m_encodeNs;
+    stats.encoderCpuNs = m_encoderCpuNs;
+    stats.submitToSentNs = m_submitToSentNs;
+    stats.clients = m_clients;
+    return stats;
+}
@@ -0,0 +1,107 @@
+// PreviewServer.h
+/*
+    Headless live preview.
+
+    Replaces the HighGUI window with an MJPEG stream served on localhost:
+        http://127.0.0.1:<port>/cam<N>   multipart/x-mixed-replace stream of camera N
+        http://127.0.0.1:<port>/         index page listing the cameras
+
+    Camera threads call SubmitFrame(), which only copies the frame into a per-camera
+    pending buffer and returns. A single encoder thread downscales and JPEG-encodes the
+    newest pending frame once; every connected client is then sent the same encoded
+    buffer. A client that is still busy sending an older frame simply picks up the newest
+    one when it is ready, so slow clients skip frames and never hold up the cameras.
+*/
+#ifndef PREVIEWSERVER_H
+#define PREVIEWSERVER_H
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <stdint.h>
+#include <opencv2/core.hpp>
+
+class CPreviewServer
+{
+public:
+    CPreviewServer( size_t cameraCount, uint16_t port = 8080, int maxWidth = 640, int jpegQuality = 70 );
+    ~CPreviewServer();
+
+    // Binds to 127.0.0.1:port and starts the encoder and accept threads.
+    bool Start();
+    void Stop();
+    // The bound port once started; the one the system picked if port was 0.
+    uint16_t Port() const { return m_boundPort; }
+
+    // Called from the camera threads. Never blocks on encoding or on clients.
+    void SubmitFrame( size_t cameraIndex, const cv::Mat& bgrImage );
+
+    struct Stats
+    {
+        uint64_t framesSubmitted;
+        uint64_t framesEncoded;
+        uint64_t framesSent;
+        uint64_t framesSkipped;     // Encoded frames a client never received because it was too slow.
+        uint64_t encodeNs;          // Total wall time spent downscaling and encoding.
+        uint64_t encoderCpuNs;      // CPU time of the encoder thread.
+        uint64_t submitToSentNs;    // Sum of SubmitFrame() to send() completion over framesSent.
+        uint32_t clients;
+    };
+    Stats GetStats() const;
+
+private:
+    CPreviewServer( const CPreviewServer& );
+    CPreviewServer& operator=( const CPreviewServer& );
+
+    struct EncodedFrame
+    {
+        std::vector<uint8_t> jpeg;
+        uint64_t sequence;
+        uint64_t submitNs;
+    };
+
+    struct Channel
+    {
+        cv::Mat pending;            // Written by SubmitFrame(), reused between frames.
+        uint64_t pendingSubmitNs;
+        bool hasPending;
+        std::shared_ptr<const EncodedFrame> latest;
+        uint64_t sequence;
+    };
+
+    void EncoderLoop();
+    void AcceptLoop();
+    void ClientLoop( int fd );
+    bool SendAll( int fd, const void* pData, size_t size );
+
+    const uint16_t m_port;
+    const int m_maxWidth;
+    const int m_jpegQuality;
+
+    std::vector<Channel> m_channels;
+    mutable std::mutex m_mutex;
+    std::condition_variable m_pendingCond;     // Encoder waits for submitted frames.
+    std::condition_variable m_encodedCond;     // Clients wait for newly encoded frames.
+
+    std::atomic<bool> m_running;
+    int m_listenFd;
+    uint16_t m_boundPort;
+    std::thread m_encoderThread;
+    std::thread m_acceptThread;
+    std::vector<int> m_clientFds;           // Client threads are detached; Stop() waits on m_clients.
+
+    std::atomic<uint64_t> m_framesSubmitted;
+    std::atomic<uint64_t> m_framesEncoded;
+    std::atomic<uint64_t> m_framesSent;
+    std::atomic<uint64_t> m_framesSkipped;
+    std::atomic<uint64_t> m_encodeNs;
+    std::atomic<uint64_t> m_encoderCpuNs;
+    std::atomic<uint64_t> m_submitToSentNs;
+    std::atomic<uint32_t> m_clients;
+};
+
+#endif // PREVIEWSERVER_H
@@ -0,0 +1,109 @@
+// SimulatedMotionSource.cpp
+#include "SimulatedMotionSource.h"
+
+#include <cmath>
+
+CSimulatedMotionSource::Config::Config()
+    : imuRate( 400.0 )
+    , wheelRate( 100.0 )
+    , cameraRate( 30.0 )
+    , cameraLatency( 0.04 )
+    , radius( 5.0 )
+    , speed( 1.5 )
+    , accelNoise( 0.02 )
+    , gyroNoise( 0.002 )
+    , wheelNoise( 0.05 )
+    , positionNoise( 0.02 )
+    , orientationNoise( 0.005 )
+    , seed( 1 )
+{
+}
+
+CSimulatedMotionSource::CSimulatedMotionSource( uint64_t startTimestamp, const Config& config )
+    : m_config( config )
+    , m_start( startTimestamp )
+    , m_nextImu( startTimestamp + Period( config.imuRate ) )
+    , m_nextWheel( startTimestamp + Period( config.wheelRate ) )
+    , m_nextCapture( startTimestamp + Period( config.cameraRate ) )
+    , m_pendingHead( 0 )
+    , m_pendingCount( 0 )
+    , m_accelBias( 0.05, -0.03, 0.02 )
+    , m_gyroBias( 0.002, -0.001, 0.003 )
+    , m_random( config.seed )
+{
+}
+
+void CSimulatedMotionSource::Truth( uint64_t timestamp, Eigen::Vector3d& position, Eigen::Vector3d& velocity,
+                                   Eigen::Quaterniond& orientation ) const
+{
+    // Counter-clockwise circle starting at the origin, heading along +x.
+    const double yaw = m_config.speed / m_config.radius * Seconds( timestamp );
+    position = Eigen::Vector3d( m_config.radius * std::sin( yaw ), m_config.radius * (1.0 - std::cos( yaw )), 0.0 );
+    velocity = Eigen::Vector3d( m_config.speed * std::cos( yaw ), m_config.speed * std::sin( yaw ), 0.0 );
+    orientation = Eigen::Quaterniond( Eigen::AngleAxisd( yaw, Eigen::Vector3d::UnitZ() ) );
+}
+
+void CSimulatedMotionSource::Next( Event& event )
+{
+    while (true)
+    {
+        const uint64_t nextDelivery = m_pendingCount > 0
+            ? m_pending[m_pendingHead].timestamp + (uint64_t) (m_config.cameraLatency * 1e9)
+            : (uint64_t) -1;
+
+        if (m_nextCapture <= m_nextImu && m_nextCapture <= m_nextWheel && m_nextCapture <= nextDelivery
+            && m_pendingCount < c_maxPendingPoses)
+        {
+            PoseMeasurement& pose = m_pending[(m_pendingHead + m_pendingCount++) % c_maxPendingPoses];
+            Eigen::Vector3d velocity;
+            Truth( m_nextCapture, pose.position, velocity, pose.orientation );
+            pose.timestamp = m_nextCapture;
+            pose.positionSigma = m_config.positionNoise;
+            pose.orientationSigma = m_config.orientationNoise;
+            for (int i = 0; i < 3; ++i)
+            {
+                pose.position[i] += m_config.positionNoise * m_normal( m_random );
+            }
+            const Eigen::Vector3d theta( m_normal( m_random ), m_normal( m_random ), m_normal( m_random ) );
+            pose.orientation = pose.orientation
+                * Eigen::Quaterniond( Eigen::AngleAxisd( m_config.orientationNoise * theta.norm(), theta.normalized() ) );
+            m_nextCapture += Period( m_config.cameraRate );
+            continue;
+        }
+
+        if (nextDelivery <= m_nextImu && nextDelivery <= m_nextWheel)
+        {
+            event.kind = EventPose;
+            event.pose = m_pending[m_pendingHead];
+            m_pendingHead = (m_pendingHead + 1) % c_maxPendingPoses;
+            --m_pendingCount;
+            return;
+        }
+
+        if (m_nextImu <= m_nextWheel)
+        {
+            const double yawRate = m_config.speed / m_config.radius;
+            // In the body frame the centripetal acceleration points to the left (+y); the
+            // accelerometer also senses the reaction to gravity.
+            const double accelSigma = m_config.accelNoise * std::sqrt( m_config.imuRate );
+            const double gyroSigma = m_config.gyroNoise * std::sqrt( m_config.imuRate );
+            event.kind = EventImu;
+            event.imu.timestamp = m_nextImu;
+            event.imu.accel = Eigen::Vector3d( 0.0, m_config.speed * yawRate, 9.81 ) + m_accelBias;
+            event.imu.gyro = Eigen::Vector3d( 0.0, 0.0, yawRate ) + m_gyroBias;
+            for (int i = 0; i < 3; ++i)
+            {
+                event.imu.accel[i] += accelSigma * m_normal( m_random );
+                event.imu.gyro[i] += gyroSigma * m_normal( m_random );
+            }
+            m_nextImu += Period( m_config.imuRate );
+            return;
+        }
+
+        event.kind = EventWheel;
+        event.wheel.timestamp = m_nextWheel;
+        event.wheel.speed = m_config.speed + m_config.wheelNoise * m_normal( m_random );
+        m_nextWheel += Period( m_config.wheelRate );
+        return;
+    }
+}
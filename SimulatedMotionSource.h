@@ -0,0 +1,77 @@
+// SimulatedMotionSource.h
+/*
+    Local stand-in for the IMU, the wheel encoders and visual odometry.
+
+    The robot drives a circle at constant speed. IMU and wheel samples carry white noise
+    (the IMU also a constant bias); camera poses are stamped with their capture time, as
+    frames are with the grab result timestamp, but are delivered cameraLatency later,
+    after newer IMU and wheel samples. Next() returns the events in delivery order.
+*/
+#ifndef SIMULATEDMOTIONSOURCE_H
+#define SIMULATEDMOTIONSOURCE_H
+
+#include <random>
+#include "StateEstimator.h"
+
+class CSimulatedMotionSource
+{
+public:
+    struct Config
+    {
+        Config();
+
+        double imuRate;             // Hz
+        double wheelRate;           // Hz
+        double cameraRate;          // Hz
+        double cameraLatency;       // s from capture to pose delivery
+        double radius;              // m
+        double speed;               // m/s
+        double accelNoise;          // m/s^2/sqrt(Hz)
+        double gyroNoise;           // rad/s/sqrt(Hz)
+        double wheelNoise;          // m/s
+        double positionNoise;       // m
+        double orientationNoise;    // rad
+        unsigned seed;
+    };
+
+    enum EventKind { EventImu, EventWheel, EventPose };
+
+    struct Event
+    {
+        EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
+        EventKind kind;
+        ImuSample imu;
+        WheelSample wheel;
+        PoseMeasurement pose;
+    };
+
+    explicit CSimulatedMotionSource( uint64_t startTimestamp, const Config& config = Config() );
+
+    void Next( Event& event );
+
+    // Ground truth at a timestamp.
+    void Truth( uint64_t timestamp, Eigen::Vector3d& position, Eigen::Vector3d& velocity,
+                Eigen::Quaterniond& orientation ) const;
+
+private:
+    static const size_t c_maxPendingPoses = 16;
+
+    double Seconds( uint64_t timestamp ) const { return (timestamp - m_start) * 1e-9; }
+    uint64_t Period( double rate ) const { return (uint64_t) (1e9 / rate); }
+
+    Config m_config;
+    uint64_t m_start;
+    uint64_t m_nextImu;
+    uint64_t m_nextWheel;
+    uint64_t m_nextCapture;
+    PoseMeasurement m_pending[c_maxPendingPoses];   // Captured, not yet delivered; FIFO ring.
+    size_t m_pendingHead;
+    size_t m_pendingCount;
+    Eigen::Vector3d m_accelBias;
+    Eigen::Vector3d m_gyroBias;
+    std::mt19937 m_random;
+    std::normal_distribution<double> m_normal;
+};
+
+#endif // SIMULATEDMOTIONSOURCE_H
@@ -0,0 +1,302 @@
+// StateEstimator.cpp
+#include "StateEstimator.h"
+
+#include <Eigen/Cholesky>
+#include <cmath>
+
+typedef Eigen::Matrix<double, CStateEstimator::c_errorStates, 1> ErrorVector;
+
+static const Eigen::Vector3d c_gravity( 0.0, 0.0, -9.81 );
+
+static Eigen::Matrix3d Skew( const Eigen::Vector3d& v )
+{
+    Eigen::Matrix3d m;
+    m <<  0.0, -v.z(),  v.y(),
+          v.z(),  0.0, -v.x(),
+         -v.y(),  v.x(),  0.0;
+    return m;
+}
+
+// Rotation vector to quaternion.
+static Eigen::Quaterniond DeltaRotation( const Eigen::Vector3d& theta )
+{
+    const double angle = theta.norm();
+    if (angle < 1e-9)
+    {
+        return Eigen::Quaterniond( 1.0, 0.5 * theta.x(), 0.5 * theta.y(), 0.5 * theta.z() ).normalized();
+    }
+    return Eigen::Quaterniond( Eigen::AngleAxisd( angle, theta / angle ) );
+}
+
+// Quaternion to rotation vector.
+static Eigen::Vector3d RotationVector( const Eigen::Quaterniond& q )
+{
+    const double sign = q.w() < 0.0 ? -1.0 : 1.0;
+    const Eigen::Vector3d v = sign * q.vec();
+    const double n = v.norm();
+    if (n < 1e-12)
+    {
+        return 2.0 * v;
+    }
+    return (2.0 * std::atan2( n, sign * q.w() ) / n) * v;
+}
+
+CStateEstimator::Noise::Noise()
+    : accel( 0.02 )
+    , gyro( 0.002 )
+    , accelBiasWalk( 1e-4 )
+    , gyroBiasWalk( 1e-5 )
+    , wheelSpeed( 0.05 )
+    , nonHolonomic( 0.1 )
+{
+}
+
+uint64_t CStateEstimator::Input::Timestamp() const
+{
+    switch (kind)
+    {
+    case InputImu:
+        return imu.timestamp;
+    case InputWheel:
+        return wheel.timestamp;
+    default:
+        return pose.timestamp;
+    }
+}
+
+CStateEstimator::CStateEstimator( const Noise& noise )
+    : m_noise( noise )
+    , m_historyHead( 0 )
+    , m_historyCount( 0 )
+    , m_predictions( 0 )
+    , m_updates( 0 )
+    , m_outOfSequence( 0 )
+    , m_replayed( 0 )
+    , m_rejected( 0 )
+{
+    Reset( 0, Eigen::Vector3d::Zero(), Eigen::Vector3d::Zero(), Eigen::Quaterniond::Identity() );
+}
+
+void CStateEstimator::Reset( uint64_t timestamp, const Eigen::Vector3d& position, const Eigen::Vector3d& velocity,
+                             const Eigen::Quaterniond& orientation )
+{
+    m_state.timestamp = timestamp;
+    m_state.position = position;
+    m_state.velocity = velocity;
+    m_state.orientation = orientation.normalized();
+    m_state.accelBias.setZero();
+    m_state.gyroBias.setZero();
+
+    ErrorVector sigma;
+    sigma << 0.01, 0.01, 0.01,      // position
+             0.1, 0.1, 0.1,         // velocity
+             0.01, 0.01, 0.01,      // orientation
+             0.1, 0.1, 0.1,         // accel bias
+             0.01, 0.01, 0.01;      // gyro bias
+    m_state.covariance = sigma.cwiseAbs2().asDiagonal();
+
+    m_historyHead = 0;
+    m_historyCount = 0;
+}
+
+void CStateEstimator::AddImu( const ImuSample& sample )
+{
+    if (sample.timestamp <= m_state.timestamp)
+    {
+        ++m_rejected;
+        return;
+    }
+    Input input;
+    input.kind = InputImu;
+    input.imu = sample;
+    Apply( input );
+}
+
+bool CStateEstimator::AddWheel( const WheelSample& sample )
+{
+    Input input;
+    input.kind = InputWheel;
+    input.wheel = sample;
+    return AddMeasurement( input );
+}
+
+bool CStateEstimator::AddPose( const PoseMeasurement& pose )
+{
+    Input input;
+    input.kind = InputPose;
+    input.pose = pose;
+    return AddMeasurement( input );
+}
+
+bool CStateEstimator::AddMeasurement( const Input& input )
+{
+    const uint64_t timestamp = input.Timestamp();
+    if (timestamp >= m_state.timestamp || m_historyCount == 0)
+    {
+        // Newer than the last IMU sample: there is nothing to propagate with yet, so the
+        // measurement is applied to the current state, at most one IMU period early.
+        Apply( input );
+        return true;
+    }
+
+    // Rewind to the newest state at or before the measurement.
+    size_t age = 0;
+    while (age < m_historyCount && Entry( age ).state.timestamp > timestamp)
+    {
+        ++age;
+    }
+    if (age == m_historyCount)
+    {
+        ++m_rejected;
+        return false;
+    }
+    ++m_outOfSequence;
+
+    const size_t replayCount = age;
+    for (size_t i = 0; i < replayCount; ++i)
+    {
+        m_replay[i] = Entry( age - 1 - i ).input;
+    }
+    m_state = Entry( age ).state;
+    m_historyHead = (m_historyHead + c_historySize - age) % c_historySize;
+    m_historyCount -= age;
+
+    // The first input after the rewound state is the IMU sample covering the measurement
+    // time (only IMU samples advance the state timestamp); propagate with it up to there.
+    Predict( m_replay[0].imu, timestamp );
+    Apply( input );
+    for (size_t i = 0; i < replayCount; ++i)
+    {
+        Apply( m_replay[i] );
+    }
+    m_replayed += replayCount;
+    return true;
+}
+
+void CStateEstimator::Apply( const Input& input )
+{
+    switch (input.kind)
+    {
+    case InputImu:
+        Predict( input.imu, input.imu.timestamp );
+        break;
+    case InputWheel:
+        UpdateWheel( input.wheel );
+        break;
+    case InputPose:
+        UpdatePose( input.pose );
+        break;
+    }
+    Record( input );
+}
+
+void CStateEstimator::Record( const Input& input )
+{
+    HistoryEntry& entry = m_history[m_historyHead];
+    entry.input = input;
+    entry.state = m_state;
+    m_historyHead = (m_historyHead + 1) % c_historySize;
+    if (m_historyCount < c_historySize)
+    {
+        ++m_historyCount;
+    }
+}
+
+void CStateEstimator::Predict( const ImuSample& sample, uint64_t until )
+{
+    if (until <= m_state.timestamp)
+    {
+        return;
+    }
+    const double dt = (until - m_state.timestamp) * 1e-9;
+    const Eigen::Vector3d accel = sample.accel - m_state.accelBias;
+    const Eigen::Vector3d gyro = sample.gyro - m_state.gyroBias;
+    const Eigen::Matrix3d rotation = m_state.orientation.toRotationMatrix();
+    const Eigen::Quaterniond delta = DeltaRotation( gyro * dt );
+
+    // F = I except for these blocks (error state order p, v, theta, ba, bg).
+    const Eigen::Matrix3d dvdTheta = -rotation * Skew( accel ) * dt;
+    const Eigen::Matrix3d dvdBa = -rotation * dt;
+    const Eigen::Matrix3d dThetadTheta = delta.toRotationMatrix().transpose();
+
+    const Eigen::Vector3d worldAccel = rotation * accel + c_gravity;
+    m_state.position += m_state.velocity * dt + 0.5 * worldAccel * dt * dt;
+    m_state.velocity += worldAccel * dt;
+    m_state.orientation = (m_state.orientation * delta).normalized();
+    m_state.timestamp = until;
+
+    // P = F P F^T, using the sparsity of F: first the block rows (F P), then the block columns.
+    Covariance& p = m_state.covariance;
+    p.middleRows<3>( 0 ) += dt * p.middleRows<3>( 3 );
+    p.middleRows<3>( 3 ) += dvdTheta * p.middleRows<3>( 6 ) + dvdBa * p.middleRows<3>( 9 );
+    p.middleRows<3>( 6 ) = (dThetadTheta * p.middleRows<3>( 6 ) - dt * p.middleRows<3>( 12 )).eval();
+    p.middleCols<3>( 0 ) += dt * p.middleCols<3>( 3 );
+    p.middleCols<3>( 3 ) += p.middleCols<3>( 6 ) * dvdTheta.transpose() + p.middleCols<3>( 9 ) * dvdBa.transpose();
+    p.middleCols<3>( 6 ) = (p.middleCols<3>( 6 ) * dThetadTheta.transpose() - dt * p.middleCols<3>( 12 )).eval();
+
+    const double accelVar = m_noise.accel * m_noise.accel * dt;
+    const double gyroVar = m_noise.gyro * m_noise.gyro * dt;
+    const double accelBiasVar = m_noise.accelBiasWalk * m_noise.accelBiasWalk * dt;
+    const double gyroBiasVar = m_noise.gyroBiasWalk * m_noise.gyroBiasWalk * dt;
+    for (int i = 0; i < 3; ++i)
+    {
+        p( 3 + i, 3 + i ) += accelVar;
+        p( 6 + i, 6 + i ) += gyroVar;
+        p( 9 + i, 9 + i ) += accelBiasVar;
+        p( 12 + i, 12 + i ) += gyroBiasVar;
+    }
+    ++m_predictions;
+}
+
+void CStateEstimator::UpdateWheel( const WheelSample& sample )
+{
+    // Body velocity R^T v; its derivative with respect to the orientation error is [R^T v]x.
+    const Eigen::Matrix3d rotationT = m_state.orientation.toRotationMatrix().transpose();
+    const Eigen::Vector3d bodyVelocity = rotationT * m_state.velocity;
+
+    Eigen::Matrix<double, 3, 1> residual = Eigen::Vector3d( sample.speed, 0.0, 0.0 ) - bodyVelocity;
+    Eigen::Matrix<double, 3, c_errorStates> h = Eigen::Matrix<double, 3, c_errorStates>::Zero();
+    h.block<3, 3>( 0, 3 ) = rotationT;
+    h.block<3, 3>( 0, 6 ) = Skew( bodyVelocity );
+    Eigen::Matrix3d r = Eigen::Matrix3d::Zero();
+    r( 0, 0 ) = m_noise.wheelSpeed * m_noise.wheelSpeed;
+    r( 1, 1 ) = r( 2, 2 ) = m_noise.nonHolonomic * m_noise.nonHolonomic;
+    Update<3>( residual, h, r );
+}
+
+void CStateEstimator::UpdatePose( const PoseMeasurement& pose )
+{
+    Eigen::Matrix<double, 6, 1> residual;
+    residual.head<3>() = pose.position - m_state.position;
+    residual.tail<3>() = RotationVector( m_state.orientation.conjugate() * pose.orientation );
+    Eigen::Matrix<double, 6, c_errorStates> h = Eigen::Matrix<double, 6, c_errorStates>::Zero();
+    h.block<3, 3>( 0, 0 ).setIdentity();
+    h.block<3, 3>( 3, 6 ).setIdentity();
+    Eigen::Matrix<double, 6, 6> r = Eigen::Matrix<double, 6, 6>::Zero();
+    r.diagonal().head<3>().setConstant( pose.positionSigma * pose.positionSigma );
+    r.diagonal().tail<3>().setConstant( pose.orientationSigma * pose.orientationSigma );
+    Update<6>( residual, h, r );
+}
+
+template <int M>
+void CStateEstimator::Update( const Eigen::Matrix<double, M, 1>& residual,
+                              const Eigen::Matrix<double, M, c_errorStates>& h,
+                              const Eigen::Matrix<double, M, M>& r )
+{
+    Covariance& p = m_state.covariance;
+    const Eigen::Matrix<double, c_errorStates, M> pht = p * h.transpose();
+    const Eigen::Matrix<double, M, M> s = h * pht + r;
+    const Eigen::Matrix<double, c_errorStates, M> k = s.llt().solve( pht.transpose() ).transpose();
+    const ErrorVector dx = k * residual;
+
+    // P - K H P, symmetrized against rounding.
+    p.noalias() -= k * pht.transpose();
+    p = (0.5 * (p + p.transpose())).eval();
+
+    m_state.position += dx.segment<3>( 0 );
+    m_state.velocity += dx.segment<3>( 3 );
+    m_state.orientation = (m_state.orientation * DeltaRotation( dx.segment<3>( 6 ) )).normalized();
+    m_state.accelBias += dx.segment<3>( 9 );
+    m_state.gyroBias += dx.segment<3>( 12 );
+    ++m_updates;
+}
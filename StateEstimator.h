@@ -0,0 +1,161 @@
+// StateEstimator.h
+/*
+    Error-state EKF fusing IMU, wheel odometry and visual pose measurements.
+
+    Nominal state: position and velocity in the world frame (z up), body-to-world
+    orientation and the accelerometer and gyro biases. The filter estimates the 15-element
+    error state [dp dv dtheta dba dbg] and folds it into the nominal state after each update.
+
+    - AddImu() predicts with one IMU sample. A sample covers the interval since the
+      previous sample, i.e. it is integrated up to its own timestamp.
+    - AddWheel() updates with the measured forward speed, assuming the robot does not
+      move sideways or vertically in its body frame.
+    - AddPose() updates with a camera pose, stamped with the grab result's timestamp.
+
+    All timestamps are ns on one clock (the camera timestamp clock). Measurements usually
+    arrive late, after IMU samples newer than the frame have been applied. Every input is
+    therefore kept in a short history together with the state after it; an older
+    measurement rewinds to the last state before it, is applied there and the newer inputs
+    are replayed. Measurements older than the history are rejected.
+
+    All matrices are fixed-size Eigen types and the history is a fixed ring, so no step
+    allocates. The history makes the object large (~300 KB); allocate it once, not on a
+    small thread stack.
+*/
+#ifndef STATEESTIMATOR_H
+#define STATEESTIMATOR_H
+
+#include <Eigen/Core>
+#include <Eigen/Geometry>
+#include <stddef.h>
+#include <stdint.h>
+
+struct ImuSample
+{
+    uint64_t timestamp;
+    Eigen::Vector3d accel;          // m/s^2, specific force in the body frame
+    Eigen::Vector3d gyro;           // rad/s, body frame
+};
+
+struct WheelSample
+{
+    uint64_t timestamp;
+    double speed;                   // m/s along the body x axis
+};
+
+struct PoseMeasurement
+{
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
+    uint64_t timestamp;             // Grab result timestamp of the frame the pose was computed from.
+    Eigen::Vector3d position;       // m, world frame
+    Eigen::Quaterniond orientation; // body to world
+    double positionSigma;           // m
+    double orientationSigma;        // rad
+};
+
+class CStateEstimator
+{
+public:
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
+    static const int c_errorStates = 15;
+    static const size_t c_historySize = 128;    // ~250 ms at 400 Hz IMU + 100 Hz wheel.
+
+    typedef Eigen::Matrix<double, c_errorStates, c_errorStates> Covariance;
+
+    struct State
+    {
+        EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
+        uint64_t timestamp;
+        Eigen::Vector3d position;
+        Eigen::Vector3d velocity;
+        Eigen::Quaterniond orientation;
+        Eigen::Vector3d accelBias;
+        Eigen::Vector3d gyroBias;
+        Covariance covariance;
+    };
+
+    struct Noise
+    {
+        Noise();
+
+        double accel;               // m/s^2/sqrt(Hz)
+        double gyro;                // rad/s/sqrt(Hz)
+        double accelBiasWalk;       // m/s^3/sqrt(Hz)
+        double gyroBiasWalk;        // rad/s^2/sqrt(Hz)
+        double wheelSpeed;          // m/s
+        double nonHolonomic;        // m/s, allowed sideways and vertical body velocity
+    };
+
+    explicit CStateEstimator( const Noise& noise = Noise() );
+
+    // Starts over from the given state with zero biases; clears the history.
+    void Reset( uint64_t timestamp, const Eigen::Vector3d& position, const Eigen::Vector3d& velocity,
+                const Eigen::Quaterniond& orientation );
+
+    void AddImu( const ImuSample& sample );
+    // Return false if the measurement is older than the history and was dropped.
+    bool AddWheel( const WheelSample& sample );
+    bool AddPose( const PoseMeasurement& pose );
+
+    const State& Current() const { return m_state; }
+
+    uint64_t Predictions() const { return m_predictions; }
+    uint64_t Updates() const { return m_updates; }
+    uint64_t OutOfSequence() const { return m_outOfSequence; }
+    uint64_t Replayed() const { return m_replayed; }
+    uint64_t Rejected() const { return m_rejected; }
+
+private:
+    enum InputKind { InputImu, InputWheel, InputPose };
+
+    struct Input
+    {
+        EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
+        InputKind kind;
+        ImuSample imu;
+        WheelSample wheel;
+        PoseMeasurement pose;
+
+        uint64_t Timestamp() const;
+    };
+
+    struct HistoryEntry
+    {
+        EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
+        Input input;
+        State state;                // After the input was applied.
+    };
+
+    void Apply( const Input& input );
+    void Predict( const ImuSample& sample, uint64_t until );
+    void UpdateWheel( const WheelSample& sample );
+    void UpdatePose( const PoseMeasurement& pose );
+    template <int M>
+    void Update( const Eigen::Matrix<double, M, 1>& residual,
+                 const Eigen::Matrix<double, M, c_errorStates>& h,
+                 const Eigen::Matrix<double, M, M>& r );
+    void Record( const Input& input );
+    bool AddMeasurement( const Input& input );
+
+    HistoryEntry& Entry( size_t age ) { return m_history[(m_historyHead + c_historySize - 1 - age) % c_historySize]; }
+
+    Noise m_noise;
+    State m_state;
+    HistoryEntry m_history[c_historySize];
+    size_t m_historyHead;           // Next slot to write.
+    size_t m_historyCount;
+    Input m_replay[c_historySize];  // Scratch for the inputs to replay after a rewind.
+
+    uint64_t m_predictions;
+    uint64_t m_updates;
+    uint64_t m_outOfSequence;
+    uint64_t m_replayed;
+    uint64_t m_rejected;
+};
+
+#endif // STATEESTIMATOR_H
@@ -0,0 +1,257 @@
+// TaskScheduler.cpp
+#include "TaskScheduler.h"
+
+#include <chrono>
+#include <pthread.h>
+
+static uint64_t NowNs()
+{
+    return (uint64_t) std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch() ).count();
+}
+
+// Lets Submit() and RunOne() find the calling worker's own deque.
+static thread_local const CTaskScheduler* t_pScheduler = NULL;
+static thread_local size_t t_workerIndex = 0;
+
+static const size_t c_noWorker = (size_t) -1;
+
+void CTaskGroup::Wait( CTaskScheduler& scheduler )
+{
+    while (!Done())
+    {
+        if (!scheduler.RunOne())
+        {
+            std::this_thread::yield();
+        }
+    }
+}
+
+CTaskScheduler::Worker::Worker()
+    : tasksRun( 0 )
+    , tasksStolen( 0 )
+    , tasksCancelled( 0 )
+    , busyNs( 0 )
+    , startNs( NowNs() )
+{
+}
+
+CTaskScheduler::CTaskScheduler( size_t workerCount )
+    : m_nextWorker( 0 )
+    , m_priorityFloor( 0 )
+    , m_queued( 0 )
+    , m_running( true )
+{
+    if (workerCount == 0)
+    {
+        workerCount = std::thread::hardware_concurrency();
+        if (workerCount == 0)
+        {
+            workerCount = 2;
+        }
+    }
+    for (size_t i = 0; i < workerCount; ++i)
+    {
+        m_workers.push_back( std::unique_ptr<Worker>( new Worker ) );
+    }
+    // Start the threads only once every deque exists, since workers steal from each other.
+    for (size_t i = 0; i < workerCount; ++i)
+    {
+        m_workers[i]->thread = std::thread( &CTaskScheduler::WorkerLoop, this, i );
+    }
+}
+
+CTaskScheduler::~CTaskScheduler()
+{
+    {
+        std::lock_guard<std::mutex> lock( m_sleepMutex );
+        m_running = false;
+    }
+    m_sleepCond.notify_all();
+    for (size_t i = 0; i < m_workers.size(); ++i)
+    {
+        m_workers[i]->thread.join();
+    }
+    // Finish what is left so no CTaskGroup waits forever.
+    while (RunOne())
+    {
+    }
+}
+
+void CTaskScheduler::Submit( std::function<void()> fn, uint64_t priority, CTaskGroup* pGroup, bool mustRun )
+{
+    if (pGroup != NULL)
+    {
+        pGroup->m_pending.fetch_add( 1, std::memory_order_relaxed );
+    }
+    Task task;
+    task.fn = std::move( fn );
+    task.priority = priority;
+    task.pGroup = pGroup;
+    task.mustRun = mustRun;
+
+    // Workers keep their own subtasks local; outside threads spread the load.
+    size_t index = t_pScheduler == this ? t_workerIndex : m_nextWorker.fetch_add( 1, std::memory_order_relaxed ) % m_workers.size();
+    Worker& worker = *m_workers[index];
+    {
+        std::lock_guard<std::mutex> lock( worker.mutex );
+        worker.tasks.push_back( std::move( task ) );
+    }
+    m_queued.fetch_add( 1, std::memory_order_release );
+    {
+        // Taking the lock orders this with a worker that is about to sleep.
+        std::lock_guard<std::mutex> lock( m_sleepMutex );
+    }
+    m_sleepCond.notify_one();
+}
+
+void CTaskScheduler::ParallelFor( int begin, int end, int grain, const std::function<void( int, int )>& fn, uint64_t priority )
+{
+    if (grain < 1)
+    {
+        grain = 1;
+    }
+    CTaskGroup group;
+    for (int chunk = begin; chunk < end; chunk += grain)
+    {
+        const int chunkEnd = chunk + grain < end ? chunk + grain : end;
+        Submit( [&fn, chunk, chunkEnd]() { fn( chunk, chunkEnd ); }, priority, &group, true );
+    }
+    group.Wait( *this );
+}
+
+void CTaskScheduler::RaisePriorityFloor( uint64_t priority )
+{
+    uint64_t current = m_priorityFloor.load( std::memory_order_relaxed );
+    while (priority > current && !m_priorityFloor.compare_exchange_weak( current, priority ))
+    {
+    }
+}
+
+bool CTaskScheduler::TakeTask( size_t self, Task& task, bool& stolen )
+{
+    stolen = false;
+    if (self != c_noWorker)
+    {
+        Worker& own = *m_workers[self];
+        std::lock_guard<std::mutex> lock( own.mutex );
+        if (!own.tasks.empty())
+        {
+            // LIFO on the own deque: the newest frame's work runs first and is still in cache.
+            task = std::move( own.tasks.back() );
+            own.tasks.pop_back();
+            m_queued.fetch_sub( 1, std::memory_order_relaxed );
+            return true;
+        }
+    }
+    const size_t count = m_workers.size();
+    const size_t start = self != c_noWorker ? self + 1 : m_nextWorker.load( std::memory_order_relaxed );
+    for (size_t i = 0; i < count; ++i)
+    {
+        const size_t victim = (start + i) % count;
+        if (victim == self)
+        {
+            continue;
+        }
+        Worker& other = *m_workers[victim];
+        std::lock_guard<std::mutex> lock( other.mutex );
+        if (!other.tasks.empty())
+        {
+            // Steal the oldest task: it is the biggest remaining chunk of the victim's work.
+            task = std::move( other.tasks.front() );
+            other.tasks.pop_front();
+            m_queued.fetch_sub( 1, std::memory_order_relaxed );
+            stolen = true;
+            return true;
+        }
+    }
+    return false;
+}
+
+void CTaskScheduler::Execute( Worker* pWorker, Task& task )
+{
+    CTaskGroup* pGroup = task.pGroup;
+    if (!task.mustRun && task.priority < m_priorityFloor.load( std::memory_order_relaxed ))
+    {
+        if (pWorker != NULL)
+        {
+            pWorker->tasksCancelled.fetch_add( 1, std::memory_order_relaxed );
+        }
+        if (pGroup != NULL)
+        {
+            pGroup->m_cancelled.fetch_add( 1, std::memory_order_relaxed );
+        }
+    }
+    else
+    {
+        const uint64_t start = NowNs();
+        task.fn();
+        if (pWorker != NULL)
+        {
+            pWorker->busyNs.fetch_add( NowNs() - start, std::memory_order_relaxed );
+            pWorker->tasksRun.fetch_add( 1, std::memory_order_relaxed );
+        }
+    }
+    task.fn = nullptr;
+    if (pGroup != NULL)
+    {
+        pGroup->m_pending.fetch_sub( 1, std::memory_order_acq_rel );
+    }
+}
+
+bool CTaskScheduler::RunOne()
+{
+    const size_t self = t_pScheduler == this ? t_workerIndex : c_noWorker;
+    Task task;
+    bool stolen = false;
+    if (!TakeTask( self, task, stolen ))
+    {
+        return false;
+    }
+    Worker* pWorker = self != c_noWorker ? m_workers[self].get() : NULL;
+    if (pWorker != NULL && stolen)
+    {
+        pWorker->tasksStolen.fetch_add( 1, std::memory_order_relaxed );
+    }
+    Execute( pWorker, task );
+    return true;
+}
+
+void CTaskScheduler::WorkerLoop( size_t index )
+{
+    pthread_setname_np( pthread_self(), "scheduler" );
+    t_pScheduler = this;
+    t_workerIndex = index;
+    while (true)
+    {
+        if (RunOne())
+        {
+            continue;
+        }
+        std::unique_lock<std::mutex> lock( m_sleepMutex );
+        while (m_running && m_queued.load( std::memory_order_acquire ) <= 0)
+        {
+            m_sleepCond.wait( lock );
+        }
+        if (!m_running)
+        {
+            break;
+        }
+    }
+}
+
+std::vector<CTaskScheduler::WorkerStats> CTaskScheduler::GetWorkerStats() const
+{
+    std::vector<WorkerStats> stats( m_workers.size() );
+    const uint64_t now = NowNs();
+    for (size_t i = 0; i < m_workers.size(); ++i)
+    {
+        const Worker& worker = *m_workers[i];
+        stats[i].tasksRun = worker.tasksRun.load( std::memory_order_relaxed );
+        stats[i].tasksStolen = worker.tasksStolen.load( std::memory_order_relaxed );
+        stats[i].tasksCancelled = worker.tasksCancelled.load( std::memory_order_relaxed );
+        stats[i].busyNs = worker.busyNs.load( std::memory_order_relaxed );
+        stats[i].aliveNs = now - worker.startNs;
+    }
+    return stats;
+}
@@ -0,0 +1,120 @@
+// TaskScheduler.h
+/*
+    Work-stealing task scheduler for per-frame processing.
+
+    Each worker owns a deque. A worker pushes and pops at the back of its own deque
+    (newest first) and, when it runs dry, steals from the front of another worker's deque.
+    Tasks submitted from outside the pool (camera or pipeline threads) are spread over the
+    workers round-robin.
+
+    Every task carries a frame priority, normally the pipeline's frame sequence number.
+    Newer frames are picked first because deques are popped LIFO, and RaisePriorityFloor()
+    lets the pipeline cancel the remaining tasks of frames that have been superseded;
+    such tasks are dropped instead of run, unless they were submitted as mustRun.
+
+    CTaskGroup counts the tasks of one unit of work (e.g. the strips of one frame); Wait()
+    runs other tasks while it waits, so waiting from inside a task cannot deadlock the pool.
+*/
+#ifndef TASKSCHEDULER_H
+#define TASKSCHEDULER_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <stdint.h>
+
+class CTaskScheduler;
+
+class CTaskGroup
+{
+public:
+    CTaskGroup() : m_pending( 0 ), m_cancelled( 0 ) {}
+
+    // Blocks until every task of the group has run or was cancelled, helping the pool meanwhile.
+    void Wait( CTaskScheduler& scheduler );
+    bool Done() const { return m_pending.load( std::memory_order_acquire ) == 0; }
+    uint32_t Cancelled() const { return m_cancelled.load(); }
+
+private:
+    friend class CTaskScheduler;
+    std::atomic<uint32_t> m_pending;
+    std::atomic<uint32_t> m_cancelled;
+};
+
+class CTaskScheduler
+{
+public:
+    // workerCount 0 uses one worker per hardware thread.
+    explicit CTaskScheduler( size_t workerCount = 0 );
+    ~CTaskScheduler();
+
+    void Submit( std::function<void()> task, uint64_t priority, CTaskGroup* pGroup = NULL, bool mustRun = false );
+
+    // Splits [begin, end) into chunks of at most grain and runs fn(chunkBegin, chunkEnd) on the pool.
+    // Returns once all chunks are done. Chunks are mustRun: the caller needs all of them.
+    void ParallelFor( int begin, int end, int grain, const std::function<void( int, int )>& fn, uint64_t priority );
+
+    // Tasks with a lower priority that have not started yet are cancelled.
+    void RaisePriorityFloor( uint64_t priority );
+
+    // Runs one pending task on the calling thread. Returns false if there was none.
+    bool RunOne();
+
+    size_t WorkerCount() const { return m_workers.size(); }
+
+    struct WorkerStats
+    {
+        uint64_t tasksRun;
+        uint64_t tasksStolen;       // Tasks this worker took from another worker's deque.
+        uint64_t tasksCancelled;
+        uint64_t busyNs;
+        uint64_t aliveNs;           // Time since the worker started; busyNs / aliveNs is its utilization.
+    };
+    std::vector<WorkerStats> GetWorkerStats() const;
+
+private:
+    CTaskScheduler( const CTaskScheduler& );
+    CTaskScheduler& operator=( const CTaskScheduler& );
+
+    struct Task
+    {
+        std::function<void()> fn;
+        uint64_t priority;
+        CTaskGroup* pGroup;
+        bool mustRun;
+    };
+
+    struct Worker
+    {
+        Worker();
+
+        std::mutex mutex;               // Short critical sections only: push/pop/steal.
+        std::deque<Task> tasks;
+        std::thread thread;
+        std::atomic<uint64_t> tasksRun;
+        std::atomic<uint64_t> tasksStolen;
+        std::atomic<uint64_t> tasksCancelled;
+        std::atomic<uint64_t> busyNs;
+        uint64_t startNs;
+    };
+
+    void WorkerLoop( size_t index );
+    bool TakeTask( size_t self, Task& task, bool& stolen );
+    void Execute( Worker* pWorker, Task& task );
+
+    std::vector<std::unique_ptr<Worker> > m_workers;
+    std::atomic<size_t> m_nextWorker;
+    std::atomic<uint64_t> m_priorityFloor;
+    std::atomic<int64_t> m_queued;      // Tasks sitting in any deque.
+
+    std::mutex m_sleepMutex;
+    std::condition_variable m_sleepCond;
+    std::atomic<bool> m_running;
+};
+
+#endif // TASKSCHEDULER_H
@@ -0,0 +1,397 @@
+// VoxelMap.cpp
+#include "VoxelMap.h"
+
+#include <cmath>
+#include <stdlib.h>
+#include <string.h>
+
+static const int c_keyBits = 21;
+static const int64_t c_keyOffset = 1 << (c_keyBits - 1);
+static const uint64_t c_keyMask = (1u << c_keyBits) - 1;
+static const int c_victimScan = 32;     // LRU entries looked at for a distant block.
+
+static inline uint64_t BlockKey( const int32_t coord[3] )
+{
+    return ((uint64_t) (coord[0] + c_keyOffset) & c_keyMask) << (2 * c_keyBits)
+         | ((uint64_t) (coord[1] + c_keyOffset) & c_keyMask) << c_keyBits
+         | ((uint64_t) (coord[2] + c_keyOffset) & c_keyMask);
+}
+
+static inline size_t HashSlot( uint64_t key, size_t mask )
+{
+    return (size_t) ((key * 0x9e3779b97f4a7c15ull) >> 32) & mask;
+}
+
+static inline int32_t FloorToInt( float value )
+{
+    const int32_t i = (int32_t) value;
+    return value < (float) i ? i - 1 : i;
+}
+
+CVoxelMap::Config::Config()
+    : voxelSize( 0.05f )
+    , memoryBudget( 64u << 20 )
+    , keepRadius( 3.0f )
+{
+}
+
+CVoxelMap::CVoxelMap( const Config& config )
+    : m_config( config )
+    , m_pBlocks( NULL )
+    , m_blockCapacity( 0 )
+    , m_blocksTouched( 0 )
+    , m_newest( -1 )
+    , m_oldest( -1 )
+    , m_resident( 0 )
+    , m_peakResident( 0 )
+    , m_sensor( Eigen::Vector3f::Zero() )
+    , m_pExport( NULL )
+    , m_pointsInserted( 0 )
+    , m_blocksEvicted( 0 )
+    , m_bytesExported( 0 )
+{
+    // Largest pool whose blocks, free list and a table of at least twice as many slots fit the budget.
+    size_t blocks = m_config.memoryBudget / (sizeof( Block ) + sizeof( int32_t ));
+    size_t tableSize = 1;
+    while (true)
+    {
+        tableSize = 1;
+        while (tableSize < 2 * blocks)
+        {
+            tableSize *= 2;
+        }
+        if (blocks <= 2 || blocks * (sizeof( Block ) + sizeof( int32_t )) + tableSize * sizeof( Slot ) <= m_config.memoryBudget)
+        {
+            break;
+        }
+        --blocks;
+    }
+    if (blocks < 2)
+    {
+        blocks = 2;
+    }
+    m_blockCapacity = blocks;
+    m_pBlocks = (Block*) malloc( blocks * sizeof( Block ) );
+
+    Slot empty;
+    empty.key = 0;
+    empty.block = -1;
+    m_table.assign( tableSize, empty );
+    m_free.reserve( blocks );
+    for (size_t i = blocks; i > 0; --i)
+    {
+        m_free.push_back( (int32_t) (i - 1) );
+    }
+}
+
+CVoxelMap::~CVoxelMap()
+{
+    CloseExport();
+    free( m_pBlocks );
+}
+
+bool CVoxelMap::OpenExport( const std::string& path )
+{
+    CloseExport();
+    m_pExport = fopen( path.c_str(), "wb" );
+    if (m_pExport == NULL)
+    {
+        return false;
+    }
+    // Whole blocks per write(); the default stdio buffer is a few KB.
+    setvbuf( m_pExport, NULL, _IOFBF, 1 << 16 );
+    return true;
+}
+
+void CVoxelMap::CloseExport()
+{
+    if (m_pExport != NULL)
+    {
+        fclose( m_pExport );
+        m_pExport = NULL;
+    }
+}
+
+void CVoxelMap::Export()
+{
+    for (int32_t block = m_newest; block >= 0; block = m_pBlocks[block].older)
+    {
+        WriteBlock( m_pBlocks[block] );
+    }
+    if (m_pExport != NULL)
+    {
+        fflush( m_pExport );
+    }
+}
+
+size_t CVoxelMap::MemoryBytes() const
+{
+    return m_blockCapacity * sizeof( Block ) + m_table.size() * sizeof( Slot ) + m_free.capacity() * sizeof( int32_t );
+}
+
+size_t CVoxelMap::ResidentBytes() const
+{
+    return m_blocksTouched * sizeof( Block ) + m_table.size() * sizeof( Slot ) + m_free.capacity() * sizeof( int32_t );
+}
+
+void CVoxelMap::Insert( const float* xyz, size_t count, const Eigen::Affine3f& sensorToWorld )
+{
+    m_sensor = sensorToWorld.translation();
+    const Eigen::Matrix3f rotation = sensorToWorld.linear();
+    const Eigen::Vector3f translation = sensorToWorld.translation();
+    const float inverse = 1.0f / m_config.voxelSize;
+
+    uint64_t lastKey = 0;
+    int32_t block = -1;
+    size_t inserted = 0;
+    for (size_t i = 0; i < count; ++i)
+    {
+        const Eigen::Vector3f p = rotation * Eigen::Vector3f( xyz[3 * i], xyz[3 * i + 1], xyz[3 * i + 2] ) + translation;
+        if (!std::isfinite( p.x() ) || !std::isfinite( p.y() ) || !std::isfinite( p.z() ))
+        {
+            continue;
+        }
+        int32_t voxel[3];
+        int32_t coord[3];
+        int local[3];
+        for (int a = 0; a < 3; ++a)
+        {
+            voxel[a] = FloorToInt( p[a] * inverse );
+            coord[a] = voxel[a] >> 3;           // c_blockSide = 8, rounds towards -inf.
+            local[a] = voxel[a] & (c_blockSide - 1);
+        }
+        const uint64_t key = BlockKey( coord );
+        // Consecutive points of a depth image mostly land in the same block.
+        if (block < 0 || key != lastKey)
+        {
+            block = FindBlock( key );
+            if (block < 0)
+            {
+                block = AcquireBlock( key, coord );
+            }
+            Touch( block );
+            lastKey = key;
+        }
+
+        Block& b = m_pBlocks[block];
+        Voxel& v = b.voxels[(local[2] * c_blockSide + local[1]) * c_blockSide + local[0]];
+        if (v.count == 0)
+        {
+            ++b.occupied;
+        }
+        const float n = (float) ++v.count;
+        float distance2 = 0.0f;
+        for (int a = 0; a < 3; ++a)
+        {
+            const float delta = p[a] - v.mean[a];
+            v.mean[a] += delta / n;
+            distance2 += delta * (p[a] - v.mean[a]);
+        }
+        v.m2 += distance2;
+        ++inserted;
+    }
+    m_pointsInserted += inserted;
+}
+
+const CVoxelMap::Voxel* CVoxelMap::Find( const Eigen::Vector3f& position ) const
+{
+    const float inverse = 1.0f / m_config.voxelSize;
+    int32_t coord[3];
+    int local[3];
+    for (int a = 0; a < 3; ++a)
+    {
+        const int32_t voxel = FloorToInt( position[a] * inverse );
+        coord[a] = voxel >> 3;
+        local[a] = voxel & (c_blockSide - 1);
+    }
+    const int32_t block = FindBlock( BlockKey( coord ) );
+    if (block < 0)
+    {
+        return NULL;
+    }
+    const Voxel& v = m_pBlocks[block].voxels[(local[2] * c_blockSide + local[1]) * c_blockSide + local[0]];
+    return v.count > 0 ? &v : NULL;
+}
+
+int32_t CVoxelMap::FindBlock( uint64_t key ) const
+{
+    const size_t mask = m_table.size() - 1;
+    for (size_t slot = HashSlot( key, mask ); m_table[slot].block >= 0; slot = (slot + 1) & mask)
+    {
+        if (m_table[slot].key == key)
+        {
+            return m_table[slot].block;
+        }
+    }
+    return -1;
+}
+
+int32_t CVoxelMap::AcquireBlock( uint64_t key, const int32_t coord[3] )
+{
+    if (m_free.empty())
+    {
+        Evict( ChooseVictim() );
+    }
+    const int32_t block = m_free.back();
+    m_free.pop_back();
+    if ((size_t) block >= m_blocksTouched)
+    {
+        m_blocksTouched = block + 1;
+    }
+
+    Block& b = m_pBlocks[block];
+    memcpy( b.coord, coord, sizeof( b.coord ) );
+    b.occupied = 0;
+    memset( b.voxels, 0, sizeof( b.voxels ) );
+    b.newer = -1;
+    b.older = -1;
+
+    const size_t mask = m_table.size() - 1;
+    size_t slot = HashSlot( key, mask );
+    while (m_table[slot].block >= 0)
+    {
+        slot = (slot + 1) & mask;
+    }
+    m_table[slot].key = key;
+    m_table[slot].block = block;
+
+    if (++m_resident > m_peakResident)
+    {
+        m_peakResident = m_resident;
+    }
+    return block;
+}
+
+int32_t CVoxelMap::ChooseVictim() const
+{
+    const float keepRadius2 = m_config.keepRadius * m_config.keepRadius;
+    const float blockSize = m_config.voxelSize * c_blockSide;
+    int32_t block = m_oldest;
+    for (int i = 0; i < c_victimScan && block >= 0; ++i)
+    {
+        const Block& b = m_pBlocks[block];
+        const Eigen::Vector3f center( (b.coord[0] + 0.5f) * blockSize, (b.coord[1] + 0.5f) * blockSize,
+                                      (b.coord[2] + 0.5f) * blockSize );
+        if ((center - m_sensor).squaredNorm() > keepRadius2)
+        {
+            return block;
+        }
+        block = b.newer;
+    }
+    return m_oldest;
+}
+
+void CVoxelMap::Evict( int32_t block )
+{
+    const Block& b = m_pBlocks[block];
+    WriteBlock( b );
+    RemoveFromTable( BlockKey( b.coord ) );
+    Unlink( block );
+    m_free.push_back( block );
+    --m_resident;
+    ++m_blocksEvicted;
+}
+
+void CVoxelMap::RemoveFromTable( uint64_t key )
+{
+    const size_t mask = m_table.size() - 1;
+    size_t slot = HashSlot( key, mask );
+    while (m_table[slot].block >= 0 && m_table[slot].key != key)
+    {
+        slot = (slot + 1) & mask;
+    }
+    if (m_table[slot].block < 0)
+    {
+        return;
+    }
+    // Backward-shift deletion: move later entries of the probe chain into the hole so
+    // lookups never need tombstones.
+    size_t hole = slot;
+    size_t next = (hole + 1) & mask;
+    while (m_table[next].block >= 0)
+    {
+        const size_t home = HashSlot( m_table[next].key, mask );
+        // The entry may fill the hole if its home is not cyclically inside (hole, next].
+        const bool movable = hole <= next ? (home <= hole || home > next) : (home <= hole && home > next);
+        if (movable)
+        {
+            m_table[hole] = m_table[next];
+            hole = next;
+        }
+        next = (next + 1) & mask;
+    }
+    m_table[hole].block = -1;
+}
+
+void CVoxelMap::Unlink( int32_t block )
+{
+    Block& b = m_pBlocks[block];
+    if (b.newer >= 0)
+    {
+        m_pBlocks[b.newer].older = b.older;
+    }
+    else
+    {
+        m_newest = b.older;
+    }
+    if (b.older >= 0)
+    {
+        m_pBlocks[b.older].newer = b.newer;
+    }
+    else
+    {
+        m_oldest = b.newer;
+    }
+    b.newer = b.older = -1;
+}
+
+void CVoxelMap::Touch( int32_t block )
+{
+    if (block == m_newest)
+    {
+        return;
+    }
+    Block& b = m_pBlocks[block];
+    if (b.newer >= 0 || b.older >= 0 || m_oldest == block)
+    {
+        Unlink( block );
+    }
+    b.older = m_newest;
+    b.newer = -1;
+    if (m_newest >= 0)
+    {
+        m_pBlocks[m_newest].newer = block;
+    }
+    m_newest = block;
+    if (m_oldest < 0)
+    {
+        m_oldest = block;
+    }
+}
+
+void CVoxelMap::WriteBlock( const Block& block )
+{
+    if (m_pExport == NULL || block.occupied == 0)
+    {
+        return;
+    }
+    uint32_t n = 0;
+    for (int i = 0; i < c_blockVoxels; ++i)
+    {
+        const Voxel& v = block.voxels[i];
+        if (v.count == 0)
+        {
+            continue;
+        }
+        ExportVoxel& out = m_exportBuffer[n++];
+        out.index = (uint16_t) i;
+        out.pad = 0;
+        out.count = v.count;
+        memcpy( out.mean, v.mean, sizeof( out.mean ) );
+        out.m2 = v.m2;
+    }
+    fwrite( block.coord, sizeof( block.coord ), 1, m_pExport );
+    fwrite( &n, sizeof( n ), 1, m_pExport );
+    fwrite( m_exportBuffer, sizeof( ExportVoxel ), n, m_pExport );
+    m_bytesExported += sizeof( block.coord ) + sizeof( n ) + n * sizeof( ExportVoxel );
+}
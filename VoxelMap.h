@@ -0,0 +1,137 @@
+// VoxelMap.h
+/*
+    Point accumulator over many frames with a hard memory cap.
+
+    Space is divided into blocks of c_blockSide^3 voxels. Blocks come from a pool that is
+    allocated once from the memory budget; a hash table maps block coordinates to pool
+    slots. Each voxel keeps running statistics of the points that fell into it (count,
+    mean position and summed squared distance from the mean, updated with Welford's method).
+
+    When the pool is exhausted, the least recently used block that is farther than
+    keepRadius from the last sensor position is evicted; if every block is near, the least
+    recently used one goes. Evicted blocks are appended to the export file, if one is open,
+    so the map can be rebuilt offline. Export() writes the resident blocks the same way.
+
+    Export file: a sequence of records
+        int32 blockX, blockY, blockZ; uint32 voxelCount;
+        voxelCount x { uint16 voxelIndex; uint16 pad; uint32 count; float mean[3]; float m2; }
+    with voxelIndex = (z * c_blockSide + y) * c_blockSide + x inside the block.
+
+    Not thread safe.
+*/
+#ifndef VOXELMAP_H
+#define VOXELMAP_H
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <stdio.h>
+#include <Eigen/Core>
+#include <Eigen/Geometry>
+
+class CVoxelMap
+{
+public:
+    static const int c_blockSide = 8;
+    static const int c_blockVoxels = c_blockSide * c_blockSide * c_blockSide;
+
+    struct Voxel
+    {
+        uint32_t count;
+        float mean[3];
+        float m2;                   // Sum of squared distances from the mean.
+    };
+
+    struct Config
+    {
+        Config();
+
+        float voxelSize;            // m
+        size_t memoryBudget;        // bytes for blocks, free list and hash table together
+        float keepRadius;           // m, blocks within this distance of the sensor are evicted last.
+    };
+
+    explicit CVoxelMap( const Config& config = Config() );
+    ~CVoxelMap();
+
+    // Evicted blocks are appended to path from now on. Returns false if it cannot be opened.
+    bool OpenExport( const std::string& path );
+    void CloseExport();
+    // Writes all resident blocks to the export file; they stay resident.
+    void Export();
+
+    // count interleaved x, y, z points in the sensor frame; sensorToWorld places them in the map.
+    void Insert( const float* xyz, size_t count, const Eigen::Affine3f& sensorToWorld );
+
+    // NULL if the voxel has never been hit or its block was evicted.
+    const Voxel* Find( const Eigen::Vector3f& position ) const;
+
+    size_t BlockCapacity() const { return m_blockCapacity; }
+    size_t ResidentBlocks() const { return m_resident; }
+    size_t PeakResidentBlocks() const { return m_peakResident; }
+    // Bytes reserved for blocks, free list and table, never more than the budget.
+    size_t MemoryBytes() const;
+    // Bytes of the reservation touched so far. Pool pages are only committed by the OS once a
+    // block in them is first used, so this is what the map costs in RAM.
+    size_t ResidentBytes() const;
+    // Points accumulated; non-finite ones are skipped and not counted.
+    uint64_t PointsInserted() const { return m_pointsInserted; }
+    uint64_t BlocksEvicted() const { return m_blocksEvicted; }
+    uint64_t BytesExported() const { return m_bytesExported; }
+
+private:
+    struct Block
+    {
+        int32_t coord[3];
+        int32_t newer;              // LRU list, -1 at the ends.
+        int32_t older;
+        uint32_t occupied;          // Voxels with count > 0.
+        Voxel voxels[c_blockVoxels];
+    };
+
+    struct Slot
+    {
+        uint64_t key;
+        int32_t block;              // -1: empty.
+    };
+
+    struct ExportVoxel
+    {
+        uint16_t index;
+        uint16_t pad;
+        uint32_t count;
+        float mean[3];
+        float m2;
+    };
+
+    CVoxelMap( const CVoxelMap& );
+    CVoxelMap& operator=( const CVoxelMap& );
+
+    int32_t FindBlock( uint64_t key ) const;
+    int32_t AcquireBlock( uint64_t key, const int32_t coord[3] );
+    int32_t ChooseVictim() const;
+    void Evict( int32_t block );
+    void RemoveFromTable( uint64_t key );
+    void Touch( int32_t block );
+    void Unlink( int32_t block );
+    void WriteBlock( const Block& block );
+
+    Config m_config;
+    Block* m_pBlocks;               // malloc'ed, so untouched blocks cost no RAM.
+    size_t m_blockCapacity;
+    size_t m_blocksTouched;         // Pool slots used at least once.
+    std::vector<Slot> m_table;
+    std::vector<int32_t> m_free;
+    ExportVoxel m_exportBuffer[c_blockVoxels];
+    int32_t m_newest;
+    int32_t m_oldest;
+    size_t m_resident;
+    size_t m_peakResident;
+    Eigen::Vector3f m_sensor;
+    FILE* m_pExport;
+    uint64_t m_pointsInserted;
+    uint64_t m_blocksEvicted;
+    uint64_t m_bytesExported;
+};
+
+#endif // VOXELMAP_H
@@ -0,0 +1,134 @@
+// BenchArming.cpp
+// Exposure-end arming on emulated event timings: two hardware-triggered cameras report the
+// end of exposure, the 1280x960 images arrive c_transferUs later and are converted into the
+// frame's buffer and pushed. Samples are exposure end to the start of processing, with
+// and without arming, which spins for the default armSpinUs. The CPU time of the worker
+// thread is reported too, since the armed worker polls instead of sleeping.
+#include "BenchHarness.h"
+
+#include <atomic>
+#include <string.h>
+#include <thread>
+#include <time.h>
+#include "../FrameArming.h"
+#include "../Pipeline.h"
+
+static const int c_cameras = 2;
+static const int c_transferUs = 2000;       // USB3, 1280x960 Bayer.
+
+static uint64_t ThreadCpuNs()
+{
+    struct timespec time;
+    clock_gettime( CLOCK_THREAD_CPUTIME_ID, &time );
+    return (uint64_t) time.tv_sec * 1000000000ull + (uint64_t) time.tv_nsec;
+}
+
+// Stands in for the first stage: records when processing of a frame starts, and the CPU
+// time of the worker thread it runs on (threadCount = 1) from the first frame on.
+class CStartSink : public IPipelineSink
+{
+public:
+    explicit CStartSink( CBenchState& state )
+        : m_state( state ), m_frames( 0 ), m_paired( 0 ), m_firstCpuNs( 0 ), m_firstNs( 0 ), m_lastCpuNs( 0 ), m_lastNs( 0 ) {}
+
+    virtual void Consume( const PipelineFrame& frame )
+    {
+        const uint64_t now = CFrameArming::HostNowNs();
+        m_state.AddSample( now - frame.exposureEndNs );
+        if (frame.stereoPair != 0)
+        {
+            ++m_paired;
+        }
+        m_lastCpuNs = ThreadCpuNs();
+        m_lastNs = now;
+        if (m_frames == 0)
+        {
+            m_firstCpuNs = m_lastCpuNs;
+            m_firstNs = now;
+        }
+        ++m_frames;
+    }
+
+    CBenchState& m_state;
+    std::atomic<uint64_t> m_frames;
+    std::atomic<uint64_t> m_paired;
+    uint64_t m_firstCpuNs;
+    uint64_t m_firstNs;
+    uint64_t m_lastCpuNs;
+    uint64_t m_lastNs;
+};
+
+static void RunTrigger( CBenchState& state, bool armed )
+{
+    const cv::Mat& source = BenchFrames()[0];
+    PipelineConfig config;
+    config.threadCount = 1;
+    CPipeline pipeline( config );       // No stages: the sink runs where the first stage would.
+    CStartSink sink( state );
+    pipeline.AddSink( &sink );
+    pipeline.Start();
+    CFrameArming arming;
+
+    const uint64_t spinNs = (uint64_t) config.armSpinUs * 1000;
+    uint64_t frameId = 0;
+    uint64_t expected = 0;
+    while (state.KeepRunning())
+    {
+        ++frameId;
+        uint64_t exposureEnd[c_cameras];
+        for (int c = 0; c < c_cameras; ++c)
+        {
+            exposureEnd[c] = CFrameArming::HostNowNs();
+            if (armed)
+            {
+                arming.OnExposureEnd( c, frameId, exposureEnd[c] );
+                pipeline.Arm( spinNs );
+            }
+        }
+        std::this_thread::sleep_for( std::chrono::microseconds( c_transferUs ) );
+
+        for (int c = 0; c < c_cameras; ++c)
+        {
+            // What OnImageGrabbed does, with a copy standing in for the pixel format converter.
+            PipelineFrame frame;
+            frame.cameraIndex = c;
+            frame.frameId = frameId;
+            frame.exposureEndNs = exposureEnd[c];
+            if (armed)
+            {
+                arming.Claim( c, frameId, source.rows, source.cols, source.type(), frame );
+            }
+            frame.image.create( source.rows, source.cols, source.type() );
+            memcpy( frame.image.data, source.data, source.total() * source.elemSize() );
+            pipeline.Push( std::move( frame ) );
+        }
+        expected += c_cameras;
+        while (sink.m_frames < expected)
+        {
+            std::this_thread::sleep_for( std::chrono::microseconds( 100 ) );
+        }
+    }
+    pipeline.Stop();
+    state.SetItemsProcessed( sink.m_frames );
+    state.SetCounter( "transfer_us", c_transferUs );
+    state.SetCounter( "spin_us", armed ? config.armSpinUs : 0 );
+    const uint64_t frames = sink.m_frames;
+    if (frames > 1)
+    {
+        const double cpuNs = (double) (sink.m_lastCpuNs - sink.m_firstCpuNs);
+        state.SetCounter( "worker_cpu_us_per_frame", cpuNs / (frames - 1) / 1000.0 );
+        state.SetCounter( "worker_cpu_percent", 100.0 * cpuNs / (double) (sink.m_lastNs - sink.m_firstNs) );
+    }
+    state.SetCounter( "stereo_paired_frames", (double) sink.m_paired );
+    state.SetCounter( "pool_misses", (double) arming.PoolMisses() );
+}
+
+BENCH_CASE( arming_off )
+{
+    RunTrigger( state, false );
+}
+
+BENCH_CASE( arming_exposure_end )
+{
+    RunTrigger( state, true );
+}
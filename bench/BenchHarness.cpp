@@ -0,0 +1,435 @@
+// BenchHarness.cpp
+/*
+    bench [--filter <substring>] [--min-time <seconds>] [--replay <dir>] [--out <file.json>]
+
+    Output:
+    {
+      "revision": "<git revision>", "arch": "x86_64|aarch64", "compiler": "...",
+      "results": [
+        { "name": "...", "iterations": N, "ns_per_iter": ..., "p50_ns": ..., "p90_ns": ...,
+          "p99_ns": ..., "max_ns": ..., "items_per_second": ..., "bytes_per_second": ...,
+          "counters": { ... }, "error": "..." }
+      ]
+    }
+*/
+#include "BenchHarness.h"
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <random>
+#include <sstream>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <opencv2/imgcodecs.hpp>
+
+// Generated on every build by bench/BenchRevision.cmake.
+#ifdef BENCH_REVISION_HEADER
+#include "BenchRevision.h"
+#endif
+#ifndef BENCH_REVISION
+#define BENCH_REVISION "unknown"
+#endif
+
+using namespace std;
+
+struct BenchEntry
+{
+    const char* name;
+    BenchFunction function;
+};
+
+static vector<BenchEntry>& Registry()
+{
+    static vector<BenchEntry> registry;
+    return registry;
+}
+
+CBenchRegistrar::CBenchRegistrar( const char* name, BenchFunction function )
+{
+    BenchEntry entry;
+    entry.name = name;
+    entry.function = function;
+    Registry().push_back( entry );
+}
+
+CBenchState::CBenchState( double minSeconds, uint64_t maxIterations )
+    : m_minSeconds( minSeconds )
+    , m_maxIterations( maxIterations )
+    , m_started( false )
+    , m_done( false )
+    , m_paused( false )
+    , m_iterations( 0 )
+    , m_totalNs( 0 )
+    , m_pausedNs( 0 )
+    , m_items( 0 )
+    , m_bytes( 0 )
+{
+}
+
+bool CBenchState::KeepRunning()
+{
+    const Clock::time_point now = Clock::now();
+    if (!m_started)
+    {
+        m_started = true;
+        m_begin = now;
+    }
+    else
+    {
+        uint64_t ns = (uint64_t) std::chrono::duration_cast<std::chrono::nanoseconds>( now - m_iterationStart ).count() - m_pausedNs;
+        m_samples.push_back( ns );
+        m_totalNs += ns;
+        ++m_iterations;
+    }
+    m_pausedNs = 0;
+
+    const double elapsed = std::chrono::duration<double>( now - m_begin ).count();
+    if (m_done || m_iterations >= m_maxIterations || (m_iterations > 0 && elapsed >= m_minSeconds))
+    {
+        m_done = true;
+        return false;
+    }
+    m_iterationStart = Clock::now();
+    return true;
+}
+
+void CBenchState::PauseTiming()
+{
+    m_paused = true;
+    m_pauseStart = Clock::now();
+}
+
+void CBenchState::ResumeTiming()
+{
+    if (m_paused)
+    {
+        m_pausedNs += (uint64_t) std::chrono::duration_cast<std::chrono::nanoseconds>( Clock::now() - m_pauseStart ).count();
+        m_paused = false;
+    }
+}
+
+vector<uint64_t> CBenchState::Samples() const
+{
+    return m_external.empty() ? m_samples : m_external;
+}
+
+static string g_replayDir;
+
+const vector<cv::Mat>& BenchFrames()
+{
+    static vector<cv::Mat> frames;
+    if (!frames.empty())
+    {
+        return frames;
+    }
+    if (!g_replayDir.empty())
+    {
+        vector<cv::String> files;
+        cv::glob( g_replayDir + "/*", files, false );
+        sort( files.begin(), files.end() );
+        for (size_t i = 0; i < files.size(); ++i)
+        {
+            cv::Mat image = cv::imread( files[i], cv::IMREAD_COLOR );
+            if (!image.empty())
+            {
+                frames.push_back( image );
+            }
+        }
+        if (frames.empty())
+        {
+            cerr << "No readable images in " << g_replayDir << ", using synthetic frames." << endl;
+        }
+    }
+    if (frames.empty())
+    {
+        // Diagonal stripes with a texture so feature detection and stereo have something to match.
+        const int c_width = 1280;
+        const int c_height = 960;
+        for (int f = 0; f < 8; ++f)
+        {
+            cv::Mat image( c_height, c_width, CV_8UC3 );
+            for (int y = 0; y < c_height; ++y)
+            {
+                uint8_t* p = image.ptr<uint8_t>( y );
+                for (int x = 0; x < c_width; ++x)
+                {
+                    uint32_t h = (uint32_t) (x * 73856093u) ^ (uint32_t) (y * 19349663u);
+                    uint8_t texture = (uint8_t) ((h >> 13) & 0x3f);
+                    uint8_t stripe = (uint8_t) ((((x + y + f * 8) >> 4) & 1) ? 160 : 40);
+                    p[3 * x + 0] = (uint8_t) (stripe + texture);
+                    p[3 * x + 1] = (uint8_t) (stripe / 2 + texture);
+                    p[3 * x + 2] = (uint8_t) (255 - stripe - texture);
+                }
+            }
+            frames.push_back( image );
+        }
+    }
+    return frames;
+}
+
+const vector<cv::Mat>& BenchDepthFrames()
+{
+    static vector<cv::Mat> frames;
+    if (!frames.empty())
+    {
+        return frames;
+    }
+    if (!g_replayDir.empty())
+    {
+        vector<cv::String> files;
+        cv::glob( g_replayDir + "/*", files, false );
+        sort( files.begin(), files.end() );
+        for (size_t i = 0; i < files.size(); ++i)
+        {
+            cv::Mat depth = cv::imread( files[i], cv::IMREAD_ANYDEPTH );
+            if (depth.type() == CV_16UC1)
+            {
+                frames.push_back( depth );
+            }
+        }
+    }
+    if (!frames.empty())
+    {
+        return frames;
+    }
+
+    // Ray cast per pixel against the floor plane and three spheres resting on it.
+    const int c_width = 640;
+    const int c_height = 480;
+    const float f = 525.0f, cx = 319.5f, cy = 239.5f, cameraHeight = 0.6f;
+    mt19937 random( 1 );
+    normal_distribution<float> noise( 0.0f, 1.0f );
+    for (int frame = 0; frame < 60; ++frame)
+    {
+        // Camera frame: x right, y down, z forward; the camera pitches down by 18..22 degrees.
+        const float pitch = (20.0f + 2.0f * sin( frame * 0.2f )) * 3.14159265f / 180.0f;
+        const float up[3] = { 0.0f, -cos( pitch ), -sin( pitch ) };
+        const float forward[3] = { 0.0f, -sin( pitch ), cos( pitch ) };     // Level, orthogonal to up.
+        const float radius[3] = { 0.25f, 0.15f, 0.3f };
+        float center[3][3];
+        for (int k = 0; k < 3; ++k)
+        {
+            const float distance = 1.5f + 0.8f * k;
+            const float side = 0.8f * (k - 1) + 0.02f * frame;
+            for (int a = 0; a < 3; ++a)
+            {
+                center[k][a] = (radius[k] - cameraHeight) * up[a] + distance * forward[a] + (a == 0 ? side : 0.0f);
+            }
+        }
+
+        cv::Mat depth( c_height, c_width, CV_16UC1 );
+        for (int v = 0; v < c_height; ++v)
+        {
+            uint16_t* p = depth.ptr<uint16_t>( v );
+            for (int u = 0; u < c_width; ++u)
+            {
+                const float ray[3] = { (u - cx) / f, (v - cy) / f, 1.0f };
+                const float rayUp = ray[0] * up[0] + ray[1] * up[1] + ray[2] * up[2];
+                float t = rayUp < 0.0f ? -cameraHeight / rayUp : 1e9f;
+                const float rayLength2 = ray[0] * ray[0] + ray[1] * ray[1] + ray[2] * ray[2];
+                for (int k = 0; k < 3; ++k)
+                {
+                    const float b = ray[0] * center[k][0] + ray[1] * center[k][1] + ray[2] * center[k][2];
+                    const float c = center[k][0] * center[k][0] + center[k][1] * center[k][1]
+                                  + center[k][2] * center[k][2] - radius[k] * radius[k];
+                    const float discriminant = b * b - rayLength2 * c;
+                    if (discriminant > 0.0f)
+                    {
+                        const float hit = (b - sqrt( discriminant )) / rayLength2;
+                        t = hit > 0.0f && hit < t ? hit : t;
+                    }
+                }
+                // ray.z is 1, so t is the depth; noise grows with distance like a stereo camera's.
+                const float z = t < 10.0f ? t * (1.0f + 0.003f * noise( random )) : 0.0f;
+                p[u] = (uint16_t) (z * 1000.0f);
+            }
+        }
+        frames.push_back( depth );
+    }
+    return frames;
+}
+
+static uint64_t Percentile( const vector<uint64_t>& sorted, double p )
+{
+    if (sorted.empty())
+    {
+        return 0;
+    }
+    size_t index = (size_t) (p * (double) (sorted.size() - 1) + 0.5);
+    return sorted[min( index, sorted.size() - 1 )];
+}
+
+static string JsonEscape( const string& text )
+{
+    string out;
+    for (size_t i = 0; i < text.size(); ++i)
+    {
+        const unsigned char c = (unsigned char) text[i];
+        if (c == '"' || c == '\\')
+        {
+            out += '\\';
+            out += (char) c;
+        }
+        else if (c == '\n')
+        {
+            out += "\\n";
+        }
+        else if (c == '\t')
+        {
+            out += "\\t";
+        }
+        else if (c < 0x20)
+        {
+            // Other control characters are not allowed in JSON strings either.
+            char escaped[8];
+            snprintf( escaped, sizeof( escaped ), "\\u%04x", c );
+            out += escaped;
+        }
+        else
+        {
+            out += (char) c;
+        }
+    }
+    return out;
+}
+
+// Round-trips the double; JSON has no NaN or infinity, so those become null.
+static string JsonNumber( double value )
+{
+    if (!std::isfinite( value ))
+    {
+        return "null";
+    }
+    ostringstream text;
+    text << setprecision( numeric_limits<double>::max_digits10 ) << value;
+    return text.str();
+}
+
+static const char* Arch()
+{
+#if defined(__aarch64__)
+    return "aarch64";
+#elif defined(__x86_64__)
+    return "x86_64";
+#elif defined(__arm__)
+    return "arm";
+#else
+    return "unknown";
+#endif
+}
+
+int main( int argc, char* argv[] )
+{
+    string filter;
+    string outPath;
+    double minSeconds = 0.5;
+    for (int i = 1; i < argc; ++i)
+    {
+        string arg = argv[i];
+        if (arg == "--filter" && i + 1 < argc)
+        {
+            filter = argv[++i];
+        }
+        else if (arg == "--min-time" && i + 1 < argc)
+        {
+            minSeconds = atof( argv[++i] );
+        }
+        else if (arg == "--replay" && i + 1 < argc)
+        {
+            g_replayDir = argv[++i];
+        }
+        else if (arg == "--out" && i + 1 < argc)
+        {
+            outPath = argv[++i];
+        }
+        else
+        {
+            cerr << "Usage: " << argv[0] << " [--filter <substring>] [--min-time <seconds>] [--replay <dir>] [--out <file.json>]" << endl;
+            return 1;
+        }
+    }
+
+    ostringstream json;
+    json << "{\n  \"revision\": \"" << BENCH_REVISION << "\",\n  \"arch\": \"" << Arch()
+         << "\",\n  \"compiler\": \"" << JsonEscape( __VERSION__ ) << "\",\n  \"replay\": \""
+         << JsonEscape( g_replayDir ) << "\",\n  \"results\": [";
+
+    bool first = true;
+    size_t failed = 0;
+    vector<BenchEntry>& registry = Registry();
+    for (size_t i = 0; i < registry.size(); ++i)
+    {
+        if (!filter.empty() && strstr( registry[i].name, filter.c_str() ) == NULL)
+        {
+            continue;
+        }
+        CBenchState state( minSeconds, 10000000 );
+        registry[i].function( state );
+
+        vector<uint64_t> samples = state.Samples();
+        sort( samples.begin(), samples.end() );
+        const double seconds = state.TotalNs() / 1e9;
+        const double nsPerIter = state.Iterations() > 0 ? state.TotalNs() / (double) state.Iterations() : 0.0;
+
+        cerr << registry[i].name << ": " << state.Iterations() << " iterations, " << nsPerIter << " ns/iter";
+        if (!state.Error().empty())
+        {
+            cerr << " (" << state.Error() << ")";
+            ++failed;
+        }
+        cerr << endl;
+
+        json << (first ? "\n" : ",\n") << "    { \"name\": \"" << registry[i].name << "\""
+             << ", \"iterations\": " << state.Iterations()
+             << ", \"ns_per_iter\": " << JsonNumber( nsPerIter )
+             << ", \"p50_ns\": " << Percentile( samples, 0.50 )
+             << ", \"p90_ns\": " << Percentile( samples, 0.90 )
+             << ", \"p99_ns\": " << Percentile( samples, 0.99 )
+             << ", \"max_ns\": " << (samples.empty() ? 0 : samples.back())
+             << ", \"items_per_second\": " << JsonNumber( seconds > 0 ? (double) state.Items() / seconds : 0.0 )
+             << ", \"bytes_per_second\": " << JsonNumber( seconds > 0 ? (double) state.Bytes() / seconds : 0.0 )
+             << ", \"counters\": {";
+        bool firstCounter = true;
+        for (map<string, double>::const_iterator it = state.Counters().begin(); it != state.Counters().end(); ++it)
+        {
+            json << (firstCounter ? " " : ", ") << "\"" << it->first << "\": " << JsonNumber( it->second );
+            firstCounter = false;
+        }
+        json << (firstCounter ? "}" : " }");
+        if (!state.Error().empty())
+        {
+            json << ", \"error\": \"" << JsonEscape( state.Error() ) << "\"";
+        }
+        json << " }";
+        first = false;
+    }
+    json << "\n  ]\n}\n";
+
+    if (outPath.empty())
+    {
+        cout << json.str();
+    }
+    else
+    {
+        ofstream out( outPath.c_str() );
+        out << json.str();
+        out.close();
+        if (!out)
+        {
+            cerr << "Could not write " << outPath << endl;
+            return 1;
+        }
+    }
+    // A case that set an error fails the run, so scripts and CI notice.
+    if (failed > 0)
+    {
+        cerr << failed << " case(s) failed." << endl;
+        return 1;
+    }
+    return 0;
+}
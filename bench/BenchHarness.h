@@ -0,0 +1,101 @@
+// BenchHarness.h
+/*
+    Minimal benchmark harness for the bench target.
+
+    A case is registered with BENCH_CASE(name) and times its body with
+        while (state.KeepRunning()) { ... }
+    Each iteration is timed individually, so results carry percentiles as well as the mean.
+    Cases measuring operations that take only a few ns should run an inner loop per
+    iteration and report it with SetItemsProcessed().
+
+    Results are written as one JSON document (see BenchHarness.cpp) so runs can be
+    compared across commits and between x86 and the Jetson.
+*/
+#ifndef BENCHHARNESS_H
+#define BENCHHARNESS_H
+
+#include <chrono>
+#include <map>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <opencv2/core.hpp>
+
+class CBenchState
+{
+public:
+    explicit CBenchState( double minSeconds, uint64_t maxIterations );
+
+    // Returns true while the case should run another iteration.
+    bool KeepRunning();
+
+    // Excludes setup work inside an iteration from the timing.
+    void PauseTiming();
+    void ResumeTiming();
+
+    void SetItemsProcessed( uint64_t items ) { m_items = items; }
+    void SetBytesProcessed( uint64_t bytes ) { m_bytes = bytes; }
+    void SetCounter( const std::string& name, double value ) { m_counters[name] = value; }
+    // Records an externally measured latency sample instead of the iteration time.
+    void AddSample( uint64_t ns ) { m_external.push_back( ns ); }
+    void SkipWithError( const std::string& message ) { m_error = message; m_done = true; }
+
+    uint64_t Iterations() const { return m_iterations; }
+    double TotalNs() const { return (double) m_totalNs; }
+    uint64_t Items() const { return m_items; }
+    uint64_t Bytes() const { return m_bytes; }
+    const std::map<std::string, double>& Counters() const { return m_counters; }
+    const std::string& Error() const { return m_error; }
+    // Per-iteration (or AddSample) latencies in ns.
+    std::vector<uint64_t> Samples() const;
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    const double m_minSeconds;
+    const uint64_t m_maxIterations;
+    bool m_started;
+    bool m_done;
+    bool m_paused;
+    uint64_t m_iterations;
+    uint64_t m_totalNs;
+    uint64_t m_pausedNs;
+    Clock::time_point m_begin;
+    Clock::time_point m_iterationStart;
+    Clock::time_point m_pauseStart;
+    std::vector<uint64_t> m_samples;
+    std::vector<uint64_t> m_external;
+    uint64_t m_items;
+    uint64_t m_bytes;
+    std::map<std::string, double> m_counters;
+    std::string m_error;
+};
+
+typedef void (*BenchFunction)( CBenchState& state );
+
+struct CBenchRegistrar
+{
+    CBenchRegistrar( const char* name, BenchFunction function );
+};
+
+#define BENCH_CASE( name ) \
+    static void name( CBenchState& state ); \
+    static CBenchRegistrar name##_registrar( #name, name ); \
+    static void name( CBenchState& state )
+
+// Frames shared by all cases: replayed from --replay <dir> or generated.
+// Synthetic frames are 1280x960 BGR with a moving pattern so consecutive frames differ.
+const std::vector<cv::Mat>& BenchFrames();
+
+// Depth maps shared by the depth cases: the 16-bit images (mm) in --replay <dir>, or a
+// generated 640x480 sequence of a slowly pitching camera 0.6 m above a floor with three obstacles.
+const std::vector<cv::Mat>& BenchDepthFrames();
+
+// Prevents the compiler from discarding a computed value.
+template <class T>
+inline void BenchDoNotOptimize( const T& value )
+{
+    asm volatile( "" : : "r,m"( value ) : "memory" );
+}
+
+#endif // BENCHHARNESS_H
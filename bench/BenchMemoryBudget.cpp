@@ -0,0 +1,163 @@
+// BenchMemoryBudget.cpp
+// Replays the bench frames as two armed cameras into a pipeline whose sink is slower than
+// the cameras, so that the queue and the arming pools fill up, without a limit and under
+// memory budgets well below what that takes. The capped cases fail if the budget's peak went over
+// the cap, or if the heap, sampled with mallinfo2() on every frame, grew by more than the
+// cap plus c_transientFrames frames that are not accounted while they exist: the frame
+// being converted before Push() admits it and its downscaled copy.
+#include "BenchHarness.h"
+
+#include <algorithm>
+#include <atomic>
+#include <malloc.h>
+#include <string.h>
+#include <thread>
+#include "../FrameArming.h"
+#include "../MemoryBudget.h"
+#include "../Pipeline.h"
+
+static const int c_cameras = 2;
+static const int c_frameUs = 1000;          // Between the frames of one camera.
+static const int c_sinkUs = 3000;           // Slower than the cameras.
+static const size_t c_queueSize = 32;
+static const size_t c_transientFrames = 2;
+static const size_t c_mb = 1024 * 1024;
+
+// In use from the heap plus mmap()ed chunks (large frames).
+static size_t HeapBytes()
+{
+#if __GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33)
+    const struct mallinfo2 info = mallinfo2();
+    return info.uordblks + info.hblkhd;
+#else
+    // glibc 2.27 on the Jetson Nano image; the int fields are enough below 2 GB.
+    const struct mallinfo info = mallinfo();
+    return (size_t) (unsigned) info.uordblks + (size_t) (unsigned) info.hblkhd;
+#endif
+}
+
+// Stands in for the preview and obstacle consumers.
+class CSlowSink : public IPipelineSink
+{
+public:
+    CSlowSink() : m_frames( 0 ) {}
+
+    virtual void Consume( const PipelineFrame& frame )
+    {
+        BenchDoNotOptimize( frame.image.data );
+        std::this_thread::sleep_for( std::chrono::microseconds( c_sinkUs ) );
+        ++m_frames;
+    }
+
+    std::atomic<uint64_t> m_frames;
+};
+
+static void RaiseMax( std::atomic<size_t>& max, size_t value )
+{
+    size_t current = max.load();
+    while (value > current && !max.compare_exchange_weak( current, value ))
+    {
+    }
+}
+
+static void RunReplay( CBenchState& state, size_t capMB )
+{
+    const std::vector<cv::Mat>& frames = BenchFrames();
+    const size_t frameBytes = frames[0].total() * frames[0].elemSize();
+    const size_t baseline = HeapBytes();
+    std::atomic<size_t> heapPeak( baseline );
+
+    CMemoryBudget::Config budgetConfig;
+    budgetConfig.limitBytes = capMB * c_mb;
+    CMemoryBudget budget( budgetConfig );
+    size_t pressure = CMemoryBudget::Pressure_None;
+    {
+        PipelineConfig config;
+        config.queueSize = c_queueSize;
+        config.threadCount = 1;
+        StageConfig gain;
+        gain.type = "gain";
+        gain.gain = 1.2;
+        config.stages.push_back( gain );
+        CPipeline pipeline( config );
+        pipeline.AttachBudget( budget );
+        CSlowSink sink;
+        pipeline.AddSink( &sink );
+        CFrameArming arming;
+        arming.AttachBudget( budget );
+        pipeline.Start();
+
+        uint64_t frameId = 0;
+        while (state.KeepRunning())
+        {
+            ++frameId;
+            for (int c = 0; c < c_cameras; ++c)
+            {
+                arming.OnExposureEnd( c, frameId, CFrameArming::HostNowNs() );
+            }
+            std::this_thread::sleep_for( std::chrono::microseconds( c_frameUs ) );
+            for (int c = 0; c < c_cameras; ++c)
+            {
+                // What OnImageGrabbed does, with a copy standing in for the pixel format converter.
+                const cv::Mat& source = frames[(frameId * c_cameras + c) % frames.size()];
+                PipelineFrame frame;
+                frame.cameraIndex = c;
+                frame.frameId = frameId;
+                arming.Claim( c, frameId, source.rows, source.cols, source.type(), frame );
+                frame.image.create( source.rows, source.cols, source.type() );
+                memcpy( frame.image.data, source.data, source.total() * source.elemSize() );
+                pipeline.Push( std::move( frame ) );
+                RaiseMax( heapPeak, HeapBytes() );
+                pressure = std::max( pressure, (size_t) budget.CurrentPressure() );
+            }
+        }
+        pipeline.Stop();
+        RaiseMax( heapPeak, HeapBytes() );
+
+        state.SetItemsProcessed( sink.m_frames );
+        state.SetCounter( "processed", (double) pipeline.Processed() );
+        state.SetCounter( "dropped", (double) pipeline.Dropped() );
+        state.SetCounter( "skipped", (double) pipeline.Skipped() );
+        state.SetCounter( "downscaled", (double) pipeline.Downscaled() );
+        state.SetCounter( "refused_frames", (double) pipeline.Refused() );
+        state.SetCounter( "pool_misses", (double) arming.PoolMisses() );
+    }
+
+    const double heapGrowthMB = (double) (heapPeak - baseline) / c_mb;
+    state.SetCounter( "cap_mb", (double) capMB );
+    state.SetCounter( "budget_peak_mb", (double) budget.Peak() / c_mb );
+    state.SetCounter( "heap_peak_mb", heapGrowthMB );
+    state.SetCounter( "pipeline_peak_mb", (double) budget.Account( "pipeline.frames" ).Peak() / c_mb );
+    state.SetCounter( "arming_peak_mb", (double) budget.Account( "arming.pool" ).Peak() / c_mb );
+    state.SetCounter( "refused", (double) (budget.Account( "pipeline.frames" ).Refused()
+                                           + budget.Account( "arming.pool" ).Refused()) );
+    state.SetCounter( "max_pressure", (double) pressure );
+    if (budget.Used() != 0)
+    {
+        state.SkipWithError( "Bytes still reserved after the pipeline stopped:\n" + budget.Report() );
+    }
+    else if (capMB != 0 && budget.Peak() > budget.Limit())
+    {
+        state.SkipWithError( "Memory budget exceeded:\n" + budget.Report() );
+    }
+    else if (capMB != 0 && heapPeak - baseline > budget.Limit() + c_transientFrames * frameBytes + c_mb)
+    {
+        state.SkipWithError( "Heap grew by " + std::to_string( heapGrowthMB ) + " MB under a cap of "
+                             + std::to_string( capMB ) + " MB" );
+    }
+}
+
+BENCH_CASE( memory_replay_unlimited )
+{
+    RunReplay( state, 0 );
+}
+
+BENCH_CASE( memory_replay_cap_24mb )
+{
+    RunReplay( state, 24 );
+}
+
+BENCH_CASE( memory_replay_cap_64mb )
+{
+    RunReplay( state, 64 );
+}
@@ -0,0 +1,154 @@
+// BenchMetrics.cpp
+// Cost of metric updates on the hot path, reported as ns_per_update over batches of
+// c_updates, alone and with c_contenders other threads updating the same metric (the
+// pipeline workers sharing a stage histogram). A plain shared atomic is the baseline for
+// the striped counter. metrics_render is one scrape of a registry the size of the robot's.
+#include "BenchHarness.h"
+
+#include <atomic>
+#include <thread>
+#include "../MetricsRegistry.h"
+
+static const int c_updates = 1000;
+static const int c_contenders = 3;
+
+// Runs update( i ) c_updates times per iteration while c_contenders threads do the same.
+template <class Update>
+static void RunUpdates( CBenchState& state, int contenders, Update update )
+{
+    std::atomic<bool> running( true );
+    std::vector<std::thread> threads;
+    for (int t = 0; t < contenders; ++t)
+    {
+        threads.push_back( std::thread( [&running, update]()
+        {
+            uint64_t i = 0;
+            while (running.load( std::memory_order_relaxed ))
+            {
+                update( i++ );
+            }
+        } ) );
+    }
+    uint64_t i = 0;
+    const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    while (state.KeepRunning())
+    {
+        for (int n = 0; n < c_updates; ++n)
+        {
+            update( i++ );
+        }
+    }
+    const double ns = std::chrono::duration<double, std::nano>( std::chrono::steady_clock::now() - start ).count();
+    running = false;
+    for (size_t t = 0; t < threads.size(); ++t)
+    {
+        threads[t].join();
+    }
+    state.SetItemsProcessed( state.Iterations() * c_updates );
+    state.SetCounter( "ns_per_update", ns / (double) (state.Iterations() * c_updates) );
+    state.SetCounter( "contending_threads", contenders );
+    state.SetCounter( "hardware_threads", std::thread::hardware_concurrency() );
+}
+
+static void CounterCase( CBenchState& state, int contenders )
+{
+    CMetricsRegistry registry;
+    CMetricCounter& counter = registry.Counter( "bench_total", "Bench." );
+    RunUpdates( state, contenders, [&counter]( uint64_t ) { counter.Add(); } );
+    BenchDoNotOptimize( counter.Value() );
+}
+
+BENCH_CASE( metrics_counter_add )
+{
+    CounterCase( state, 0 );
+}
+
+BENCH_CASE( metrics_counter_add_contended )
+{
+    CounterCase( state, c_contenders );
+}
+
+// What the striping is measured against: every thread adds to one atomic.
+BENCH_CASE( metrics_atomic_add_contended )
+{
+    std::atomic<uint64_t> counter( 0 );
+    RunUpdates( state, c_contenders, [&counter]( uint64_t ) { counter.fetch_add( 1, std::memory_order_relaxed ); } );
+    BenchDoNotOptimize( counter.load() );
+}
+
+BENCH_CASE( metrics_gauge_set )
+{
+    CMetricsRegistry registry;
+    CMetricGauge& gauge = registry.Gauge( "bench", "Bench." );
+    RunUpdates( state, 0, [&gauge]( uint64_t i ) { gauge.Set( (double) i ); } );
+    BenchDoNotOptimize( gauge.Value() );
+}
+
+static void HistogramCase( CBenchState& state, int contenders )
+{
+    CMetricsRegistry registry;
+    CMetricHistogram& histogram = registry.Histogram( "bench_seconds", "Bench." );
+    // Spread over the buckets like stage times from a few us to a few ms.
+    RunUpdates( state, contenders, [&histogram]( uint64_t i ) { histogram.Observe( 1000 + (i * 7919 & 0x3fffff) ); } );
+    BenchDoNotOptimize( histogram.Sum() );
+}
+
+BENCH_CASE( metrics_histogram_observe )
+{
+    HistogramCase( state, 0 );
+}
+
+BENCH_CASE( metrics_histogram_observe_contended )
+{
+    HistogramCase( state, c_contenders );
+}
+
+// What CPipeline adds per stage with metrics attached: one clock read and one observation.
+BENCH_CASE( metrics_stage_timer )
+{
+    typedef std::chrono::steady_clock Clock;
+    CMetricsRegistry registry;
+    CMetricHistogram& histogram = registry.Histogram( "bench_seconds", "Bench." );
+    Clock::time_point last = Clock::now();
+    RunUpdates( state, 0, [&histogram, &last]( uint64_t )
+    {
+        const Clock::time_point now = Clock::now();
+        histogram.Observe( (uint64_t) std::chrono::duration_cast<std::chrono::nanoseconds>( now - last ).count() );
+        last = now;
+    } );
+}
+
+BENCH_CASE( metrics_render )
+{
+    CMetricsRegistry registry;
+    static const char* c_stages[] = { "motiongate", "gray", "downscale", "gain", "threshold", "obstacles" };
+    for (int c = 0; c < 2; ++c)
+    {
+        const std::string labels = CMetricsRegistry::Label( "camera", std::to_string( c ) );
+        CMetricCounter& frames = registry.Counter( "robot_camera_frames_total", "Frames grabbed and converted.", labels );
+        frames.Add( 1000 );
+        registry.Rate( "robot_camera_fps", "Frames per second grabbed.", labels, frames );
+        registry.Histogram( "robot_camera_convert_seconds", "Pixel format conversion time per frame.", labels ).Observe( 900000 );
+        registry.Counter( "robot_grab_errors_total", "Failed grabs by pylon error code.",
+                          labels + "," + CMetricsRegistry::Label( "code", "0xe1000014" ) ).Add();
+        registry.Gauge( "robot_grab_buffers", "Grab buffers owned by the camera's pool.", labels ).Set( 10 );
+        registry.Gauge( "robot_grab_buffer_bytes", "Memory of the camera's grab buffer pool.", labels ).Set( 36864000 );
+    }
+    for (size_t s = 0; s < sizeof( c_stages ) / sizeof( c_stages[0] ); ++s)
+    {
+        registry.Histogram( "robot_pipeline_stage_seconds", "Time spent in each pipeline stage per frame.",
+                            CMetricsRegistry::Label( "stage", c_stages[s] ) ).Observe( 250000 * (s + 1) );
+    }
+    registry.GaugeFunction( "robot_pipeline_queue_depth", "Frames waiting for a pipeline worker.", "",
+                            []() { return 3.0; } );
+
+    size_t bytes = 0;
+    while (state.KeepRunning())
+    {
+        const std::string text = registry.Render();
+        bytes += text.size();
+        BenchDoNotOptimize( text );
+    }
+    state.SetBytesProcessed( bytes );
+    state.SetCounter( "bytes_per_scrape", (double) bytes / state.Iterations() );
+}
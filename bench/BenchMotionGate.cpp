@@ -0,0 +1,139 @@
+// BenchMotionGate.cpp
+// Motion gate on a replay that alternates 60 static frames (one frame with sensor noise)
+// and 60 moving ones: cost of the signature, and pipeline time per frame with and without
+// the gate in front of the heavy stages.
+#include "BenchHarness.h"
+
+#include <memory>
+#include "../MotionGate.h"
+#include "../Pipeline.h"
+
+static const size_t c_segmentFrames = 60;
+static const int c_noiseVariants = 4;
+static const int c_noiseAmplitude = 2;  // +- grey levels
+
+struct ReplayFrame
+{
+    cv::Mat image;
+    cv::Mat depth;
+};
+
+static const std::vector<ReplayFrame>& MixedReplay()
+{
+    static std::vector<ReplayFrame> replay;
+    if (!replay.empty())
+    {
+        return replay;
+    }
+    const std::vector<cv::Mat>& frames = BenchFrames();
+    const std::vector<cv::Mat>& depths = BenchDepthFrames();
+
+    std::vector<cv::Mat> noisy( c_noiseVariants );
+    uint32_t random = 12345;
+    for (int v = 0; v < c_noiseVariants; ++v)
+    {
+        noisy[v] = frames[0].clone();
+        for (int r = 0; r < noisy[v].rows; ++r)
+        {
+            uint8_t* p = noisy[v].ptr<uint8_t>( r );
+            const int width = noisy[v].cols * noisy[v].channels();
+            for (int i = 0; i < width; ++i)
+            {
+                random = random * 1664525u + 1013904223u;
+                const int value = p[i] + (int) ((random >> 24) % (2 * c_noiseAmplitude + 1)) - c_noiseAmplitude;
+                p[i] = (uint8_t) (value < 0 ? 0 : value > 255 ? 255 : value);
+            }
+        }
+    }
+
+    for (size_t i = 0; i < 4 * c_segmentFrames; ++i)
+    {
+        ReplayFrame frame;
+        if ((i / c_segmentFrames) % 2 == 0)
+        {
+            frame.image = noisy[i % c_noiseVariants];
+            frame.depth = depths[0];
+        }
+        else
+        {
+            frame.image = frames[i % frames.size()];
+            frame.depth = depths[i % depths.size()];
+        }
+        replay.push_back( frame );
+    }
+    return replay;
+}
+
+BENCH_CASE( motiongate_check_1280x960 )
+{
+    const std::vector<ReplayFrame>& replay = MixedReplay();
+    CMotionGate gate;
+    size_t f = 0;
+    while (state.KeepRunning())
+    {
+        BenchDoNotOptimize( gate.Check( replay[f++ % replay.size()].image ) );
+    }
+    state.SetItemsProcessed( state.Iterations() );
+    state.SetCounter( "skip_rate", (double) gate.Skipped() / gate.Frames() );
+    state.SetCounter( "refreshes", (double) gate.Refreshes() );
+}
+
+// Every frame must reach the sinks processed, gated or not: gray, with obstacles.
+class COutputCheckSink : public IPipelineSink
+{
+public:
+    COutputCheckSink() : m_unprocessed( 0 ) {}
+    virtual void Consume( const PipelineFrame& frame )
+    {
+        if (frame.image.channels() != 1 || frame.obstacles.empty())
+        {
+            ++m_unprocessed;
+        }
+    }
+    uint64_t m_unprocessed;
+};
+
+static void RunPipeline( CBenchState& state, bool gated )
+{
+    const std::vector<ReplayFrame>& replay = MixedReplay();
+    PipelineConfig config;
+    const char* c_types[] = { "motiongate", "gray", "gain", "obstacles" };
+    for (size_t i = gated ? 0 : 1; i < sizeof( c_types ) / sizeof( c_types[0] ); ++i)
+    {
+        StageConfig stage;
+        stage.type = c_types[i];
+        stage.gain = 1.5;
+        config.stages.push_back( stage );
+    }
+    CPipeline pipeline( config );
+    COutputCheckSink sink;
+    pipeline.AddSink( &sink );
+
+    size_t f = 0;
+    while (state.KeepRunning())
+    {
+        const ReplayFrame& input = replay[f++ % replay.size()];
+        PipelineFrame frame;
+        frame.image = input.image;      // The gray stage writes a new image, the input stays intact.
+        frame.depth = input.depth;
+        pipeline.ProcessFrame( frame );
+    }
+    state.SetItemsProcessed( state.Iterations() );
+    state.SetCounter( "skip_rate", (double) pipeline.Gated() / state.Iterations() );
+    state.SetCounter( "cpu_saved_ms", pipeline.SavedNs() / 1e6 );
+    state.SetCounter( "unprocessed_at_sinks", (double) sink.m_unprocessed );
+    if (sink.m_unprocessed > 0)
+    {
+        state.SkipWithError( "frames reached the sinks without the output of the stages" );
+    }
+}
+
+BENCH_CASE( motiongate_pipeline_ungated )
+{
+    RunPipeline( state, false );
+}
+
+BENCH_CASE( motiongate_pipeline_gated )
+{
+    RunPipeline( state, true );
+}
@@ -0,0 +1,91 @@
+// BenchObstacles.cpp
+// Floor fit and obstacle clustering on the depth replay: latency percentiles per frame and
+// depth points processed per second.
+#include "BenchHarness.h"
+
+#include <memory>
+#include "../ObstacleDetector.h"
+#include "../Pipeline.h"
+
+static void RunDetector( CBenchState& state, CObstacleDetector& detector )
+{
+    const std::vector<cv::Mat>& frames = BenchDepthFrames();
+    uint64_t points = 0;
+    uint64_t obstacles = 0;
+    uint64_t warmStarts = 0;
+    uint64_t iterations = 0;
+    uint64_t misses = 0;
+    size_t f = 0;
+    while (state.KeepRunning())
+    {
+        if (!detector.Detect( frames[f++ % frames.size()] ))
+        {
+            ++misses;
+        }
+        points += detector.Points();
+        obstacles += detector.Obstacles().size();
+        warmStarts += detector.WarmStarted() ? 1 : 0;
+        iterations += detector.Iterations();
+    }
+    const double n = (double) state.Iterations();
+    state.SetItemsProcessed( points );
+    state.SetCounter( "frames", n );
+    state.SetCounter( "obstacles_per_frame", obstacles / n );
+    state.SetCounter( "warm_start_rate", warmStarts / n );
+    state.SetCounter( "ransac_iterations_per_frame", iterations / n );
+    state.SetCounter( "floor_missed", (double) misses );
+}
+
+BENCH_CASE( obstacles_640x480 )
+{
+    CObstacleDetector detector;
+    RunDetector( state, detector );
+}
+
+BENCH_CASE( obstacles_640x480_step2 )
+{
+    CObstacleDetector::Config config;
+    config.pixelStep = 2;
+    CObstacleDetector detector( config );
+    RunDetector( state, detector );
+}
+
+// A fresh detector per frame: the full RANSAC search without warm start, plus sizing the buffers.
+BENCH_CASE( obstacles_640x480_cold )
+{
+    const std::vector<cv::Mat>& frames = BenchDepthFrames();
+    uint64_t points = 0;
+    size_t f = 0;
+    while (state.KeepRunning())
+    {
+        state.PauseTiming();
+        CObstacleDetector* pDetector = new CObstacleDetector;
+        state.ResumeTiming();
+        pDetector->Detect( frames[f++ % frames.size()] );
+        points += pDetector->Points();
+        state.PauseTiming();
+        delete pDetector;
+        state.ResumeTiming();
+    }
+    state.SetItemsProcessed( points );
+}
+
+// The same detector as a pipeline stage, as the workers run it.
+BENCH_CASE( obstacles_pipeline_stage )
+{
+    const std::vector<cv::Mat>& frames = BenchDepthFrames();
+    StageConfig stageConfig;
+    stageConfig.type = "obstacles";
+    std::unique_ptr<IPipelineStage> pStage( CreatePipelineStage( stageConfig ) );
+    size_t f = 0;
+    uint64_t obstacles = 0;
+    while (state.KeepRunning())
+    {
+        PipelineFrame frame;
+        frame.depth = frames[f++ % frames.size()];
+        pStage->Process( frame );
+        obstacles += frame.obstacles.size();
+    }
+    state.SetCounter( "obstacles_per_frame", (double) obstacles / state.Iterations() );
+    state.SetItemsProcessed( state.Iterations() );
+}
@@ -0,0 +1,612 @@
+// BenchPipeline.cpp
+// Acquisition and processing pipeline cases: conversion, hand-off, display skipping,
+// features, stereo, recording and end-to-end throughput.
+#include "BenchHarness.h"
+
+#include <atomic>
+#include <memory>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <thread>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <opencv2/calib3d.hpp>
+#include <opencv2/features2d.hpp>
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+#include "../FrameBus.h"
+#include "../FrameQueue.h"
+#include "../Pipeline.h"
+#include "../PreviewServer.h"
+
+// Bayer frames as the camera delivers them, derived from the shared BGR frames.
+static const std::vector<cv::Mat>& BayerFrames()
+{
+    static std::vector<cv::Mat> bayer;
+    if (bayer.empty())
+    {
+        const std::vector<cv::Mat>& frames = BenchFrames();
+        for (size_t f = 0; f < frames.size(); ++f)
+        {
+            cv::Mat raw( frames[f].rows, frames[f].cols, CV_8UC1 );
+            for (int y = 0; y < raw.rows; ++y)
+            {
+                const uint8_t* src = frames[f].ptr<uint8_t>( y );
+                uint8_t* dst = raw.ptr<uint8_t>( y );
+                for (int x = 0; x < raw.cols; ++x)
+                {
+                    // BG/GR mosaic: pick the channel this photosite would see.
+                    int channel = (y & 1) == 0 ? ((x & 1) == 0 ? 0 : 1) : ((x & 1) == 0 ? 1 : 2);
+                    dst[x] = src[3 * x + channel];
+                }
+            }
+            bayer.push_back( raw );
+        }
+    }
+    return bayer;
+}
+
+static const std::vector<cv::Mat>& GrayFrames()
+{
+    static std::vector<cv::Mat> gray;
+    if (gray.empty())
+    {
+        const std::vector<cv::Mat>& frames = BenchFrames();
+        for (size_t f = 0; f < frames.size(); ++f)
+        {
+            cv::Mat image;
+            cv::cvtColor( frames[f], image, cv::COLOR_BGR2GRAY );
+            gray.push_back( image );
+        }
+    }
+    return gray;
+}
+
+BENCH_CASE( convert_bayer_to_bgr )
+{
+    const std::vector<cv::Mat>& bayer = BayerFrames();
+    cv::Mat bgr;
+    size_t f = 0;
+    uint64_t bytes = 0;
+    while (state.KeepRunning())
+    {
+        const cv::Mat& raw = bayer[f++ % bayer.size()];
+        cv::cvtColor( raw, bgr, cv::COLOR_BayerBG2BGR );
+        bytes += raw.total();
+    }
+    state.SetBytesProcessed( bytes );
+    state.SetItemsProcessed( state.Iterations() );
+}
+
+BENCH_CASE( convert_bgr_to_gray )
+{
+    const std::vector<cv::Mat>& frames = BenchFrames();
+    cv::Mat gray;
+    size_t f = 0;
+    uint64_t bytes = 0;
+    while (state.KeepRunning())
+    {
+        const cv::Mat& bgr = frames[f++ % frames.size()];
+        cv::cvtColor( bgr, gray, cv::COLOR_BGR2GRAY );
+        bytes += bgr.total() * bgr.elemSize();
+    }
+    state.SetBytesProcessed( bytes );
+    state.SetItemsProcessed( state.Iterations() );
+}
+
+// One camera thread handing owned frames to one worker, as OnImageGrabbed does.
+BENCH_CASE( queue_handoff )
+{
+    const std::vector<cv::Mat>& frames = BenchFrames();
+    CFrameQueue<PipelineFrame> queue( 8 );
+    std::atomic<uint64_t> consumed( 0 );
+    std::thread consumer( [&queue, &consumed]()
+    {
+        PipelineFrame frame;
+        while (queue.Pop( frame ))
+        {
+            ++consumed;
+        }
+    } );
+
+    size_t f = 0;
+    while (state.KeepRunning())
+    {
+        PipelineFrame frame;
+        frame.image = frames[f++ % frames.size()];
+        frame.frameId = f;
+        queue.Push( std::move( frame ) );
+    }
+    queue.Close();
+    consumer.join();
+    state.SetItemsProcessed( state.Iterations() );
+    state.SetCounter( "dropped", (double) queue.Dropped() );
+    state.SetCounter( "consumed", (double) consumed.load() );
+}
+
+// Display path with nobody consuming: every push has to drop the oldest frame.
+BENCH_CASE( display_skip_queue )
+{
+    const std::vector<cv::Mat>& frames = BenchFrames();
+    CFrameQueue<std::pair<cv::Mat, std::string> > queue( 2 );
+    size_t f = 0;
+    while (state.KeepRunning())
+    {
+        queue.Push( std::make_pair( frames[f++ % frames.size()], std::string( "Live Video: Camera 0" ) ) );
+    }
+    state.SetItemsProcessed( state.Iterations() );
+    state.SetCounter( "dropped", (double) queue.Dropped() );
+}
+
+// Cost the camera thread pays to hand a frame to the preview encoder.
+BENCH_CASE( display_skip_preview_submit )
+{
+    const std::vector<cv::Mat>& frames = BenchFrames();
+    CPreviewServer server( 1, 0 );
+    if (!server.Start())
+    {
+        state.SkipWithError( "preview server did not start" );
+        return;
+    }
+    size_t f = 0;
+    while (state.KeepRunning())
+    {
+        server.SubmitFrame( 0, frames[f++ % frames.size()] );
+    }
+    server.Stop();
+    CPreviewServer::Stats stats = server.GetStats();
+    state.SetItemsProcessed( state.Iterations() );
+    state.SetCounter( "encoded", (double) stats.framesEncoded );
+    state.SetCounter( "encode_ms_avg", stats.framesEncoded > 0 ? stats.encodeNs / 1e6 / (double) stats.framesEncoded : 0.0 );
+}
+
+static const int c_previewClients = 3;         // The last one is slow.
+static const int c_previewFrameUs = 33333;    // 30 fps.
+static const int c_slowClientChunk = 4096;
+static const int c_slowClientPauseUs = 20000;
+
+// A loopback client of one camera's MJPEG stream that counts the parts it receives.
+struct PreviewClient
+{
+    PreviewClient() : fd( -1 ), slow( false ), frames( 0 ) {}
+    int fd;
+    bool slow;                  // Reads c_slowClientChunk bytes every c_slowClientPauseUs.
+    std::atomic<uint64_t> frames;
+    std::thread thread;
+};
+
+static int ConnectPreview( uint16_t port, bool slow )
+{
+    int fd = socket( AF_INET, SOCK_STREAM, 0 );
+    if (fd < 0)
+    {
+        return -1;
+    }
+    if (slow)
+    {
+        // A small receive buffer, so the server's sends back up instead of being absorbed.
+        int size = 2 * c_slowClientChunk;
+        setsockopt( fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof( size ) );
+    }
+    struct sockaddr_in addr;
+    memset( &addr, 0, sizeof( addr ) );
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons( port );
+    addr.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+    static const char request[] = "GET /cam0 HTTP/1.0\r\n\r\n";
+    if (connect( fd, (struct sockaddr*) &addr, sizeof( addr ) ) != 0
+        || send( fd, request, sizeof( request ) - 1, MSG_NOSIGNAL ) != (ssize_t) (sizeof( request ) - 1))
+    {
+        close( fd );
+        return -1;
+    }
+    return fd;
+}
+
+// Parses the stream by the parts' Content-Length until the server closes it.
+static void ReadPreviewStream( PreviewClient* pClient )
+{
+    std::vector<char> chunk( pClient->slow ? c_slowClientChunk : 65536 );
+    std::string pending;
+    size_t bodyLeft = 0;
+    bool inPart = false;
+    while (true)
+    {
+        if (bodyLeft > 0 && !pending.empty())
+        {
+            const size_t n = bodyLeft < pending.size() ? bodyLeft : pending.size();
+            pending.erase( 0, n );
+            bodyLeft -= n;
+        }
+        if (bodyLeft == 0 && inPart)
+        {
+            ++pClient->frames;
+            inPart = false;
+        }
+        const size_t headerEnd = bodyLeft == 0 ? pending.find( "\r\n\r\n" ) : std::string::npos;
+        if (headerEnd != std::string::npos)
+        {
+            // The response header has no Content-Length; each part's header does.
+            const size_t length = pending.find( "Content-Length: " );
+            if (length != std::string::npos && length < headerEnd)
+            {
+                bodyLeft = (size_t) strtoul( pending.c_str() + length + 16, NULL, 10 ) + 2;
+                inPart = true;
+            }
+            pending.erase( 0, headerEnd + 4 );
+            continue;
+        }
+        if (pClient->slow)
+        {
+            std::this_thread::sleep_for( std::chrono::microseconds( c_slowClientPauseUs ) );
+        }
+        const ssize_t n = recv( pClient->fd, chunk.data(), chunk.size(), 0 );
+        if (n <= 0)
+        {
+            break;
+        }
+        pending.append( chunk.data(), (size_t) n );
+    }
+    close( pClient->fd );
+}
+
+// The preview at 30 fps with c_previewClients loopback clients connected, the last one too
+// slow for the stream. Iterations time SubmitFrame(), which is what the preview sink adds
+// to a pipeline worker per frame. The encoder's CPU time, the time from submit to sent and
+// the frames each client skipped (encoded but never received) are counters.
+BENCH_CASE( display_preview_loopback_clients )
+{
+    const std::vector<cv::Mat>& frames = BenchFrames();
+    CPreviewServer server( 1, 0 );
+    if (!server.Start())
+    {
+        state.SkipWithError( "preview server did not start" );
+        return;
+    }
+    std::vector<std::unique_ptr<PreviewClient> > clients;
+    for (int c = 0; c < c_previewClients; ++c)
+    {
+        std::unique_ptr<PreviewClient> pClient( new PreviewClient );
+        pClient->slow = c == c_previewClients - 1;
+        pClient->fd = ConnectPreview( server.Port(), pClient->slow );
+        if (pClient->fd < 0)
+        {
+            break;
+        }
+        pClient->thread = std::thread( ReadPreviewStream, pClient.get() );
+        clients.push_back( std::move( pClient ) );
+    }
+    // Every client has been accepted before the first frame, so each could receive all of them.
+    for (int wait = 0; wait < 200 && server.GetStats().clients < clients.size(); ++wait)
+    {
+        std::this_thread::sleep_for( std::chrono::milliseconds( 10 ) );
+    }
+    const bool connected = clients.size() == (size_t) c_previewClients && server.GetStats().clients == clients.size();
+
+    size_t f = 0;
+    const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    while (connected && state.KeepRunning())
+    {
+        server.SubmitFrame( 0, frames[f++ % frames.size()] );
+        state.PauseTiming();
+        std::this_thread::sleep_for( std::chrono::microseconds( c_previewFrameUs ) );
+        state.ResumeTiming();
+    }
+    const double wallNs = std::chrono::duration<double, std::nano>( std::chrono::steady_clock::now() - start ).count();
+    server.Stop();
+    for (size_t c = 0; c < clients.size(); ++c)
+    {
+        clients[c]->thread.join();
+    }
+    if (!connected)
+    {
+        state.SkipWithError( "loopback clients could not connect to the preview server" );
+        return;
+    }
+
+    CPreviewServer::Stats stats = server.GetStats();
+    state.SetItemsProcessed( state.Iterations() );
+    state.SetCounter( "clients", (double) clients.size() );
+    state.SetCounter( "encoded", (double) stats.framesEncoded );
+    state.SetCounter( "sent", (double) stats.framesSent );
+    state.SetCounter( "skipped", (double) stats.framesSkipped );
+    state.SetCounter( "submit_to_sent_ms_avg", stats.framesSent > 0 ? stats.submitToSentNs / 1e6 / (double) stats.framesSent : 0.0 );
+    state.SetCounter( "encoder_cpu_ms_per_frame", stats.framesEncoded > 0 ? stats.encoderCpuNs / 1e6 / (double) stats.framesEncoded : 0.0 );
+    state.SetCounter( "encoder_cpu_percent", wallNs > 0.0 ? 100.0 * stats.encoderCpuNs / wallNs : 0.0 );
+    for (size_t c = 0; c < clients.size(); ++c)
+    {
+        const uint64_t received = clients[c]->frames;
+        const std::string name = "client" + std::to_string( c ) + (clients[c]->slow ? "_slow" : "");
+        state.SetCounter( name + "_frames", (double) received );
+        state.SetCounter( name + "_skipped", stats.framesEncoded > received ? (double) (stats.framesEncoded - received) : 0.0 );
+    }
+}
+
+BENCH_CASE( features_orb )
+{
+    const std::vector<cv::Mat>& gray = GrayFrames();
+    cv::Ptr<cv::ORB> orb = cv::ORB::create( 1000 );
+    std::vector<cv::KeyPoint> keypoints;
+    cv::Mat descriptors;
+    size_t f = 0;
+    uint64_t total = 0;
+    while (state.KeepRunning())
+    {
+        orb->detectAndCompute( gray[f++ % gray.size()], cv::noArray(), keypoints, descriptors );
+        total += keypoints.size();
+    }
+    state.SetItemsProcessed( state.Iterations() );
+    state.SetCounter( "keypoints_avg", state.Iterations() > 0 ? (double) total / (double) state.Iterations() : 0.0 );
+}
+
+// Block matching on a 640x480 pair; the right image is the left one shifted by 16 px.
+BENCH_CASE( stereo_bm )
+{
+    const std::vector<cv::Mat>& gray = GrayFrames();
+    std::vector<std::pair<cv::Mat, cv::Mat> > pairs;
+    for (size_t f = 0; f < gray.size(); ++f)
+    {
+        cv::Mat left;
+        cv::resize( gray[f], left, cv::Size( 640, 480 ), 0, 0, cv::INTER_AREA );
+        cv::Mat right = cv::Mat::zeros( left.size(), left.type() );
+        left( cv::Rect( 16, 0, left.cols - 16, left.rows ) ).copyTo( right( cv::Rect( 0, 0, left.cols - 16, left.rows ) ) );
+        pairs.push_back( std::make_pair( left, right ) );
+    }
+    cv::Ptr<cv::StereoBM> matcher = cv::StereoBM::create( 64, 15 );
+    cv::Mat disparity;
+    size_t f = 0;
+    while (state.KeepRunning())
+    {
+        const std::pair<cv::Mat, cv::Mat>& pair = pairs[f++ % pairs.size()];
+        matcher->compute( pair.first, pair.second, disparity );
+    }
+    state.SetItemsProcessed( state.Iterations() );
+}
+
+// Raw frame recording: one fwrite per frame, flushed to the page cache.
+BENCH_CASE( record_raw_write )
+{
+    const std::vector<cv::Mat>& frames = BenchFrames();
+    char path[] = "/tmp/bench_recordXXXXXX";
+    int fd = mkstemp( path );
+    FILE* pFile = fd >= 0 ? fdopen( fd, "wb" ) : NULL;
+    if (pFile == NULL)
+    {
+        state.SkipWithError( "cannot create recording file" );
+        return;
+    }
+    size_t f = 0;
+    uint64_t bytes = 0;
+    while (state.KeepRunning())
+    {
+        const cv::Mat& frame = frames[f++ % frames.size()];
+        const size_t size = frame.total() * frame.elemSize();
+        fwrite( frame.data, 1, size, pFile );
+        fflush( pFile );
+        bytes += size;
+        // Keep the file from growing without bound on long runs.
+        if ((f & 63) == 0)
+        {
+            state.PauseTiming();
+            rewind( pFile );
+            state.ResumeTiming();
+        }
+    }
+    fclose( pFile );
+    unlink( path );
+    state.SetBytesProcessed( bytes );
+    state.SetItemsProcessed( state.Iterations() );
+}
+
+BENCH_CASE( record_jpeg_encode )
+{
+    const std::vector<cv::Mat>& frames = BenchFrames();
+    std::vector<uchar> jpeg;
+    std::vector<int> params;
+    params.push_back( cv::IMWRITE_JPEG_QUALITY );
+    params.push_back( 90 );
+    size_t f = 0;
+    uint64_t bytes = 0;
+    while (state.KeepRunning())
+    {
+        cv::imencode( ".jpg", frames[f++ % frames.size()], jpeg, params );
+        bytes += jpeg.size();
+    }
+    state.SetItemsProcessed( state.Iterations() );
+    state.SetCounter( "jpeg_bytes_avg", state.Iterations() > 0 ? (double) bytes / (double) state.Iterations() : 0.0 );
+}
+
+static PipelineConfig BenchPipelineConfig()
+{
+    PipelineConfig config;
+    StageConfig stage;
+    stage.type = "gray";
+    config.stages.push_back( stage );
+    stage.type = "downscale";
+    stage.factor = 0.5;
+    config.stages.push_back( stage );
+    stage.type = "threshold";
+    stage.threshold = 100;
+    config.stages.push_back( stage );
+    config.sinks.clear();
+    return config;
+}
+
+// The same three stages as pipeline_graph, called directly.
+BENCH_CASE( pipeline_handwired )
+{
+    const std::vector<cv::Mat>& frames = BenchFrames();
+    GrayOp gray;
+    DownscaleOp downscale( 0.5 );
+    CPixelOp<ThresholdPixel> threshold( ThresholdPixel( 100 ) );
+    size_t f = 0;
+    while (state.KeepRunning())
+    {
+        PipelineFrame frame;
+        frame.image = frames[f++ % frames.size()];
+        gray( frame );
+        downscale( frame );
+        threshold( frame );
+        BenchDoNotOptimize( frame.image.data );
+    }
+    state.SetItemsProcessed( state.Iterations() );
+}
+
+BENCH_CASE( pipeline_graph )
+{
+    const std::vector<cv::Mat>& frames = BenchFrames();
+    CPipeline pipeline( BenchPipelineConfig() );
+    size_t f = 0;
+    while (state.KeepRunning())
+    {
+        PipelineFrame frame;
+        frame.image = frames[f++ % frames.size()];
+        pipeline.ProcessFrame( frame );
+        BenchDoNotOptimize( frame.image.data );
+    }
+    state.SetItemsProcessed( state.Iterations() );
+}
+
+// Push rate a camera can sustain into the threaded pipeline; frames the workers
+// cannot keep up with are dropped by the queue and reported.
+BENCH_CASE( pipeline_end_to_end )
+{
+    const std::vector<cv::Mat>& frames = BenchFrames();
+    PipelineConfig config = BenchPipelineConfig();
+    config.threadCount = 2;
+    CPipeline pipeline( config );
+    pipeline.Start();
+    size_t f = 0;
+    while (state.KeepRunning())
+    {
+        PipelineFrame frame;
+        frame.image = frames[f % frames.size()].clone();
+        frame.frameId = f++;
+        pipeline.Push( std::move( frame ) );
+    }
+    pipeline.Stop();
+    state.SetItemsProcessed( pipeline.Processed() );
+    state.SetCounter( "processed", (double) pipeline.Processed() );
+    state.SetCounter( "dropped", (double) pipeline.Dropped() );
+}
+
+// Publishing into the shared-memory frame bus while several reader processes consume.
+// Each reader reports its publish-to-acquire latency and how many frames it skipped,
+// or that it could not attach within c_attachTimeoutNs.
+BENCH_CASE( framebus_publish_readers )
+{
+    const std::vector<cv::Mat>& frames = BenchFrames();
+    const int c_readers = 3;
+    const uint64_t c_attachTimeoutNs = 2000000000;
+    const std::string name = "/autonomous_robot_bench";
+    const uint32_t slotSize = (uint32_t) (frames[0].total() * frames[0].elemSize());
+    CFrameBusWriter writer;
+    if (!writer.Create( name, 8, slotSize ))
+    {
+        state.SkipWithError( "cannot create shared memory" );
+        return;
+    }
+
+    int pipes[c_readers][2];
+    pid_t pids[c_readers];
+    for (int r = 0; r < c_readers; ++r)
+    {
+        if (pipe( pipes[r] ) != 0)
+        {
+            state.SkipWithError( "pipe failed" );
+            return;
+        }
+        pids[r] = fork();
+        if (pids[r] == 0)
+        {
+            close( pipes[r][0] );
+            CFrameBusReader reader;
+            const uint64_t deadline = FrameBusNowNs() + c_attachTimeoutNs;
+            bool attached;
+            while (!(attached = reader.Attach( name )) && FrameBusNowNs() < deadline)
+            {
+                usleep( 100 );
+            }
+            uint64_t received = 0, latencyNs = 0, maxLag = 0, torn = 0;
+            while (attached && !reader.IsStale())
+            {
+                FrameBusView view;
+                if (!reader.AcquireLatest( view ))
+                {
+                    usleep( 50 );
+                    continue;
+                }
+                latencyNs += FrameBusNowNs() - view.meta.publishNs;
+                maxLag = std::max( maxLag, reader.Lag() );
+                // Touch the payload the way a consumer would.
+                BenchDoNotOptimize( view.pData[view.meta.size / 2] );
+                if (!reader.Release( view ))
+                {
+                    ++torn;
+                }
+                ++received;
+            }
+            uint64_t report[6] = { attached ? 1u : 0u, received, latencyNs, reader.Skipped(), maxLag, torn };
+            ssize_t written = write( pipes[r][1], report, sizeof( report ) );
+            _exit( attached && written == (ssize_t) sizeof( report ) ? 0 : 1 );
+        }
+        close( pipes[r][1] );
+    }
+
+    FrameBusMeta meta = FrameBusMeta();
+    meta.width = (uint32_t) frames[0].cols;
+    meta.height = (uint32_t) frames[0].rows;
+    meta.stride = meta.width * 3;
+    meta.size = slotSize;
+    size_t f = 0;
+    uint64_t bytes = 0;
+    while (state.KeepRunning())
+    {
+        meta.frameId = f;
+        writer.Publish( frames[f++ % frames.size()].data, meta );
+        bytes += slotSize;
+        // Camera rate is far below what the bus can do; pace publishing to ~1 kHz so readers keep up.
+        state.PauseTiming();
+        usleep( 1000 );
+        state.ResumeTiming();
+    }
+    writer.Close();
+
+    uint64_t received = 0, latencyNs = 0, skipped = 0, maxLag = 0, torn = 0;
+    int failed = 0;
+    for (int r = 0; r < c_readers; ++r)
+    {
+        // report[0] is 1 if the reader attached.
+        uint64_t report[6] = { 0, 0, 0, 0, 0, 0 };
+        if (read( pipes[r][0], report, sizeof( report ) ) == (ssize_t) sizeof( report ) && report[0] == 1)
+        {
+            received += report[1];
+            latencyNs += report[2];
+            skipped += report[3];
+            maxLag = std::max( maxLag, report[4] );
+            torn += report[5];
+        }
+        else
+        {
+            ++failed;
+        }
+        close( pipes[r][0] );
+        waitpid( pids[r], NULL, 0 );
+    }
+    if (failed > 0)
+    {
+        state.SkipWithError( std::to_string( failed ) + " frame bus reader(s) did not attach or report" );
+        return;
+    }
+    state.SetBytesProcessed( bytes );
+    state.SetItemsProcessed( state.Iterations() );
+    state.SetCounter( "readers", c_readers );
+    state.SetCounter( "reader_latency_us_avg", received > 0 ? latencyNs / 1e3 / (double) received : 0.0 );
+    state.SetCounter( "reader_skipped", (double) skipped );
+    state.SetCounter( "reader_max_lag", (double) maxLag );
+    state.SetCounter( "reader_torn", (double) torn );
+}
@@ -0,0 +1,397 @@
+// BenchPlaceIndex.cpp
+// Place recognition on a generated route: every place is a set of landmark descriptors,
+// the route visits each place once to build the index, and queries are views of the same
+// places on a second visit (a different subset of landmarks, with bit noise). Reports query
+// latency, recall at 1 and 5 against the true place, and agreement with brute-force matching.
+#include "BenchHarness.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "../PlaceIndex.h"
+
+static const uint32_t c_keyframes = 20000;
+static const uint32_t c_bruteForceKeyframes = 200;
+static const int c_queries = 256;
+static const int c_trainKeyframes = 200;
+static const int c_agreementQueries = 16;    // Index top 1 checked against brute force.
+
+// ORB descriptors cluster: landmarks are one of c_prototypes patterns with c_landmarkFlips
+// bits changed, and a view changes up to c_viewFlips more.
+static const uint64_t c_prototypes = 16384;
+static const int c_landmarkFlips = 24;
+static const int c_viewFlips = 6;
+static const int c_landmarksPerPlace = 400;
+static const int c_visiblePercent = 60;
+static const int c_clutter = 60;            // Descriptors per view not tied to the place.
+static const int c_matchDistance = 64;      // Brute force: bits for two descriptors to match.
+
+static inline uint64_t Mix( uint64_t x )
+{
+    x += 0x9e3779b97f4a7c15ull;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+    return x ^ (x >> 31);
+}
+
+static void AppendDescriptor( uint64_t pattern, uint64_t noise, int flips, std::vector<uint8_t>& out )
+{
+    uint64_t bits[4];
+    for (int i = 0; i < 4; ++i)
+    {
+        bits[i] = Mix( (pattern % c_prototypes) * 4 + i );
+    }
+    for (int j = 0; j < c_landmarkFlips; ++j)
+    {
+        const uint64_t b = Mix( pattern + j ) % 256;
+        bits[b / 64] ^= 1ull << (b % 64);
+    }
+    for (int j = 0; j < flips; ++j)
+    {
+        const uint64_t b = Mix( noise + j ) % 256;
+        bits[b / 64] ^= 1ull << (b % 64);
+    }
+    const uint8_t* p = (const uint8_t*) bits;
+    out.insert( out.end(), p, p + CPlaceIndex::c_descriptorBytes );
+}
+
+// Descriptors of place seen on the given visit.
+static void View( uint64_t place, uint64_t visit, std::vector<uint8_t>& out )
+{
+    out.clear();
+    for (int i = 0; i < c_landmarksPerPlace; ++i)
+    {
+        if (Mix( place * 7919 + visit * 104729 + i * 31 ) % 100 >= (uint64_t) c_visiblePercent)
+        {
+            continue;
+        }
+        const uint64_t landmark = Mix( place * 1000003 + i );
+        const uint64_t noise = Mix( landmark ^ (visit * 0x1234567) );
+        AppendDescriptor( landmark, noise, (int) (noise % (c_viewFlips + 1)), out );
+    }
+    for (int i = 0; i < c_clutter; ++i)
+    {
+        AppendDescriptor( Mix( place * 31337 + visit * 65537 + i ), 0, 0, out );
+    }
+}
+
+static size_t Count( const std::vector<uint8_t>& descriptors )
+{
+    return descriptors.size() / CPlaceIndex::c_descriptorBytes;
+}
+
+static void TrainIndex( CPlaceIndex& index )
+{
+    std::vector<uint8_t> training;
+    std::vector<uint8_t> view;
+    for (int place = 0; place < c_trainKeyframes; ++place)
+    {
+        View( place, 0, view );
+        training.insert( training.end(), view.begin(), view.end() );
+    }
+    index.Train( training.data(), Count( training ) );
+}
+
+// Trained on the first places and filled with the first visit of c_keyframes places, once.
+static CPlaceIndex& RouteIndex()
+{
+    static CPlaceIndex index;
+    if (!index.Trained())
+    {
+        TrainIndex( index );
+        std::vector<uint8_t> view;
+        for (uint32_t place = 0; place < c_keyframes; ++place)
+        {
+            View( place, 0, view );
+            index.AddKeyframe( view.data(), Count( view ) );
+        }
+    }
+    return index;
+}
+
+struct Query
+{
+    uint32_t place;
+    std::vector<uint8_t> descriptors;
+};
+
+static std::vector<Query> MakeQueries( uint32_t places )
+{
+    std::vector<Query> queries( c_queries );
+    for (int q = 0; q < c_queries; ++q)
+    {
+        queries[q].place = (uint32_t) (Mix( q + 1 ) % places);
+        View( queries[q].place, 1, queries[q].descriptors );
+    }
+    return queries;
+}
+
+static void RunQueries( CBenchState& state, CPlaceIndex& index, const std::vector<Query>& queries )
+{
+    std::vector<CPlaceIndex::Match> matches;
+    uint64_t top1 = 0;
+    uint64_t top5 = 0;
+    size_t q = 0;
+    while (state.KeepRunning())
+    {
+        const Query& query = queries[q++ % queries.size()];
+        index.Query( query.descriptors.data(), Count( query.descriptors ), 5, (uint32_t) index.Keyframes(), matches );
+        for (size_t i = 0; i < matches.size(); ++i)
+        {
+            if (matches[i].keyframe == query.place)
+            {
+                top1 += i == 0 ? 1 : 0;
+                ++top5;
+            }
+        }
+    }
+    const double n = (double) state.Iterations();
+    state.SetItemsProcessed( state.Iterations() );
+    state.SetCounter( "keyframes", (double) index.Keyframes() );
+    state.SetCounter( "recall_at_1", top1 / n );
+    state.SetCounter( "recall_at_5", top5 / n );
+    state.SetCounter( "postings", (double) index.Postings() );
+    state.SetCounter( "heap_mb", index.MemoryBytes() / 1048576.0 );
+}
+
+BENCH_CASE( place_query_20000 )
+{
+    CPlaceIndex& index = RouteIndex();
+    RunQueries( state, index, MakeQueries( c_keyframes ) );
+}
+
+// The same index saved and mapped back, as after a restart.
+BENCH_CASE( place_query_mapped_20000 )
+{
+    char path[] = "/tmp/placeindexXXXXXX";
+    const int fd = mkstemp( path );
+    if (fd < 0)
+    {
+        state.SkipWithError( "cannot create index file" );
+        return;
+    }
+    close( fd );
+    if (!RouteIndex().Save( path ))
+    {
+        unlink( path );
+        state.SkipWithError( "cannot save index" );
+        return;
+    }
+    CPlaceIndex mapped;
+    const uint64_t start = (uint64_t) std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch() ).count();
+    const bool opened = mapped.Open( path );
+    const uint64_t end = (uint64_t) std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch() ).count();
+    unlink( path );     // The mapping stays valid.
+    if (!opened)
+    {
+        state.SkipWithError( "cannot open index" );
+        return;
+    }
+    RunQueries( state, mapped, MakeQueries( c_keyframes ) );
+    state.SetCounter( "open_us", (end - start) / 1000.0 );
+}
+
+BENCH_CASE( place_add_keyframe )
+{
+    CPlaceIndex index;
+    TrainIndex( index );
+    std::vector<std::vector<uint8_t> > views( 64 );
+    for (size_t v = 0; v < views.size(); ++v)
+    {
+        View( v, 0, views[v] );
+    }
+    size_t v = 0;
+    while (state.KeepRunning())
+    {
+        const std::vector<uint8_t>& view = views[v++ % views.size()];
+        index.AddKeyframe( view.data(), Count( view ) );
+    }
+    state.SetItemsProcessed( state.Iterations() );
+}
+
+// Brute force and index on the same small route: every query descriptor is matched against
+// every keyframe descriptor, the keyframe with the most matches wins.
+struct SmallRoute
+{
+    CPlaceIndex index;
+    std::vector<std::vector<uint8_t> > keyframes;
+    std::vector<Query> queries;
+};
+
+static SmallRoute& BruteForceRoute()
+{
+    static SmallRoute route;
+    if (route.keyframes.empty())
+    {
+        TrainIndex( route.index );
+        route.keyframes.resize( c_bruteForceKeyframes );
+        for (uint32_t place = 0; place < c_bruteForceKeyframes; ++place)
+        {
+            View( place, 0, route.keyframes[place] );
+            route.index.AddKeyframe( route.keyframes[place].data(), Count( route.keyframes[place] ) );
+        }
+        route.queries = MakeQueries( c_bruteForceKeyframes );
+    }
+    return route;
+}
+
+static uint32_t BruteForceBest( const SmallRoute& route, const Query& query )
+{
+    uint32_t best = 0;
+    size_t bestMatches = 0;
+    const size_t count = Count( query.descriptors );
+    for (uint32_t k = 0; k < route.keyframes.size(); ++k)
+    {
+        const std::vector<uint8_t>& keyframe = route.keyframes[k];
+        const size_t keyframeCount = Count( keyframe );
+        size_t matches = 0;
+        for (size_t i = 0; i < count; ++i)
+        {
+            const uint8_t* pQuery = &query.descriptors[i * CPlaceIndex::c_descriptorBytes];
+            for (size_t j = 0; j < keyframeCount; ++j)
+            {
+                if (CPlaceIndex::Distance( pQuery, &keyframe[j * CPlaceIndex::c_descriptorBytes] ) < c_matchDistance)
+                {
+                    ++matches;
+                    break;
+                }
+            }
+        }
+        if (matches > bestMatches)
+        {
+            bestMatches = matches;
+            best = k;
+        }
+    }
+    return best;
+}
+
+BENCH_CASE( place_bruteforce_200 )
+{
+    const SmallRoute& route = BruteForceRoute();
+    uint64_t top1 = 0;
+    size_t q = 0;
+    while (state.KeepRunning())
+    {
+        const Query& query = route.queries[q++ % route.queries.size()];
+        top1 += BruteForceBest( route, query ) == query.place ? 1 : 0;
+    }
+    state.SetItemsProcessed( state.Iterations() );
+    state.SetCounter( "recall_at_1", (double) top1 / state.Iterations() );
+}
+
+BENCH_CASE( place_query_200 )
+{
+    SmallRoute& route = BruteForceRoute();
+    std::vector<CPlaceIndex::Match> matches;
+    uint64_t top1 = 0;
+    size_t q = 0;
+    while (state.KeepRunning())
+    {
+        const Query& query = route.queries[q++ % route.queries.size()];
+        route.index.Query( query.descriptors.data(), Count( query.descriptors ), 1, c_bruteForceKeyframes, matches );
+        top1 += !matches.empty() && matches[0].keyframe == query.place ? 1 : 0;
+    }
+    state.SetItemsProcessed( state.Iterations() );
+    state.SetCounter( "recall_at_1", (double) top1 / state.Iterations() );
+
+    // Outside the timed loop: brute force takes a good fraction of a second per query.
+    int agree = 0;
+    for (int i = 0; i < c_agreementQueries; ++i)
+    {
+        const Query& query = route.queries[i];
+        route.index.Query( query.descriptors.data(), Count( query.descriptors ), 1, c_bruteForceKeyframes, matches );
+        agree += !matches.empty() && matches[0].keyframe == BruteForceBest( route, query ) ? 1 : 0;
+    }
+    state.SetCounter( "agreement_with_bruteforce", (double) agree / c_agreementQueries );
+}
+
+static bool WriteFile( const char* path, const std::vector<char>& bytes )
+{
+    FILE* pFile = fopen( path, "wb" );
+    if (pFile == NULL)
+    {
+        return false;
+    }
+    const bool ok = fwrite( bytes.data(), 1, bytes.size(), pFile ) == bytes.size();
+    return fclose( pFile ) == 0 && ok;
+}
+
+template <class T>
+static void Patch( std::vector<char>& bytes, size_t at, T value )
+{
+    memcpy( &bytes[at], &value, sizeof( value ) );
+}
+
+// Open() of the 200-keyframe index, which checks the whole file; then damaged copies of it,
+// every one of which must be rejected. Header fields at their offsets in the file layout.
+BENCH_CASE( place_open_rejects_corrupt )
+{
+    char path[] = "/tmp/placeindexXXXXXX";
+    const int fd = mkstemp( path );
+    if (fd < 0)
+    {
+        state.SkipWithError( "cannot create index file" );
+        return;
+    }
+    close( fd );
+    std::vector<char> saved;
+    FILE* pFile = BruteForceRoute().index.Save( path ) ? fopen( path, "rb" ) : NULL;
+    if (pFile != NULL)
+    {
+        char chunk[65536];
+        size_t read;
+        while ((read = fread( chunk, 1, sizeof( chunk ), pFile )) > 0)
+        {
+            saved.insert( saved.end(), chunk, chunk + read );
+        }
+        fclose( pFile );
+    }
+    if (saved.size() < 64)
+    {
+        unlink( path );
+        state.SkipWithError( "cannot save index" );
+        return;
+    }
+    bool opened = true;
+    while (state.KeepRunning())
+    {
+        CPlaceIndex index;
+        opened = opened && index.Open( path );
+    }
+
+    uint32_t words, nodes;
+    uint64_t postings;
+    memcpy( &words, &saved[20], sizeof( words ) );
+    memcpy( &nodes, &saved[24], sizeof( nodes ) );
+    memcpy( &postings, &saved[32], sizeof( postings ) );
+    const size_t offsetsAt = 64 + (size_t) nodes * 32 + (((size_t) words * 4 + 7) & ~(size_t) 7);
+    std::vector<std::vector<char> > damaged( 6, saved );
+    damaged[0].resize( saved.size() - 8 );                          // Truncated.
+    Patch( damaged[1], 24, nodes + 1 );                             // Nodes do not match the tree.
+    Patch( damaged[2], 20, words * 2 );                             // Words do not match the tree.
+    Patch( damaged[3], 28, (uint32_t) 0 );                          // Every keyframe id out of range.
+    Patch( damaged[4], offsetsAt + 8, postings + 1 );               // Offsets not increasing.
+    Patch( damaged[5], offsetsAt + (size_t) words * 8, postings - 1 );  // Last offset is not the postings.
+    int accepted = 0;
+    for (size_t i = 0; i < damaged.size(); ++i)
+    {
+        CPlaceIndex index;
+        accepted += WriteFile( path, damaged[i] ) && index.Open( path ) ? 1 : 0;
+    }
+    unlink( path );
+    state.SetItemsProcessed( state.Iterations() );
+    state.SetCounter( "file_kb", saved.size() / 1024.0 );
+    state.SetCounter( "damaged_accepted", accepted );
+    if (!opened)
+    {
+        state.SkipWithError( "cannot open index" );
+    }
+    else if (accepted > 0)
+    {
+        state.SkipWithError( "a damaged index file was opened" );
+    }
+}
@@ -0,0 +1,88 @@
+// BenchRecovery.cpp
+// Camera recovery on pylon's camera emulator (built as bench_recovery, which links pylon).
+// Each iteration forces the removal path the grab loop takes: the watchdog's removal
+// callback, then Reconnect(), which destroys the device, finds the emulated camera again
+// by serial number, reopens it and reloads the cached configuration, and then the first
+// frame after StartGrabbing(). Samples are the removal-to-reconfigured time the watchdog
+// reports; the grab buffer pool must not allocate again after the first grab.
+// The emulator cannot unplug itself, so pylon's own removal detection is not part of it.
+#include "BenchHarness.h"
+
+#include <stdlib.h>
+#include <pylon/PylonIncludes.h>
+#include <pylon/BaslerUniversalInstantCamera.h>
+#include "../CameraWatchdog.h"
+
+using namespace Pylon;
+
+static const unsigned c_reconnectTimeoutMs = 10000;
+static const unsigned c_grabTimeoutMs = 5000;
+
+BENCH_CASE( recovery_emulated_removal )
+{
+    // Emulated devices are only enumerated with this set before pylon is initialized.
+    setenv( "PYLON_CAMEMU", "1", 0 );
+    PylonAutoInitTerm autoInitTerm;
+    try
+    {
+        CTlFactory& tlFactory = CTlFactory::GetInstance();
+        CDeviceInfo emulator;
+        emulator.SetDeviceClass( BaslerCamEmuDeviceClass );
+        DeviceInfoList_t filter;
+        filter.push_back( emulator );
+        DeviceInfoList_t devices;
+        if (tlFactory.EnumerateDevices( devices, filter ) == 0)
+        {
+            state.SkipWithError( "no emulated camera found (PYLON_CAMEMU)" );
+            return;
+        }
+
+        // Declared before the camera, as in Basler_CameraView.
+        CPooledBufferFactory bufferFactory;
+        CDeviceRemovalWatchdog watchdog;
+        CBaslerUniversalInstantCamera camera( tlFactory.CreateDevice( devices[0] ) );
+        camera.RegisterConfiguration( &watchdog, RegistrationMode_Append, Cleanup_None );
+        camera.SetBufferFactory( &bufferFactory, Cleanup_None );
+        camera.Open();
+        watchdog.CacheConfiguration( camera );
+
+        // The first grab fills the pool; recoveries should only reuse it.
+        CGrabResultPtr result;
+        camera.StartGrabbing( GrabStrategy_OneByOne );
+        camera.RetrieveResult( c_grabTimeoutMs, result, TimeoutHandling_ThrowException );
+        result.Release();
+        camera.StopGrabbing();
+        const size_t allocations = bufferFactory.Allocations();
+
+        double firstFrameMs = 0.0;
+        while (state.KeepRunning())
+        {
+            const std::chrono::steady_clock::time_point removed = std::chrono::steady_clock::now();
+            watchdog.OnCameraDeviceRemoved( camera );
+            if (!watchdog.Reconnect( camera, NULL, c_reconnectTimeoutMs ))
+            {
+                state.SkipWithError( "the emulated camera did not come back" );
+                break;
+            }
+            camera.StartGrabbing( GrabStrategy_OneByOne );
+            camera.RetrieveResult( c_grabTimeoutMs, result, TimeoutHandling_ThrowException );
+            firstFrameMs += std::chrono::duration<double, std::milli>( std::chrono::steady_clock::now() - removed ).count();
+            result.Release();
+            camera.StopGrabbing();
+            state.AddSample( (uint64_t) (watchdog.LastRecoveryMs() * 1e6) );
+        }
+        state.SetItemsProcessed( watchdog.Reconnects() );
+        state.SetCounter( "reconnects", watchdog.Reconnects() );
+        state.SetCounter( "removal_to_first_frame_ms_avg", watchdog.Reconnects() > 0 ? firstFrameMs / watchdog.Reconnects() : 0.0 );
+        state.SetCounter( "grab_buffers_allocated_after_first_grab", (double) (bufferFactory.Allocations() - allocations) );
+        state.SetCounter( "grab_buffer_reuses", (double) bufferFactory.Reuses() );
+        if (bufferFactory.Allocations() != allocations)
+        {
+            state.SkipWithError( "recovery reallocated grab buffers" );
+        }
+    }
+    catch (const GenericException& e)
+    {
+        state.SkipWithError( std::string( "pylon: " ) + e.GetDescription() );
+    }
+}
@@ -0,0 +1,29 @@
+# Writes BENCH_REVISION into OUTPUT on every build of the bench targets (see CMakeLists.txt),
+# so results are labelled with the commit that was built, not the one cmake was run on.
+# The file is only rewritten when the revision changed, so only BenchHarness.cpp recompiles.
+execute_process(COMMAND git rev-parse --short HEAD
+                WORKING_DIRECTORY ${SOURCE_DIR}
+                OUTPUT_VARIABLE revision
+                OUTPUT_STRIP_TRAILING_WHITESPACE
+                RESULT_VARIABLE failed
+                ERROR_QUIET)
+if(failed OR revision STREQUAL "")
+    set(revision "unknown")
+else()
+    # Uncommitted changes to tracked files: the numbers are not that commit's. The build
+    # tree in build/ (tracked, and rewritten by every build) does not count.
+    execute_process(COMMAND git diff-index --quiet HEAD -- . ":(exclude)build"
+                    WORKING_DIRECTORY ${SOURCE_DIR}
+                    RESULT_VARIABLE dirty
+                    ERROR_QUIET)
+    if(dirty)
+        set(revision "${revision}-dirty")
+    endif()
+endif()
+set(content "#define BENCH_REVISION \"${revision}\"\n")
+if(EXISTS ${OUTPUT})
+    file(READ ${OUTPUT} previous)
+endif()
+if(NOT content STREQUAL previous)
+    file(WRITE ${OUTPUT} "${content}")
+endif()
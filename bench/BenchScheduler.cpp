@@ -0,0 +1,232 @@
+// BenchScheduler.cpp
+// Per-frame processing of two cameras on three thread models: one thread per camera,
+// the work-stealing CTaskScheduler and Qt Concurrent. The cameras deliver different
+// resolutions, as the robot's do, so a fixed thread per camera leaves one core idle.
+#include "BenchHarness.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <QVector>
+#include <QtConcurrent/QtConcurrentMap>
+#include <opencv2/imgproc/imgproc.hpp>
+#include "../Pipeline.h"
+#include "../TaskScheduler.h"
+
+static const int c_cameras = 2;
+static const int c_stripRows = 32;
+
+struct BenchCameraFrame
+{
+    cv::Mat src;
+    cv::Mat dst;
+};
+
+// One frame per camera: the full-size gray frame and one at half resolution.
+static std::vector<BenchCameraFrame> CameraFrames()
+{
+    const cv::Mat& frame = BenchFrames()[0];
+    std::vector<BenchCameraFrame> cameras( c_cameras );
+    cv::cvtColor( frame, cameras[0].src, cv::COLOR_BGR2GRAY );
+    cv::resize( cameras[0].src, cameras[1].src, cv::Size(), 0.5, 0.5, cv::INTER_AREA );
+    for (int c = 0; c < c_cameras; ++c)
+    {
+        cameras[c].dst.create( cameras[c].src.size(), CV_8UC1 );
+    }
+    return cameras;
+}
+
+// 3x3 box filter followed by a threshold, in plain loops so OpenCV's own thread pool
+// does not take part in the comparison.
+static void FilterRows( const cv::Mat& src, cv::Mat& dst, int begin, int end )
+{
+    const int last = src.cols - 1;
+    for (int y = begin; y < end; ++y)
+    {
+        const uint8_t* above = src.ptr<uint8_t>( y > 0 ? y - 1 : y );
+        const uint8_t* row = src.ptr<uint8_t>( y );
+        const uint8_t* below = src.ptr<uint8_t>( y < src.rows - 1 ? y + 1 : y );
+        uint8_t* out = dst.ptr<uint8_t>( y );
+        for (int x = 0; x < src.cols; ++x)
+        {
+            const int l = x > 0 ? x - 1 : x;
+            const int r = x < last ? x + 1 : x;
+            const int sum = above[l] + above[x] + above[r] + row[l] + row[x] + row[r] + below[l] + below[x] + below[r];
+            out[x] = sum > 9 * 100 ? 255 : 0;
+        }
+    }
+}
+
+// Baseline: each camera has its own processing thread, as the grab threads did before the pipeline.
+BENCH_CASE( scheduler_thread_per_camera )
+{
+    std::vector<BenchCameraFrame> cameras = CameraFrames();
+    std::mutex mutex;
+    std::condition_variable cond;
+    uint64_t generation = 0;
+    int remaining = 0;
+    bool running = true;
+
+    std::vector<std::thread> threads;
+    std::vector<uint64_t> busyNs( c_cameras, 0 );
+    for (int c = 0; c < c_cameras; ++c)
+    {
+        threads.push_back( std::thread( [&, c]()
+        {
+            uint64_t seen = 0;
+            while (true)
+            {
+                {
+                    std::unique_lock<std::mutex> lock( mutex );
+                    while (running && generation == seen)
+                    {
+                        cond.wait( lock );
+                    }
+                    if (!running)
+                    {
+                        return;
+                    }
+                    seen = generation;
+                }
+                std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+                FilterRows( cameras[c].src, cameras[c].dst, 0, cameras[c].src.rows );
+                busyNs[c] += (uint64_t) std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now() - start ).count();
+                std::lock_guard<std::mutex> lock( mutex );
+                if (--remaining == 0)
+                {
+                    cond.notify_all();
+                }
+            }
+        } ) );
+    }
+
+    std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+    while (state.KeepRunning())
+    {
+        std::unique_lock<std::mutex> lock( mutex );
+        remaining = c_cameras;
+        ++generation;
+        cond.notify_all();
+        while (remaining > 0)
+        {
+            cond.wait( lock );
+        }
+    }
+    const double elapsedNs = (double) std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - begin ).count();
+    {
+        std::lock_guard<std::mutex> lock( mutex );
+        running = false;
+    }
+    cond.notify_all();
+    for (int c = 0; c < c_cameras; ++c)
+    {
+        threads[c].join();
+        state.SetCounter( "utilization_thread" + std::to_string( c ), busyNs[c] / elapsedNs );
+    }
+    state.SetItemsProcessed( state.Iterations() * c_cameras );
+}
+
+// Each camera's frame is one task that splits itself into strips; idle workers steal strips.
+BENCH_CASE( scheduler_work_stealing )
+{
+    std::vector<BenchCameraFrame> cameras = CameraFrames();
+    CTaskScheduler scheduler;
+    uint64_t sequence = 0;
+    while (state.KeepRunning())
+    {
+        CTaskGroup group;
+        for (int c = 0; c < c_cameras; ++c)
+        {
+            BenchCameraFrame* pCamera = &cameras[c];
+            const uint64_t priority = ++sequence;
+            scheduler.Submit( [&scheduler, pCamera, priority]()
+            {
+                scheduler.ParallelFor( 0, pCamera->src.rows, c_stripRows,
+                    [pCamera]( int begin, int end ) { FilterRows( pCamera->src, pCamera->dst, begin, end ); }, priority );
+            }, priority, &group );
+        }
+        group.Wait( scheduler );
+    }
+
+    std::vector<CTaskScheduler::WorkerStats> stats = scheduler.GetWorkerStats();
+    uint64_t stolen = 0;
+    for (size_t w = 0; w < stats.size(); ++w)
+    {
+        stolen += stats[w].tasksStolen;
+        state.SetCounter( "utilization_worker" + std::to_string( w ),
+                          stats[w].aliveNs > 0 ? (double) stats[w].busyNs / stats[w].aliveNs : 0.0 );
+    }
+    state.SetCounter( "workers", (double) stats.size() );
+    state.SetCounter( "tasks_stolen", (double) stolen );
+    state.SetItemsProcessed( state.Iterations() * c_cameras );
+}
+
+struct BenchStrip
+{
+    BenchCameraFrame* pCamera;
+    int begin;
+    int end;
+};
+
+static void FilterStrip( BenchStrip& strip )
+{
+    FilterRows( strip.pCamera->src, strip.pCamera->dst, strip.begin, strip.end );
+}
+
+// The same strips handed to Qt Concurrent's global pool.
+BENCH_CASE( scheduler_qt_concurrent )
+{
+    std::vector<BenchCameraFrame> cameras = CameraFrames();
+    QVector<BenchStrip> strips;
+    for (int c = 0; c < c_cameras; ++c)
+    {
+        for (int row = 0; row < cameras[c].src.rows; row += c_stripRows)
+        {
+            BenchStrip strip;
+            strip.pCamera = &cameras[c];
+            strip.begin = row;
+            strip.end = std::min( row + c_stripRows, cameras[c].src.rows );
+            strips.push_back( strip );
+        }
+    }
+    while (state.KeepRunning())
+    {
+        QtConcurrent::blockingMap( strips, FilterStrip );
+    }
+    state.SetCounter( "strips", (double) strips.size() );
+    state.SetItemsProcessed( state.Iterations() * c_cameras );
+}
+
+// pipeline_end_to_end on the work-stealing pool: the newest frame is processed first and
+// frames that fell more than queueSize behind are cancelled instead of processed late.
+BENCH_CASE( scheduler_pipeline_newest_wins )
+{
+    const std::vector<cv::Mat>& frames = BenchFrames();
+    PipelineConfig config;
+    StageConfig stage;
+    stage.type = "gray";
+    config.stages.push_back( stage );
+    stage.type = "threshold";
+    stage.threshold = 100;
+    config.stages.push_back( stage );
+    config.sinks.clear();
+    config.schedulerWorkers = 2;
+    CPipeline pipeline( config );
+    pipeline.Start();
+    size_t f = 0;
+    while (state.KeepRunning())
+    {
+        PipelineFrame frame;
+        frame.image = frames[f % frames.size()].clone();
+        frame.frameId = f++;
+        pipeline.Push( std::move( frame ) );
+    }
+    pipeline.Stop();
+    state.SetItemsProcessed( pipeline.Processed() );
+    state.SetCounter( "processed", (double) pipeline.Processed() );
+    state.SetCounter( "dropped", (double) pipeline.Dropped() );
+}
@@ -0,0 +1,255 @@
+// BenchStateEstimator.cpp
+// Cost of the EKF predict and update steps and the allocations they make (expected: none),
+// plus accuracy over a simulated drive with late camera poses.
+#include "BenchHarness.h"
+
+#include <algorithm>
+#include <cmath>
+#include <new>
+#include <stdlib.h>
+#include "../SimulatedMotionSource.h"
+#include "../StateEstimator.h"
+
+// Counts the heap allocations of a thread while an ekf case has counting on for it.
+// Per thread and without atomics, so that the other cases in the bench binary, which
+// allocate from many threads, only pay a thread-local flag test. Cases read the counter
+// around the calls they measure, so allocations by the harness itself are not included.
+static thread_local bool t_countAllocations = false;
+static thread_local uint64_t t_allocations = 0;
+
+// Counting on for the calling thread while in scope.
+struct CCountAllocations
+{
+    CCountAllocations() { t_countAllocations = true; }
+    ~CCountAllocations() { t_countAllocations = false; }
+};
+
+void* operator new( size_t size )
+{
+    if (t_countAllocations)
+    {
+        ++t_allocations;
+    }
+    void* p = malloc( size > 0 ? size : 1 );
+    if (p == NULL)
+    {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void* operator new[]( size_t size )
+{
+    return operator new( size );
+}
+
+void operator delete( void* p ) noexcept
+{
+    free( p );
+}
+
+void operator delete[]( void* p ) noexcept
+{
+    free( p );
+}
+
+static const uint64_t c_startTimestamp = 1000000000ull;
+
+// An estimator that has been running on the simulated drive for a few seconds.
+static CStateEstimator* WarmEstimator( CSimulatedMotionSource& source )
+{
+    CStateEstimator* pEstimator = new CStateEstimator;
+    Eigen::Vector3d position, velocity;
+    Eigen::Quaterniond orientation;
+    source.Truth( c_startTimestamp, position, velocity, orientation );
+    pEstimator->Reset( c_startTimestamp, position, velocity, orientation );
+    CSimulatedMotionSource::Event event;
+    for (int i = 0; i < 2000; ++i)
+    {
+        source.Next( event );
+        switch (event.kind)
+        {
+        case CSimulatedMotionSource::EventImu:
+            pEstimator->AddImu( event.imu );
+            break;
+        case CSimulatedMotionSource::EventWheel:
+            pEstimator->AddWheel( event.wheel );
+            break;
+        case CSimulatedMotionSource::EventPose:
+            pEstimator->AddPose( event.pose );
+            break;
+        }
+    }
+    return pEstimator;
+}
+
+BENCH_CASE( ekf_predict )
+{
+    CCountAllocations counting;
+    CSimulatedMotionSource source( c_startTimestamp );
+    CStateEstimator* pEstimator = WarmEstimator( source );
+    ImuSample sample;
+    sample.timestamp = pEstimator->Current().timestamp;
+    sample.accel = Eigen::Vector3d( 0.0, 0.45, 9.81 );
+    sample.gyro = Eigen::Vector3d( 0.0, 0.0, 0.3 );
+    uint64_t allocations = 0;
+    while (state.KeepRunning())
+    {
+        sample.timestamp += 2500000;
+        const uint64_t before = t_allocations;
+        pEstimator->AddImu( sample );
+        allocations += t_allocations - before;
+    }
+    state.SetCounter( "allocations_per_step", (double) allocations / state.Iterations() );
+    state.SetItemsProcessed( state.Iterations() );
+    delete pEstimator;
+}
+
+BENCH_CASE( ekf_wheel_update )
+{
+    CCountAllocations counting;
+    CSimulatedMotionSource source( c_startTimestamp );
+    CStateEstimator* pEstimator = WarmEstimator( source );
+    WheelSample sample;
+    sample.timestamp = pEstimator->Current().timestamp;
+    sample.speed = 1.5;
+    uint64_t allocations = 0;
+    while (state.KeepRunning())
+    {
+        const uint64_t before = t_allocations;
+        pEstimator->AddWheel( sample );
+        allocations += t_allocations - before;
+    }
+    state.SetCounter( "allocations_per_step", (double) allocations / state.Iterations() );
+    state.SetItemsProcessed( state.Iterations() );
+    delete pEstimator;
+}
+
+// A pose stamped with the current filter time: a plain update.
+BENCH_CASE( ekf_pose_update )
+{
+    CCountAllocations counting;
+    CSimulatedMotionSource source( c_startTimestamp );
+    CStateEstimator* pEstimator = WarmEstimator( source );
+    PoseMeasurement pose;
+    pose.timestamp = pEstimator->Current().timestamp;
+    pose.position = pEstimator->Current().position;
+    pose.orientation = pEstimator->Current().orientation;
+    pose.positionSigma = 0.02;
+    pose.orientationSigma = 0.005;
+    uint64_t allocations = 0;
+    while (state.KeepRunning())
+    {
+        const uint64_t before = t_allocations;
+        pEstimator->AddPose( pose );
+        allocations += t_allocations - before;
+    }
+    state.SetCounter( "allocations_per_step", (double) allocations / state.Iterations() );
+    state.SetItemsProcessed( state.Iterations() );
+    delete pEstimator;
+}
+
+// A pose arriving 40 ms after its grab timestamp: rewind, update and replay of the
+// 16 IMU and 4 wheel samples received in between.
+BENCH_CASE( ekf_pose_update_delayed )
+{
+    CCountAllocations counting;
+    CSimulatedMotionSource source( c_startTimestamp );
+    CStateEstimator* pEstimator = WarmEstimator( source );
+    uint64_t allocations = 0;
+    uint64_t replayed = pEstimator->Replayed();
+    uint64_t poses = 0;
+    CSimulatedMotionSource::Event event;
+    while (state.KeepRunning())
+    {
+        state.PauseTiming();
+        do
+        {
+            source.Next( event );
+            if (event.kind == CSimulatedMotionSource::EventImu)
+            {
+                pEstimator->AddImu( event.imu );
+            }
+            else if (event.kind == CSimulatedMotionSource::EventWheel)
+            {
+                pEstimator->AddWheel( event.wheel );
+            }
+        }
+        while (event.kind != CSimulatedMotionSource::EventPose);
+        state.ResumeTiming();
+
+        const uint64_t before = t_allocations;
+        pEstimator->AddPose( event.pose );
+        allocations += t_allocations - before;
+        ++poses;
+    }
+    state.SetCounter( "allocations_per_step", (double) allocations / state.Iterations() );
+    state.SetCounter( "replayed_per_pose", (double) (pEstimator->Replayed() - replayed) / poses );
+    state.SetItemsProcessed( state.Iterations() );
+    delete pEstimator;
+}
+
+// One minute of simulated driving per iteration; reports the position error against
+// ground truth at each pose update.
+BENCH_CASE( ekf_simulated_drive )
+{
+    CCountAllocations counting;
+    double sumSquared = 0.0;
+    double maxError = 0.0;
+    uint64_t samples = 0;
+    uint64_t events = 0;
+    uint64_t allocations = 0;
+    uint64_t outOfSequence = 0;
+    uint64_t rejected = 0;
+    while (state.KeepRunning())
+    {
+        state.PauseTiming();
+        CSimulatedMotionSource source( c_startTimestamp );
+        CStateEstimator* pEstimator = new CStateEstimator;
+        Eigen::Vector3d position, velocity;
+        Eigen::Quaterniond orientation;
+        source.Truth( c_startTimestamp, position, velocity, orientation );
+        pEstimator->Reset( c_startTimestamp, position, velocity, orientation );
+        state.ResumeTiming();
+
+        const uint64_t before = t_allocations;
+        CSimulatedMotionSource::Event event;
+        while (pEstimator->Current().timestamp < c_startTimestamp + 60000000000ull)
+        {
+            source.Next( event );
+            ++events;
+            switch (event.kind)
+            {
+            case CSimulatedMotionSource::EventImu:
+                pEstimator->AddImu( event.imu );
+                break;
+            case CSimulatedMotionSource::EventWheel:
+                pEstimator->AddWheel( event.wheel );
+                break;
+            case CSimulatedMotionSource::EventPose:
+            {
+                pEstimator->AddPose( event.pose );
+                source.Truth( pEstimator->Current().timestamp, position, velocity, orientation );
+                const double error = (pEstimator->Current().position - position).norm();
+                sumSquared += error * error;
+                maxError = std::max( maxError, error );
+                ++samples;
+                break;
+            }
+            }
+        }
+        allocations += t_allocations - before;
+        outOfSequence += pEstimator->OutOfSequence();
+        rejected += pEstimator->Rejected();
+
+        state.PauseTiming();
+        delete pEstimator;
+        state.ResumeTiming();
+    }
+    state.SetCounter( "position_rms_m", samples > 0 ? std::sqrt( sumSquared / samples ) : 0.0 );
+    state.SetCounter( "position_max_m", maxError );
+    state.SetCounter( "out_of_sequence", (double) outOfSequence );
+    state.SetCounter( "rejected", (double) rejected );
+    state.SetCounter( "allocations_per_step", events > 0 ? (double) allocations / events : 0.0 );
+    state.SetItemsProcessed( events );
+}
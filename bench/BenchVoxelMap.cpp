@@ -0,0 +1,102 @@
+// BenchVoxelMap.cpp
+// Map accumulation over a long replay: the depth sequence is inserted with the camera moving
+// forward 5 cm per frame, so old blocks fall behind and have to be evicted once the budget is
+// used up. Reports points inserted per second and the map's memory.
+#include "BenchHarness.h"
+
+#include <stdlib.h>
+#include <unistd.h>
+#include "../VoxelMap.h"
+
+static const float c_fx = 525.0f;
+static const float c_step = 0.05f;      // m of forward motion per frame.
+
+// Depth frames back-projected once with every second pixel, as the map would be fed.
+static const std::vector<std::vector<float> >& BenchClouds()
+{
+    static std::vector<std::vector<float> > clouds;
+    if (!clouds.empty())
+    {
+        return clouds;
+    }
+    const std::vector<cv::Mat>& frames = BenchDepthFrames();
+    clouds.resize( frames.size() );
+    for (size_t f = 0; f < frames.size(); ++f)
+    {
+        const cv::Mat& depth = frames[f];
+        const float cx = depth.cols * 0.5f;
+        const float cy = depth.rows * 0.5f;
+        for (int r = 0; r < depth.rows; r += 2)
+        {
+            const uint16_t* pRow = depth.ptr<uint16_t>( r );
+            for (int c = 0; c < depth.cols; c += 2)
+            {
+                if (pRow[c] == 0)
+                {
+                    continue;
+                }
+                const float z = pRow[c] * 0.001f;
+                clouds[f].push_back( (c - cx) * z / c_fx );
+                clouds[f].push_back( (r - cy) * z / c_fx );
+                clouds[f].push_back( z );
+            }
+        }
+    }
+    return clouds;
+}
+
+static void RunReplay( CBenchState& state, CVoxelMap& map, size_t budget )
+{
+    const std::vector<std::vector<float> >& clouds = BenchClouds();
+    size_t f = 0;
+    while (state.KeepRunning())
+    {
+        const std::vector<float>& cloud = clouds[f % clouds.size()];
+        Eigen::Affine3f pose = Eigen::Affine3f::Identity();
+        pose.translation() = Eigen::Vector3f( 0.0f, 0.0f, c_step * f );
+        map.Insert( cloud.data(), cloud.size() / 3, pose );
+        ++f;
+    }
+    state.SetItemsProcessed( map.PointsInserted() );
+    state.SetCounter( "frames", (double) f );
+    state.SetCounter( "budget_mb", map.MemoryBytes() / 1048576.0 );
+    state.SetCounter( "resident_mb", map.ResidentBytes() / 1048576.0 );
+    state.SetCounter( "block_capacity", (double) map.BlockCapacity() );
+    state.SetCounter( "peak_resident_blocks", (double) map.PeakResidentBlocks() );
+    state.SetCounter( "blocks_evicted", (double) map.BlocksEvicted() );
+    if (map.MemoryBytes() > budget)
+    {
+        state.SkipWithError( "the map reserved more than its memory budget" );
+    }
+}
+
+// Budget large enough that a short run never evicts.
+BENCH_CASE( voxelmap_insert_256mb )
+{
+    CVoxelMap::Config config;
+    config.memoryBudget = 256u << 20;
+    CVoxelMap map( config );
+    RunReplay( state, map, config.memoryBudget );
+}
+
+// Tight budget with evicted blocks streamed to a scratch file.
+BENCH_CASE( voxelmap_insert_16mb_export )
+{
+    char path[] = "/tmp/voxelmapXXXXXX";
+    const int fd = mkstemp( path );
+    if (fd < 0)
+    {
+        state.SkipWithError( "cannot create export file" );
+        return;
+    }
+    close( fd );
+
+    CVoxelMap::Config config;
+    config.memoryBudget = 16u << 20;
+    CVoxelMap map( config );
+    map.OpenExport( path );
+    RunReplay( state, map, config.memoryBudget );
+    map.CloseExport();
+    state.SetCounter( "exported_mb", map.BytesExported() / 1048576.0 );
+    unlink( path );
+}